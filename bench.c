@@ -0,0 +1,333 @@
+/*
+** Benchmark driver for the SQLEXEC extension. Loads the extension given on
+** the command line into an in-memory database and times queries which go
+** through the virtual table cursor path, so we can spot regressions. The
+** partitioned scans need a database file, which is made in the current
+** directory and deleted afterwards.
+**
+** The results are written to stdout as a JSON object, with the SQLite
+** version and an array of the cases, each with its average time per query
+** and per row, so they can be kept and compared from one build to the
+** next. Most cases come in pairs: the query through a sqlexec table and
+** the same query done directly, the difference being the cost of the
+** virtual table layer.
+**
+** Usage: sqlexec_bench ./sqlexec.so
+*/
+#include <sqlite3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OUTER_ROWS 10000
+#define BENCH_REPEAT 10
+#define BENCH_FULL_ROWS 100000
+#define BENCH_WIDE_ROWS 2000
+#define BENCH_WIDE_TEXT 1000
+#define BENCH_WIDE_BLOB 4000
+#define BENCH_PRAGMA_TABLES 200
+#define BENCH_SCAN_ROWS 200000
+#define BENCH_MAX_PARTITION 16
+#define BENCH_DB "sqlexec_bench.db"
+
+/*
+** Returns current time in nanoseconds from a monotonic clock.
+*/
+static double benchNow(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+** Execute SQL which returns no results, exiting on error.
+*/
+static void benchExec(sqlite3 *db, const char *sql){
+  char *zErr = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &zErr) != SQLITE_OK) {
+    fprintf(stderr, "Error executing: %s; reason: %s\n", sql, zErr);
+    exit(1);
+  }
+}
+
+/* Number of results written so far, to separate them with commas */
+static int nBenchResult = 0;
+
+/*
+** Run a query returning a single integer BENCH_REPEAT times, and report the
+** average time per run and per row of the nRow it goes through. Exits if
+** the query fails or doesn't return the expected result.
+*/
+static void benchQuery(
+  sqlite3 *db,
+  const char *name,
+  const char *sql,
+  sqlite3_int64 expected,
+  int nRow
+){
+  sqlite3_stmt *pStmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Error preparing: %s; reason: %s\n", sql,
+            sqlite3_errmsg(db));
+    exit(1);
+  }
+  double start = benchNow();
+  for (int i = 0; i < BENCH_REPEAT; i++) {
+    if (sqlite3_step(pStmt) != SQLITE_ROW) {
+      fprintf(stderr, "Error running: %s; reason: %s\n", sql,
+              sqlite3_errmsg(db));
+      exit(1);
+    }
+    sqlite3_int64 result = sqlite3_column_int64(pStmt, 0);
+    if (result != expected) {
+      fprintf(stderr, "%s: expected %lld, got %lld\n", name,
+              (long long)expected, (long long)result);
+      exit(1);
+    }
+    sqlite3_reset(pStmt);
+  }
+  double elapsed = (benchNow() - start) / BENCH_REPEAT;
+  sqlite3_finalize(pStmt);
+  printf("%s\n    {\"name\": \"%s\", \"rows\": %d, \"ms_per_query\": %.3f,"
+         " \"ns_per_row\": %.1f}", nBenchResult++ ? "," : "", name, nRow,
+         elapsed / 1e6, elapsed / nRow);
+  fflush(stdout);
+}
+
+/*
+** Run a query returning a single integer and return it, exiting on error.
+*/
+static sqlite3_int64 benchScalar(sqlite3 *db, const char *sql){
+  sqlite3_stmt *pStmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL) != SQLITE_OK
+      || sqlite3_step(pStmt) != SQLITE_ROW) {
+    fprintf(stderr, "Error running: %s; reason: %s\n", sql,
+            sqlite3_errmsg(db));
+    exit(1);
+  }
+  sqlite3_int64 result = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return result;
+}
+
+/*
+** Open database zFile and load the extension into it, exiting on error.
+*/
+static sqlite3 *benchOpen(const char *zFile, const char *zExtension){
+  sqlite3 *db;
+  char *zErr = NULL;
+  if (sqlite3_open(zFile, &db) != SQLITE_OK) {
+    fprintf(stderr, "Error opening database %s\n", zFile);
+    exit(1);
+  }
+  sqlite3_enable_load_extension(db, 1);
+  if (sqlite3_load_extension(db, zExtension, NULL, &zErr) != SQLITE_OK) {
+    fprintf(stderr, "Error loading %s: %s\n", zExtension, zErr);
+    exit(1);
+  }
+  return db;
+}
+
+/*
+** Scan a table of BENCH_SCAN_ROWS rows through SQL which is costly per row,
+** directly and divided into 1, 2, 4, ... BENCH_MAX_PARTITION slices with
+** the partition option, to measure how the scan scales with the number of
+** cores. The database is in rollback journal mode, where the slices can
+** share our connection's snapshot; in WAL mode that needs an explicit
+** transaction and SQLITE_ENABLE_SNAPSHOT.
+*/
+static void benchPartition(const char *zExtension){
+  unlink(BENCH_DB);
+  sqlite3 *db = benchOpen(BENCH_DB, zExtension);
+  char *sql = sqlite3_mprintf(
+    "create table scan_t(x integer primary key, y text);"
+    "insert into scan_t with recursive n(x) as"
+    "  (select 1 union all select x + 1 from n where x < %d)"
+    "  select x, printf('%%08x', x * 2654435761 %% 4294967296) from n;",
+    BENCH_SCAN_ROWS);
+  benchExec(db, sql);
+  sqlite3_free(sql);
+  const char *zScan =
+    "select x, y from scan_t where y glob '*[0-3]*[4-7]*[89ab]*' or x % 5 = 0";
+  sql = sqlite3_mprintf("select count(*) from (%s)", zScan);
+  sqlite3_int64 nRow = benchScalar(db, sql);
+  benchQuery(db, "scan_direct", sql, nRow, BENCH_SCAN_ROWS);
+  sqlite3_free(sql);
+
+  for (int nPart = 1; nPart <= BENCH_MAX_PARTITION; nPart *= 2) {
+    char zName[32];
+    snprintf(zName, sizeof(zName), "scan_partition_%d", nPart);
+    sql = sqlite3_mprintf("create virtual table %s"
+                          "  using sqlexec((%s), partition=(x, %d))",
+                          zName, zScan, nPart);
+    benchExec(db, sql);
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("select count(*) from %s", zName);
+    benchQuery(db, zName, sql, nRow, BENCH_SCAN_ROWS);
+    sqlite3_free(sql);
+  }
+
+  sqlite3_close(db);
+  unlink(BENCH_DB);
+}
+
+/*
+** Scan BENCH_FULL_ROWS rows through a sqlexec table, with and without the
+** block option, and directly. The query uses both columns so that neither
+** is left out of the SQL.
+*/
+static void benchFullScan(sqlite3 *db){
+  char *sql = sqlite3_mprintf(
+    "create table full_t(x integer primary key, y text);"
+    "insert into full_t with recursive n(x) as"
+    "  (select 1 union all select x + 1 from n where x < %d)"
+    "  select x, 'row ' || x from n;"
+    "create virtual table full_v using sqlexec((select x, y from full_t));"
+    "create virtual table full_b using sqlexec((select x, y from full_t),"
+    "  block);",
+    BENCH_FULL_ROWS);
+  benchExec(db, sql);
+  sqlite3_free(sql);
+  sqlite3_int64 nSum = benchScalar(db,
+                                   "select sum(x + length(y)) from full_t");
+  benchQuery(db, "scan_direct_full",
+             "select sum(x + length(y)) from full_t", nSum, BENCH_FULL_ROWS);
+  benchQuery(db, "scan_sqlexec_full",
+             "select sum(x + length(y)) from full_v", nSum, BENCH_FULL_ROWS);
+  benchQuery(db, "scan_sqlexec_block",
+             "select sum(x + length(y)) from full_b", nSum, BENCH_FULL_ROWS);
+}
+
+/*
+** Read rows with a BENCH_WIDE_TEXT character string and a BENCH_WIDE_BLOB
+** byte blob, through a sqlexec table and directly, for the cost of
+** copying large values out of the cursor.
+*/
+static void benchWide(sqlite3 *db){
+  char *sql = sqlite3_mprintf(
+    "create table wide_t(x integer primary key, t text, b blob);"
+    "insert into wide_t with recursive n(x) as"
+    "  (select 1 union all select x + 1 from n where x < %d)"
+    "  select x, printf('%%.*c', %d, 'a'), randomblob(%d) from n;"
+    "create virtual table wide_v using sqlexec((select t, b from wide_t));",
+    BENCH_WIDE_ROWS, BENCH_WIDE_TEXT, BENCH_WIDE_BLOB);
+  benchExec(db, sql);
+  sqlite3_free(sql);
+  /* substr() makes SQLite fetch each value, where length() might not */
+  const char *zQuery =
+    "select sum(length(substr(t, -1)) + length(substr(b, -1))) from %s";
+  sqlite3_int64 nSum = BENCH_WIDE_ROWS * 2;
+  sql = sqlite3_mprintf(zQuery, "wide_t");
+  benchQuery(db, "wide_direct", sql, nSum, BENCH_WIDE_ROWS);
+  sqlite3_free(sql);
+  sql = sqlite3_mprintf(zQuery, "wide_v");
+  benchQuery(db, "wide_sqlexec", sql, nSum, BENCH_WIDE_ROWS);
+  sqlite3_free(sql);
+}
+
+/*
+** Run PRAGMA table_info and index_list over BENCH_PRAGMA_TABLES tables of
+** three columns and one index, through sqlexec tables and with the pragma
+** table-valued functions built into SQLite.
+*/
+static void benchPragma(sqlite3 *db){
+  benchExec(db, "create virtual table table_info_v"
+                "  using sqlexec(pragma table_info(?1))");
+  benchExec(db, "create virtual table index_list_v"
+                "  using sqlexec(pragma index_list(?1))");
+  for (int i = 0; i < BENCH_PRAGMA_TABLES; i++) {
+    char *sql = sqlite3_mprintf("create table pragma_t%d(a, b, c);"
+                                "create index pragma_i%d on pragma_t%d(a)",
+                                i, i, i);
+    benchExec(db, sql);
+    sqlite3_free(sql);
+  }
+  benchQuery(db, "pragma_direct",
+             "select count(*) from sqlite_master m, pragma_table_info(m.name) p"
+             " where m.name like 'pragma_t%'",
+             3 * BENCH_PRAGMA_TABLES, BENCH_PRAGMA_TABLES);
+  benchQuery(db, "pragma_sqlexec",
+             "select count(*) from sqlite_master m, table_info_v p"
+             " where m.name like 'pragma_t%' and p.arg = m.name",
+             3 * BENCH_PRAGMA_TABLES, BENCH_PRAGMA_TABLES);
+  benchQuery(db, "index_list_direct",
+             "select count(*) from sqlite_master m, pragma_index_list(m.name) p"
+             " where m.name like 'pragma_t%'",
+             BENCH_PRAGMA_TABLES, BENCH_PRAGMA_TABLES);
+  benchQuery(db, "index_list_sqlexec",
+             "select count(*) from sqlite_master m, index_list_v p"
+             " where m.name like 'pragma_t%' and p.arg = m.name",
+             BENCH_PRAGMA_TABLES, BENCH_PRAGMA_TABLES);
+}
+
+int main(int argc, char **argv){
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s EXTENSION\n", argv[0]);
+    return 1;
+  }
+  sqlite3 *db = benchOpen(":memory:", argv[1]);
+  printf("{\n  \"sqlite_version\": \"%s\",\n  \"repeat\": %d,\n"
+         "  \"results\": [", sqlite3_libversion(), BENCH_REPEAT);
+
+  char *sql = sqlite3_mprintf(
+    "create table outer_t(x integer primary key);"
+    "insert into outer_t with recursive n(x) as"
+    "  (select 1 union all select x + 1 from n where x < %d)"
+    "  select x from n;"
+    "create table inner_t(x integer primary key, y text);"
+    "insert into inner_t select x, 'row ' || x from outer_t;"
+    "create virtual table inner_v"
+    "  using sqlexec((select y from inner_t where x = ?1));"
+    "create virtual table small_v"
+    "  using sqlexec((select x from inner_t where x <= 3));"
+    "create virtual table all_v"
+    "  using sqlexec((select x, y from inner_t));",
+    BENCH_OUTER_ROWS);
+  benchExec(db, sql);
+  sqlite3_free(sql);
+
+  benchFullScan(db);
+
+  /*
+  ** 10k-row outer loop joined to a sqlexec table: one parameterised scan
+  ** per outer row, against the same join done directly.
+  */
+  benchQuery(db, "join_direct",
+             "select count(*) from outer_t o, inner_t i where i.x = o.x",
+             BENCH_OUTER_ROWS, BENCH_OUTER_ROWS);
+  benchQuery(db, "join_sqlexec_param",
+             "select count(*) from outer_t o, inner_v v where v.arg = o.x",
+             BENCH_OUTER_ROWS, BENCH_OUTER_ROWS);
+
+  /*
+  ** 10k-row outer loop rescanning a small sqlexec table on every row.
+  */
+  benchQuery(db, "join_sqlexec_rescan",
+             "select count(*) from outer_t o cross join small_v s"
+             " where s.x <= o.x + 2",
+             3 * BENCH_OUTER_ROWS, BENCH_OUTER_ROWS);
+
+  /*
+  ** 10k-row outer loop joined to a sqlexec table on either of two terms,
+  ** giving a scan for each term with the WHERE pushed into the SQL. The
+  ** terms pick the same row for even x, which must come back only once.
+  */
+  benchQuery(db, "join_direct_or",
+             "select count(*) from outer_t o, inner_t i"
+             " where i.x = o.x or i.x = o.x - o.x % 2",
+             3 * BENCH_OUTER_ROWS / 2 - 1, BENCH_OUTER_ROWS);
+  benchQuery(db, "join_sqlexec_or",
+             "select count(*) from outer_t o, all_v v"
+             " where v.x = o.x or v.x = o.x - o.x % 2",
+             3 * BENCH_OUTER_ROWS / 2 - 1, BENCH_OUTER_ROWS);
+
+  benchWide(db);
+  benchPragma(db);
+  sqlite3_close(db);
+
+  benchPartition(argv[1]);
+  printf("\n  ]\n}\n");
+  return 0;
+}
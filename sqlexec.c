@@ -12,390 +12,7329 @@
 ** sqlite> select * from pragma_database_list;
 ** seq|name|file
 ** 0|main|
+**
+** Parameters in the SQL (?1, :name, etc.) become HIDDEN columns of the
+** virtual table. Equality constraints on those columns are bound to the
+** parameters, so the table can be used like a table-valued function:
+**
+** sqlite> create virtual table ti
+**    ...> using sqlexec(select * from pragma_table_info(?1));
+** sqlite> select * from ti('sqlite_master');
+**
+** PRAGMA statements do not accept parameters, so for those we substitute
+** the constrained values into the statement text as SQL literals:
+**
+** sqlite> create virtual table ti using sqlexec(pragma table_info(?1));
+** sqlite> select t.name, ti.name from sqlite_master t, ti
+**    ...>  where ti.arg = t.name;
 */
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
+#ifdef SQLITE_CORE
+# include "sqlexec.h"
+#endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#ifndef SQLEXEC_OMIT_PREFETCH
+# include <pthread.h>
+# include <stdatomic.h>
+# ifdef _WIN32
+#  include <io.h>
+#  define sqlexecWrite _write
+# else
+#  include <unistd.h>
+#  define sqlexecWrite write
+# endif
+#endif
+#include <time.h>
+#include <sys/stat.h>
+#if defined(_WIN32) && !defined(SQLEXEC_OMIT_SNAPSHOT)
+# define SQLEXEC_OMIT_SNAPSHOT 1
+#endif
+#ifndef SQLEXEC_OMIT_SNAPSHOT
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <stdio.h>
+#endif
+
+/*
+** Maximum number of parameters whose hidden columns we can accept
+** constraints for. The set of constrained parameters is passed from
+** xBestIndex to xFilter as a bitmask in idxNum.
+*/
+#define SQLEXEC_MAX_PARAM 31
+
+/*
+** Set in idxNum as well if the scan returns only some of the rows of the
+** SQL, because of a WHERE or LIMIT in the rewrite of it.
+*/
+#define SQLEXEC_IDX_SUBSET INT_MIN
+
+/*
+** Maximum number of idle prepared statements each virtual table keeps for
+** reuse by later cursors. Statements beyond this are finalized.
+*/
+#ifndef SQLEXEC_POOL_SIZE
+# define SQLEXEC_POOL_SIZE 4
+#endif
+
+/*
+** Maximum number of schemas kept in the schema cache shared by all the
+** connections of the process (see sqlexecSharedGet).
+*/
+#ifndef SQLEXEC_SHARED_SCHEMAS
+# define SQLEXEC_SHARED_SCHEMAS 256
+#endif
+
+/*
+** Maximum number of closed cursors each virtual table keeps for reuse by
+** xOpen (see sqlexecCursorNew).
+*/
+#ifndef SQLEXEC_IDLE_CURSORS
+# define SQLEXEC_IDLE_CURSORS 4
+#endif
+
+/*
+** Maximum number of rewritten versions of its SQL (see sqlexecBestIndex)
+** each virtual table keeps statement pools for. The least recently used
+** pool which no cursor is using is thrown away to make room for a new one.
+*/
+#ifndef SQLEXEC_MAX_VARIANT
+# define SQLEXEC_MAX_VARIANT 16
+#endif
+
+/*
+** Byte budget of the result cache of a table over one of the catalog
+** PRAGMAs (see sqlexecIsCatalog) when the cache option doesn't give one.
+*/
+#ifndef SQLEXEC_CATALOG_CACHE
+# define SQLEXEC_CATALOG_CACHE 262144
+#endif
+
+/*
+** Most bytes of the record of the databases of the connection which the
+** results of catalog PRAGMAs are cached against (see sqlexecCatalogSig).
+** With more databases than fit, the results only last one statement.
+*/
+#define SQLEXEC_CATALOG_SIG 256
+
+/*
+** Most rows the prefetch worker (see sqlexec_prefetch) puts in each batch
+** it hands over to the cursor.
+*/
+#ifndef SQLEXEC_PREFETCH_BATCH
+# define SQLEXEC_PREFETCH_BATCH 64
+#endif
+
+/*
+** Virtual machine instructions between the checks a prefetch worker makes
+** of the max_steps and timeout_ms options (see sqlexecPrefetchProgress).
+*/
+#ifndef SQLEXEC_PROGRESS_OPS
+# define SQLEXEC_PROGRESS_OPS 1000
+#endif
+
+/*
+** Rows the block option (see sqlexecBlockFill) reads into each block when
+** it is given no number.
+*/
+#ifndef SQLEXEC_BLOCK_ROWS
+# define SQLEXEC_BLOCK_ROWS 256
+#endif
+
+/*
+** Most slices the partition option can divide a scan into, and so most
+** worker connections a cursor can have.
+*/
+#ifndef SQLEXEC_MAX_PARTITION
+# define SQLEXEC_MAX_PARTITION 64
+#endif
+
+/*
+** Name of the common table expression rewritten SQL reads the results of
+** the original SQL from. Its columns are called c0, c1, etc.
+*/
+#define SQLEXEC_SRC "sqlexec_src"
+
+/*
+** Name a slice of a partitioned scan gives the common table expression of
+** the original SQL, so that it can define SQLEXEC_SRC as the rows of the
+** slice (see sqlexecSliceSql).
+*/
+#define SQLEXEC_ALL "sqlexec_all"
+
+/*
+** The statements run for writes to a virtual table (see sqlexecUpdate), as
+** indexes into azWrite of sqlexec_options and of sqlexec_vtab.
+*/
+#define SQLEXEC_WRITE_INSERT 0
+#define SQLEXEC_WRITE_UPDATE 1
+#define SQLEXEC_WRITE_DELETE 2
+
+/*
+** What a write statement does about a row breaking a constraint: what its
+** SQL says, or what an OR IGNORE or OR REPLACE clause on the statement
+** writing to the virtual table asks for (see sqlexecWriteStmt). Indexes
+** into the rows of apWrite of sqlexec_vtab.
+*/
+#define SQLEXEC_CONFLICT_ASIS 0
+#define SQLEXEC_CONFLICT_IGNORE 1
+#define SQLEXEC_CONFLICT_REPLACE 2
+#define SQLEXEC_CONFLICT_MODES 3
+
+/*
+** Records where a parameter token appears in the text of a PRAGMA
+** statement, so that xFilter can replace it with the bound value.
+*/
+typedef struct sqlexec_subst sqlexec_subst;
+struct sqlexec_subst {
+  int iOfst;    /* Byte offset of the parameter token in the SQL */
+  int nByte;    /* Length of the parameter token in bytes */
+  int iParam;   /* Parameter number, starting from 1 */
+};
+
+/*
+** Options which can follow the SQL in the USING clause, for example:
+**
+**   create virtual table v using sqlexec(pragma compile_options, materialize);
+*/
+typedef struct sqlexec_options sqlexec_options;
+struct sqlexec_options {
+  const char *zOrder; /* Value of order option, only during xConnect */
+  const char *zPartition; /* Value of partition option, ditto */
+  const char *zKey;   /* Value of key option, ditto */
+  const char *azWrite[3]; /* insert, update and delete options, ditto */
+  const char *zSnapshot; /* Value of snapshot option, ditto */
+  int bMaterialize;   /* Copy the result set into memory and reuse it */
+  int bTransaction;   /* Keep cached results for the whole transaction */
+  sqlite3_int64 nCacheSize; /* Byte budget of the result cache, 0 for none,
+                            ** or -1 until xConnect picks the default */
+  sqlite3_int64 nRowsHint;  /* Expected rows in a full scan, -1 if unknown */
+  int bUnique;        /* Binding all parameters gives at most one row */
+  sqlite3_int64 nPrefetch;  /* Rows the prefetch worker may run ahead by */
+  int nBlock;         /* Rows to read from the statement at once, or 0 */
+  sqlite3_int64 nMaxSteps;  /* VM steps a statement may take, 0 for any */
+  sqlite3_int64 nTimeout;   /* Milliseconds a scan may take, 0 for any */
+};
+
+/*
+** One term of the order the SQL returns its rows in, from the order option.
+*/
+typedef struct sqlexec_order sqlexec_order;
+struct sqlexec_order {
+  int iCol;     /* Column number */
+  int bDesc;    /* True for descending order */
+};
+
+/*
+** What xConnect learns about a virtual table by preparing its SQL. It is
+** kept in a table of the database (see sqlexecSchemaSave) so that later
+** connections can declare the virtual table without preparing the SQL.
+*/
+typedef struct sqlexec_schema sqlexec_schema;
+struct sqlexec_schema {
+  char *zDecl;            /* CREATE TABLE statement to declare */
+  int nCol;               /* Number of columns returned by the SQL */
+  int nParam;             /* Number of parameters in the SQL */
+  char *aClass;           /* Affinity of each column (sqlexecAffinityClass) */
+  int nOrder;             /* Number of entries in aOrder */
+  sqlexec_order *aOrder;  /* Order of rows, from the order option */
+  int iPartCol;           /* Column of the partition option */
+  int nPart;              /* Number of slices, 0 without partition */
+  int bSrc;               /* True if the SQL can be rewritten */
+};
+
+/*
+** An entry of the schema cache shared by all the connections of the
+** process. zKey holds the name of the database file, the name of the
+** virtual table and the arguments of its USING clause, separated by NULs.
+*/
+typedef struct sqlexec_shared sqlexec_shared;
+struct sqlexec_shared {
+  char *zKey;             /* File, table and USING clause */
+  int nKey;               /* Bytes of zKey */
+  unsigned int iHash;     /* Hash of zKey */
+  sqlite3_int64 iDev;     /* Device of the database file */
+  sqlite3_int64 iIno;     /* Inode of the database file */
+  int iCookie;            /* Schema cookie of the database for schema */
+  sqlexec_schema schema;  /* What the SQL returns */
+  sqlexec_shared *pNext;  /* Next entry, less recently used */
+};
+
+/*
+** A pool of idle prepared statements for one piece of SQL: the SQL of a
+** virtual table, or a rewritten version of it. nRef counts the cursors
+** holding a statement from the pool, which will give it back, so the pool
+** must not be freed while any do.
+*/
+typedef struct sqlexec_pool sqlexec_pool;
+struct sqlexec_pool {
+  char *zSql;             /* The SQL */
+  int nRef;               /* Number of cursors using a statement from here */
+  int nStmt;              /* Number of statements in apStmt */
+  sqlite3_stmt *apStmt[SQLEXEC_POOL_SIZE]; /* The idle statements */
+  sqlexec_pool *pNext;    /* Next pool of the same virtual table */
+};
+
+/*
+** A result set copied out of a statement, stored by column so that each
+** column is an array of values of the same kind. For row iRow of column
+** iCol, the datatype is aType[iCol*nRowAlloc+iRow] and the value is in
+** aCell[iCol*nRowAlloc+iRow]. For TEXT and BLOB values the cell holds the
+** offset of the content in aHeap and anByte holds its size. aCell, anByte
+** and aType all live in one allocation.
+**
+** Cursors reading a rowset hold a reference to it, so it is not freed
+** while still in use, even once the virtual table has dropped it.
+**
+** Each TEXT or BLOB value in aHeap is preceded by a pointer back to the
+** rowset, aligned to SQLEXEC_HEAP_ALIGN. That lets us hand the content to
+** SQLite without copying it: the value holds a reference to the rowset,
+** which its destructor finds through the pointer and drops. A rowset is
+** never appended to once a cursor reads from it, so aHeap doesn't move
+** under values SQLite still holds.
+**
+** A rowset loaded from a snapshot file (see sqlexecSnapshotLoad) has its
+** arrays in the mapping of the file at pMap, with nRowAlloc equal to nRow,
+** and no pointers back to it in aHeap, so its TEXT and BLOB values are
+** copied when handed out.
+*/
+#define SQLEXEC_HEAP_ALIGN ((sqlite3_int64)sizeof(sqlexec_rowset*))
+
+typedef union sqlexec_cell sqlexec_cell;
+union sqlexec_cell {
+  sqlite3_int64 i;        /* SQLITE_INTEGER value, or offset into aHeap */
+  double r;               /* SQLITE_FLOAT value */
+};
+
+typedef struct sqlexec_rowset sqlexec_rowset;
+struct sqlexec_rowset {
+  int nRef;               /* Number of references to this object */
+  int nCol;               /* Number of columns */
+  int nRow;               /* Number of rows stored */
+  int nRowAlloc;          /* Number of rows there is space for */
+  sqlexec_cell *aCell;    /* Values, nRowAlloc per column */
+  int *anByte;            /* Sizes of TEXT and BLOB values */
+  unsigned char *aType;   /* Datatypes (SQLITE_INTEGER etc.) */
+  char *aHeap;            /* Content of TEXT and BLOB values */
+  sqlite3_int64 nHeap;    /* Bytes of aHeap in use */
+  sqlite3_int64 nHeapAlloc; /* Bytes allocated for aHeap */
+  void *pMap;             /* Mapping of a snapshot file holding it, or NULL */
+  sqlite3_int64 nMap;     /* Bytes mapped at pMap */
+};
+
+/*
+** With the prefetch option, a cursor gets a worker: a thread with a
+** read-only connection of its own to the same database files, which runs
+** the SQL and hands the rows over in batches. The rows are fetched on one
+** core while the query reading them runs on another. With the partition
+** option, a cursor gets a worker for each slice of the rows.
+**
+** The batches are rowsets, passed through apSlot, a ring of nSlot entries.
+** The worker fills slot iTail % nSlot and then advances iTail, and the
+** cursor takes slot iHead % nSlot and then advances iHead, so neither side
+** takes a lock unless the ring is full or empty. When it is full the
+** worker sets bWorkerWait and waits on condWorker for the cursor to signal
+** it. When the cursor has nothing to take, it waits on the condition
+** variable of its sqlexec_merge, which the workers signal after moving
+** their indexes or finishing a scan.
+**
+** eJob tells the worker to run pStmt, wait, or exit. It is only changed
+** with mutex held, but the cursor reads it without. When the worker has
+** run a scan it sets rc and zErr, and eJob back to SQLEXEC_JOB_IDLE.
+** bCancel asks it to stop a scan early. bDrained belongs to the cursor,
+** which sets it once it has taken all the rows of the scan.
+**
+** A virtual table keeps the workers no cursor is using, on a list through
+** pNext, for the next cursor. zSig holds the ATTACH statements the worker's
+** connection was set up with, so we can tell if it still has the same
+** databases open as ours.
+*/
+#define SQLEXEC_JOB_IDLE 0        /* Waiting for a scan */
+#define SQLEXEC_JOB_RUN  1        /* Running a scan */
+#define SQLEXEC_JOB_QUIT 2        /* Exiting */
+
+typedef struct sqlexec_prefetch sqlexec_prefetch;
+typedef struct sqlexec_merge sqlexec_merge;
+typedef struct sqlexec_cursor sqlexec_cursor;
+typedef struct sqlexec_env sqlexec_env;
+#ifndef SQLEXEC_OMIT_PREFETCH
+struct sqlexec_prefetch {
+  sqlite3 *db;                  /* The worker's connection */
+  char *zSig;                   /* ATTACH statements run on db */
+  pthread_t thread;             /* The worker */
+  int bThread;                  /* True once thread is started */
+  pthread_mutex_t mutex;
+  pthread_cond_t condWorker;    /* The worker waits on this */
+  atomic_int eJob;              /* SQLEXEC_JOB_IDLE, _RUN or _QUIT */
+  int rc;                       /* Result of the last scan */
+  char *zErr;                   /* Error message of the last scan, or NULL */
+  sqlite3_stmt *pStmt;          /* Statement the worker runs */
+  char *zSql;                   /* SQL of pStmt */
+  sqlexec_merge *pMerge;        /* Cursor the worker is running a scan for */
+  int nCol;                     /* Number of columns of each batch */
+  int nBatch;                   /* Most rows in a batch */
+  int nSlot;                    /* Number of entries in apSlot */
+  sqlexec_rowset **apSlot;      /* Ring of batches */
+  atomic_uint iHead;            /* Slot the cursor takes next */
+  atomic_uint iTail;            /* Slot the worker fills next */
+  atomic_int bWorkerWait;       /* True while the worker waits for room */
+  atomic_int bCancel;           /* True to stop the scan */
+  int bDrained;                 /* True once the cursor has all the rows */
+  const char *zOver;            /* Limit the scan went over, or NULL */
+  sqlexec_prefetch *pNext;      /* Next idle worker of the virtual table */
+};
+
+/*
+** The prefetch workers of a cursor. The cursor takes batches from them as
+** they come (round-robin, starting with iNext), or if bOrdered is set it
+** takes all of the batches of each worker in turn, so that the rows come
+** out in the order of the slices. bWait is set while the cursor waits on
+** cond for a worker to have something for it.
+*/
+struct sqlexec_merge {
+  int nHave;                    /* Number of workers in apWorker */
+  int nWorker;                  /* Number of them running this scan */
+  int nAlloc;                   /* Number of entries allocated in apWorker */
+  sqlexec_prefetch **apWorker;  /* The workers */
+  int iNext;                    /* Worker to look at first */
+  int bOrdered;                 /* Take the batches in order of worker */
+  sqlite3_int64 nMaxSteps;      /* max_steps of the scan, or 0 */
+  sqlite3_int64 iDeadline;      /* Clock the scan must end by, or 0 */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;          /* The cursor waits on this */
+  atomic_int bWait;             /* True while the cursor waits */
+  sqlexec_env *pEnv;            /* Connection state, for fdNotify */
+  sqlexec_cursor *pCur;         /* The cursor */
+  sqlexec_merge *pNextMerge;    /* Next on the list of pEnv */
+};
+#endif
+
+/*
+** An entry in the result cache of a virtual table: the rows returned by
+** zSql when run with the parameter values apArg. Entries are found through
+** a hash table and kept on a list in order of last use, most recent first,
+** so we know which to throw out when the cache grows past its budget.
+*/
+typedef struct sqlexec_cache_entry sqlexec_cache_entry;
+struct sqlexec_cache_entry {
+  unsigned int iHash;           /* Hash of zSql and apArg */
+  char *zSql;                   /* SQL the rows came from */
+  int nArg;                     /* Number of entries in apArg */
+  sqlite3_value **apArg;        /* Parameter values, NULL if unbound */
+  sqlexec_rowset *pRows;        /* The rows */
+  sqlite3_int64 nByte;          /* Memory used by this entry */
+  sqlexec_cache_entry *pHashNext; /* Next entry in same hash bucket */
+  sqlexec_cache_entry *pLruNext;  /* Next less recently used entry */
+  sqlexec_cache_entry *pLruPrev;  /* Next more recently used entry */
+};
+
+/*
+** Result cache of a virtual table.
+*/
+typedef struct sqlexec_cache sqlexec_cache;
+struct sqlexec_cache {
+  int nBucket;                  /* Number of entries in apBucket */
+  sqlexec_cache_entry **apBucket; /* Hash table */
+  int nEntry;                   /* Number of entries in the cache */
+  sqlite3_int64 nByte;          /* Memory used by all the entries */
+  sqlexec_cache_entry *pLruFirst; /* Most recently used entry */
+  sqlexec_cache_entry *pLruLast;  /* Least recently used entry */
+  sqlite3_int64 nHit;           /* Number of lookups which found an entry */
+  sqlite3_int64 nMiss;          /* Number of lookups which didn't */
+};
+
+/*
+** State shared by all the modules we register on a connection. We keep a
+** list of all the sqlexec virtual tables of the connection here, so the
+** sqlexec_cache table can report on them, and of the cursors' prefetch
+** workers, for sqlexec_would_block. The envs of all the connections are
+** on a list of the process (see sqlexecEnvRegister), so the functions of
+** sqlexec.h can find the one of a connection.
+*/
+typedef struct sqlexec_vtab sqlexec_vtab;
+struct sqlexec_env {
+  int nRef;                     /* Number of modules using this object */
+  sqlexec_vtab *pFirst;         /* First virtual table of the connection */
+  sqlite3 *db;                  /* The connection */
+  sqlexec_env *pNextEnv;        /* Next connection on the process's list */
+#ifndef SQLEXEC_OMIT_PREFETCH
+  sqlexec_merge *pMerge;        /* First set of prefetch workers */
+  atomic_int fdNotify;          /* File descriptor of sqlexec_notify_fd */
+#endif
+};
+
+/*
+** Number of buckets in the step time histogram of sqlexec_stats. Bucket 0
+** counts steps taking less than a microsecond, and bucket i from 2^(i-1)
+** up to 2^i microseconds, except that the last bucket takes all the
+** slower ones too.
+*/
+#define SQLEXEC_STATS_BUCKETS 24
+
+/*
+** Reading the clock costs as much as a cheap step, so sqlexec_stats times
+** only one step in every SQLEXEC_STATS_SAMPLE, and estimates the total
+** time from those. Define it as 1 to time every step.
+*/
+#ifndef SQLEXEC_STATS_SAMPLE
+# define SQLEXEC_STATS_SAMPLE 16
+#endif
+
+/*
+** Counters of the work a virtual table has done, for the sqlexec_stats
+** table. They are plain increments, and can be left out, with the clock
+** readings for the step times, by compiling with -DSQLEXEC_OMIT_STATS.
+**
+** A step is getting the next row from the source of a scan: a call to
+** sqlite3_step, or with prefetching, waiting for a batch of rows from the
+** workers. Rows served from a materialized result set or the result cache
+** are counted, but take no steps once the rows are there. nStepTime,
+** nStepMax and anHist are for the steps which were timed.
+*/
+typedef struct sqlexec_stats sqlexec_stats;
+struct sqlexec_stats {
+  sqlite3_int64 nCursor;        /* Cursors opened */
+  sqlite3_int64 nAlloc;         /* Cursors and block rowsets allocated */
+  sqlite3_int64 nScan;          /* Scans started (xFilter calls) */
+  sqlite3_int64 nStop;          /* Scans stopped by max_steps or timeout_ms */
+  sqlite3_int64 nPrepare;       /* Statements prepared */
+  sqlite3_int64 nPoolHit;       /* Scans which reused a prepared statement */
+  sqlite3_int64 nRow;           /* Rows returned */
+  sqlite3_int64 nByte;          /* Bytes of column values returned */
+  sqlite3_int64 nStep;          /* Steps taken */
+  sqlite3_int64 nTimed;         /* Steps timed */
+  sqlite3_int64 nStepTime;      /* Nanoseconds spent in timed steps */
+  sqlite3_int64 nStepMax;       /* Nanoseconds of the slowest timed step */
+  sqlite3_int64 anHist[SQLEXEC_STATS_BUCKETS]; /* Steps by time taken */
+};
+
+/*
+** The state of the connection at some point, for telling later whether we
+** are still in the same statement or transaction (see sqlexecStampValid).
+*/
+typedef struct sqlexec_stamp sqlexec_stamp;
+struct sqlexec_stamp {
+  int iGeneration;              /* iGeneration of the virtual table */
+  int bAutocommit;              /* True if in autocommit mode */
+  int nChanges;                 /* sqlite3_total_changes() */
+  int iCookie;                  /* Schema cookie */
+  unsigned int iDataVersion;    /* Data version of the main database */
+};
+
+/*
+** The state of the files of the main database when a snapshot was taken
+** (see sqlexecSnapshotKey). Unlike the data version, this means the same
+** to every process, so it is kept in the snapshot file, and the snapshot
+** is only used while the files are in the same state.
+*/
+typedef struct sqlexec_snapkey sqlexec_snapkey;
+struct sqlexec_snapkey {
+  sqlite3_int64 nSize;          /* Size of the database file */
+  sqlite3_int64 iTime;          /* Its modification time in nanoseconds */
+  sqlite3_int64 iWalSalt;       /* Salts of the WAL, 0 if none */
+  sqlite3_int64 iWalFrame;      /* Its last commit frame, 0 if none */
+  sqlite3_int64 iWalCksum;      /* Checksum of that frame, 0 if none */
+  sqlite3_int64 iChange;        /* Change counter of the database header */
+  sqlite3_int64 iCookie;        /* Schema cookie */
+};
 
 /*
 ** Stores definition of each virtual table. We need to store the underlying
 ** SQL we will be executing to get the data of this virtual table.
+**
+** The first nCol columns of the virtual table are the columns returned by
+** the SQL. After those come nParam hidden columns, one for each parameter
+** of the SQL. If the SQL is a PRAGMA, aSubst lists the parameter tokens we
+** need to substitute before it can be prepared.
+**
+** Preparing the SQL is often more expensive than running it, and a query
+** can open many cursors on the same virtual table, so we keep statements
+** which cursors have finished with in pool for the next cursor to use.
+** Rewritten versions of the SQL get pools of their own, on the pVariant
+** list in order of last use. If the SQL can be rewritten, zSrc is the
+** start of every rewrite: a WITH clause defining SQLEXEC_SRC as the SQL.
+**
+** aOrder is the order the SQL returns rows in, if the order option told us.
+** aClass has the affinity of each column, as worked out by
+** sqlexecAffinityClass, for deciding which comparisons can be rewritten.
+**
+** With the materialize option, pMat holds the result set of the last scan
+** which bound no parameters. With the cache option, cache holds the results
+** of recent scans. cacheStamp records the state of the connection when we
+** started caching results, which we use to decide when they need to be
+** thrown away (see sqlexecStampValid). nOpen is the number of cursors
+** currently open, and iGeneration counts the times it has gone up from 0.
+** If sql is a catalog PRAGMA (bCatalog), its cached results also last from
+** one statement to the next in autocommit mode, for as long as the
+** databases of the connection are as aCatalogSig records, checked with
+** the help of pSentinel, which reads the schema of each database named in
+** zSentinelDbs (see sqlexecCatalogSig).
+**
+** If the USING clause held more than one statement, all but the last are
+** setup statements in azSetup, and sql is the last. The setup statements
+** run on the first scan of each statement or transaction (see
+** sqlexecRunSetup), and setupStamp records when they last ran. An ATTACH
+** only runs once, as the database stays attached after that.
+**
+** If xConnect declared the virtual table from its schema table rather than
+** by preparing sql (see SQLEXEC_SCHEMA_SUFFIX), bUnchecked is set until
+** the first cursor is opened and we have checked that sql still returns
+** nCol columns. If the schema table is out of date, stale holds what
+** xConnect learned by preparing sql, or the out of date row it declared the
+** table from when sql wouldn't prepare without its setup statements, for
+** sqlexecSchemaRefresh to record once sqlexecSchemaCheck passes it.
+**
+** A query opening a cursor on the table each time it runs would otherwise
+** allocate one and its arrays every time, so up to SQLEXEC_IDLE_CURSORS
+** closed cursors are kept on the pIdleCursor list for xOpen to reuse.
+**
+** With the insert, update or delete options, xUpdate adds each change to
+** pPending, and they are made by running azWrite at xSync (see
+** sqlexecUpdate). abUpdateCol flags the columns whose values the update
+** statement takes, the only ones an UPDATE needs from xColumn.
+**
+** With the snapshot option, pSnap is the result set last loaded from or
+** saved to a file in the directory zSnapshot, and snapKey the state of
+** the database files it belongs to (see sqlexecSnapshotRows).
+**
+** aRowEstimate is what we tell the planner to expect from a scan, learned
+** from the scans which have run to the end (see sqlexecObserveRows), or -1
+** if we don't know yet.
 */
-typedef struct sqlexec_vtab sqlexec_vtab;
 struct sqlexec_vtab {
   sqlite3_vtab base;
   sqlite3 *db;
   char * sql;
+  int nCol;               /* Number of columns returned by sql */
+  int nParam;             /* Number of parameters in sql */
+  int nSubst;             /* Number of entries in aSubst */
+  sqlexec_subst *aSubst;  /* Parameter tokens of a PRAGMA statement */
+  sqlexec_pool pool;      /* Idle statements for sql */
+  sqlexec_pool *pVariant; /* Pools for rewritten SQL */
+  int nVariant;           /* Number of pools on the pVariant list */
+  char *zSrc;             /* WITH clause for rewrites, or NULL */
+  int nOrder;             /* Number of entries in aOrder */
+  sqlexec_order *aOrder;  /* Order of rows returned by sql */
+  char *aClass;           /* Affinity of each column of sql */
+  sqlexec_options opts;   /* Options from the USING clause */
+  int nOpen;              /* Number of open cursors */
+  int iGeneration;        /* Incremented when nOpen goes from 0 to 1 */
+  sqlite3_stmt *pCookieStmt; /* PRAGMA schema_version */
+  sqlexec_rowset *pMat;   /* Materialized result set, or NULL */
+  sqlexec_cache cache;    /* Results of recent scans */
+  sqlexec_stamp cacheStamp; /* Connection state when caching started */
+  int bCatalog;           /* True if sql is in sqlexecCatalogPragmas */
+  sqlite3_stmt *pSentinel; /* Reads every schema table, for aCatalogSig */
+  char *zSentinelDbs;     /* Names of the databases pSentinel reads */
+  int nSentinelDbs;       /* Bytes in zSentinelDbs, with each name's NUL */
+  int nCatalogSig;        /* Bytes in aCatalogSig, or -1 for none */
+  char aCatalogSig[SQLEXEC_CATALOG_SIG]; /* Databases when caching started */
+  int nSetup;             /* Number of setup statements */
+  char **azSetup;         /* SQL of each setup statement */
+  sqlite3_stmt **apSetup; /* Setup statements, prepared when first run */
+  char *abSetupDone;      /* True for each ATTACH setup which has run */
+  int bSetupRun;          /* True once the setup statements have run */
+  sqlexec_stamp setupStamp; /* Connection state when setup last ran */
+  sqlexec_env *pEnv;      /* Connection state shared by our modules */
+  sqlexec_vtab *pNext;    /* Next virtual table in pEnv list */
+  sqlexec_vtab **ppPrev;  /* Pointer to this in pEnv list */
+  char *zDb;              /* Name of database containing virtual table */
+  char *zName;            /* Name of virtual table */
+  double aRowEstimate[2]; /* Rows per scan without/with parameters bound */
+  sqlexec_prefetch *pFetchIdle; /* Prefetch workers no cursor is using */
+  int nFetchIdle;         /* Number of workers on the pFetchIdle list */
+  int bPrefetchOff;       /* True if prefetching turned out not to work */
+  int iPartCol;           /* Column the partition option slices by */
+  int nPart;              /* Number of slices, 0 without partition */
+  int bPartOrdered;       /* Slices must be merged in order (see aOrder) */
+  int bUnchecked;         /* Declared from the schema table, sql unprepared */
+  char *zArgs;            /* USING clause, which keys the schema table row */
+  char *azSchemaOpt[3];   /* Order, partition and key options, or NULL */
+  sqlexec_schema stale;   /* To record in the schema table, if zDecl set */
+  int iStaleCookie;       /* Schema cookie when stale was learned */
+  sqlexec_cursor *pIdleCursor; /* Closed cursors kept for reuse */
+  int nIdleCursor;        /* Number of cursors on the pIdleCursor list */
+  char *azWrite[3];       /* SQL of the insert, update and delete options */
+  sqlite3_stmt *apWrite[3][SQLEXEC_CONFLICT_MODES]; /* azWrite, prepared
+                          ** when first run, for each conflict mode */
+  char *abUpdateCol;      /* Columns the update statement takes, or NULL */
+  sqlexec_rowset *pPending; /* Writes waiting for xSync, or NULL */
+  sqlite3_stmt *apRangeStmt[2]; /* Least and greatest value of iPartCol */
+  char *azRangeSql[2];    /* SQL of apRangeStmt (sqlexecPartitionRange) */
+  char *zSnapshot;        /* Directory of the snapshot option, or NULL */
+  sqlexec_rowset *pSnap;  /* Result set of the latest snapshot, or NULL */
+  sqlexec_snapkey snapKey; /* State of the database files pSnap is for */
+#ifndef SQLEXEC_OMIT_STATS
+  sqlexec_stats stats;    /* Counters for the sqlexec_stats table */
+#endif
 };
 
 /*
 ** Stores the cursor used to return data from our virtual table. Keep track
 ** of row number (iRowid) and also the underlying statement handle we are
-** executing.
+** executing. The row number is not the rowid (see sqlexecRowid). apArg
+** holds the values xFilter bound to each parameter, so we can return them
+** as the values of the hidden columns, followed by any values a rewrite of
+** the SQL needed (see sqlexec_plan).
+**
+** At end of data we reset the statement but keep hold of it, so that when
+** xFilter is called again (the inner loop of a join) it can just be stepped
+** again. bEof marks that we are at end of data.
+**
+** If pRows is not NULL, we are returning rows from a materialized result
+** set instead of from the statement, and row number iRowid-iRowBase-1 of
+** it is the current row. If bFetching is set, pRows is the latest batch
+** from the prefetch workers of pMerge, and iRowBase is the number of rows
+** in the batches before it. If bBlock is set, pRows is the latest block of
+** rows read from the statement (see sqlexecBlockFill), and iRowBase
+** counts the rows of the blocks before it. The cursor keeps the rowsets
+** of the last two blocks in apBlock, most recent first, to fill again.
+**
+** A closed cursor goes on the pIdleCursor list of its virtual table, through
+** pNextIdle, keeping apArg and apBlock for the next cursor opened.
 */
-typedef struct sqlexec_cursor sqlexec_cursor;
 struct sqlexec_cursor {
   sqlite3_vtab_cursor base;
   sqlite3_int64 iRowid;
   sqlite3_stmt *pStmt;
+  sqlexec_pool *pPool;    /* Pool pStmt goes back to, NULL to finalize it */
+  sqlite3_value **apArg;
+  int nArg;               /* Number of entries of apArg in use */
+  int nArgAlloc;          /* Number of entries allocated for apArg */
+  int bEof;
+  int bBound;             /* True if xFilter bound any parameters */
+  int bSubset;            /* True if the scan returns only some rows */
+  sqlexec_rowset *pRows;
+  sqlite3_int64 iRowBase; /* Rows before the first row of pRows */
+  sqlexec_merge *pMerge;  /* Prefetch workers, or NULL */
+  int bFetching;          /* True if pMerge is running this scan */
+  sqlexec_rowset *apBlock[2]; /* Rowsets for blocks of rows */
+  int bBlock;             /* True if this scan reads pStmt in blocks */
+  int bBlockDone;         /* True once pStmt has returned its last row */
+  int bCount;             /* True if pStmt counts the rows of the scan */
+  sqlite3_int64 nCount;   /* Rows pStmt counted, or -1 before it has run */
+  int bLimit;             /* True if the scan has max_steps or timeout_ms */
+  sqlite3_int64 iDeadline; /* sqlexecClock the scan must end by, or 0 */
+  sqlexec_cursor *pNextIdle; /* Next cursor on the pIdleCursor list */
 };
 
 /*
-** Sqlite calls this function when CREATE VIRTUAL TABLE is executed. We get
-** passed the USING clause. We need to declare the columns of the virtual
-** table, allocate the virtual table object, and do anything else needed to
-** get the virtual table ready. In our case, that means preparing the
-** underlying SQL (passed via the USING clause) to validate its syntax and
-** find out what columns it returns.
+** Skip over whitespace and comments, returning pointer to the first byte
+** of the next token.
 */
-static int sqlexecConnect(
-  sqlite3 *db,
-  void *pAux,
-  int argc, const char *const*argv,
-  sqlite3_vtab **ppVtab,
-  char **pzErr
-){
-  sqlexec_vtab *pNew;
-  int rc;
-
-  /*
-  ** Check passed arguments are what we expected. Note that argv vector looks
-  ** like this:
-  ** argv[0]: module name (in our case "sqlexec")
-  ** argv[1]: name of database (most commonly "main")
-  ** argv[2]: name of virtual table
-  ** argv[3]: first USING clause argument
-  **
-  ** Note although we are module/database/table names, we don't use them for
-  ** anything at the moment; all we use is what is in the USING clause. At
-  ** present we expect exactly one parameter in the USING clause so that is
-  ** what we are validating for below.
-  */
-  if (argc != 4) {
-    if (pzErr)
-      *pzErr = sqlite3_mprintf("sqlexecConnect: expected 1 argument in USING clause, got %d\n",
-                               argc - 3);
-    return SQLITE_ERROR;
+static const char *sqlexecSkipSpace(const char *z){
+  for (;;) {
+    if (isspace((unsigned char)*z)) {
+      z++;
+    } else if (z[0] == '-' && z[1] == '-') {
+      while (*z && *z != '\n')
+        z++;
+    } else if (z[0] == '/' && z[1] == '*') {
+      const char *zEnd = strstr(z+2, "*/");
+      z = zEnd ? zEnd+2 : strchr(z,0);
+    } else {
+      return z;
+    }
   }
+}
 
-  /*
-  ** In first parameter of USING clause we were passed SQL to execute.
-  ** Optionally it is surrounded by parenthesis so that any commas in it
-  ** are ignored (and not considered another USING clause argument).
-  ** So now we check if the argument starts with ( and ends with ) and
-  ** if so we will strip the ( and ) off the start/end. We allow whitespace
-  ** before the ( and after the ) but not any other character.
-  */
-  char *sql = NULL;
-  char *parenOpen = strchr(argv[3],'(');
-  if (parenOpen != NULL) {
-    for (const char *p = argv[3]; p != parenOpen; p++) {
-      if (!isspace(*p)) {
-        parenOpen = NULL;
-        break;
+/*
+** Returns true if the SQL statement is a PRAGMA.
+*/
+static int sqlexecIsPragma(const char *sql){
+  const char *z = sqlexecSkipSpace(sql);
+  return sqlite3_strnicmp(z, "pragma", 6) == 0
+      && !isalnum((unsigned char)z[6]) && z[6] != '_';
+}
+
+/*
+** The PRAGMAs which read the schema and nothing else, so that their results
+** stay good for as long as the databases of the connection don't change.
+*/
+static const char *const sqlexecCatalogPragmas[] = {
+  "database_list", "table_info", "table_xinfo", "index_list", "index_info",
+  "index_xinfo", "foreign_key_list",
+};
+
+/*
+** Returns a pointer past the identifier at z, bare or quoted, or z itself
+** if there isn't one.
+*/
+static const char *sqlexecIdentEnd(const char *z){
+  if (*z == '"' || *z == '`' || *z == '[') {
+    char cEnd = *z == '[' ? ']' : *z;
+    for (const char *p = z+1; *p; p++) {
+      if (*p == cEnd) {
+        if (p[1] != cEnd || cEnd == ']')
+          return p+1;
+        p++;
       }
     }
+    return z;
   }
-  if (parenOpen != NULL) {
-    char *parenClose = strrchr(argv[3],')');
-    if (parenClose != NULL) {
-      for (char *p = strchr(argv[3],0)-1; p != parenClose; p--) {
-        if (!isspace(*p)) {
-          parenClose = NULL;
+  while (isalnum((unsigned char)*z) || *z == '_')
+    z++;
+  return z;
+}
+
+/*
+** Returns true if the SQL statement is one of sqlexecCatalogPragmas, with
+** or without a schema name and an argument.
+*/
+static int sqlexecIsCatalog(const char *sql){
+  if (!sqlexecIsPragma(sql))
+    return 0;
+  const char *zName = sqlexecSkipSpace(sqlexecSkipSpace(sql) + 6);
+  const char *z = sqlexecIdentEnd(zName);
+  if (z != zName && *sqlexecSkipSpace(z) == '.') {
+    zName = sqlexecSkipSpace(sqlexecSkipSpace(z) + 1);
+    z = sqlexecIdentEnd(zName);
+  }
+  int nName = (int)(z - zName);
+  z = sqlexecSkipSpace(z);
+  if (*z != 0 && *z != '(' && *z != '=' && *z != ';')
+    return 0;
+  for (int i = 0; i < (int)(sizeof(sqlexecCatalogPragmas)/sizeof(char*));
+       i++) {
+    if ((int)strlen(sqlexecCatalogPragmas[i]) == nName
+        && sqlite3_strnicmp(zName, sqlexecCatalogPragmas[i], nName) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+** Scan the text of a PRAGMA statement for parameter tokens. SQLite does not
+** allow parameters in PRAGMA statements, so we have to find them ourselves.
+** We number the parameters the same way sqlite3_prepare would: "?" takes
+** the next unused number, "?NNN" takes number NNN, and a named parameter
+** takes the next unused number the first time its name is seen.
+**
+** On success, *paSubst receives an array of the tokens found, *pazName an
+** array of nParam parameter names (NULL for unnamed parameters), and
+** *pnParam the largest parameter number used.
+*/
+static int sqlexecScanPragmaParams(
+  const char *sql,
+  sqlexec_subst **paSubst, int *pnSubst,
+  char ***pazName, int *pnParam
+){
+  sqlexec_subst *aSubst = NULL;
+  char **azName = NULL;
+  int nSubst = 0;
+  int nParam = 0;
+  int rc = SQLITE_NOMEM;
+  const char *z = sql;
+
+  *paSubst = NULL;
+  *pnSubst = 0;
+  *pazName = NULL;
+  *pnParam = 0;
+  while (*(z = sqlexecSkipSpace(z))) {
+    const char *zStart = z;
+    int iParam = 0;
+
+    if (*z == '\'' || *z == '"' || *z == '`' || *z == '[') {
+      /* Skip quoted strings and identifiers */
+      char cEnd = *z == '[' ? ']' : *z;
+      for (z++; *z; z++) {
+        if (*z == cEnd) {
+          if (z[1] != cEnd || cEnd == ']')
+            break;
+          z++;
+        }
+      }
+      if (*z)
+        z++;
+      continue;
+    }
+    if (*z == '?') {
+      for (z++; isdigit((unsigned char)*z); z++)
+        iParam = iParam*10 + (*z - '0');
+      if (z == zStart+1)
+        iParam = nParam+1;
+    } else if ((*z == ':' || *z == '@' || *z == '$')
+               && (isalnum((unsigned char)z[1]) || z[1] == '_')) {
+      for (z++; isalnum((unsigned char)*z) || *z == '_'; z++)
+        ;
+      for (int i = 0; i < nParam; i++) {
+        if (azName[i] && (int)strlen(azName[i]) == z-zStart
+            && memcmp(azName[i], zStart, z-zStart) == 0) {
+          iParam = i+1;
           break;
         }
       }
+      if (iParam == 0)
+        iParam = nParam+1;
+    } else {
+      z++;
+      continue;
     }
-    if (parenClose != NULL) {
-      sql = sqlite3_mprintf("%s", parenOpen+1);
-      if (sql == NULL)
-        return SQLITE_NOMEM;
-      *(strrchr(sql,')')) = 0;
+    if (iParam < 1 || iParam > SQLEXEC_MAX_PARAM) {
+      rc = SQLITE_RANGE;
+      goto scan_error;
     }
-  }
-  if (sql == NULL)
-    sql = sqlite3_mprintf("%s", argv[3]);
-  if (sql == NULL)
-    return SQLITE_NOMEM;
 
-  /*
-  ** Now we prepare the statement to validate its syntax and find out the
-  ** columns it returns.
-  */
-  sqlite3_stmt * pStmt;
-  rc = sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL);
-  if (rc != SQLITE_OK) {
-    if (pzErr)
-      *pzErr = sqlite3_mprintf("Error preparing: %s; reason: %s", sql,
-          sqlite3_errmsg(db));
-    return rc;
-  }
+    sqlexec_subst *aNew = sqlite3_realloc(aSubst, (nSubst+1)*sizeof(*aNew));
+    if (aNew == NULL)
+      goto scan_error;
+    aSubst = aNew;
+    aSubst[nSubst].iOfst = (int)(zStart - sql);
+    aSubst[nSubst].nByte = (int)(z - zStart);
+    aSubst[nSubst].iParam = iParam;
+    nSubst++;
 
-  /*
-  ** Find out number of columns prepared SQL returns. If it returns zero
-  ** columns we return an error here.
-  */
-  int colCount = sqlite3_column_count(pStmt);
-  if (colCount == 0) {
-    sqlite3_finalize(pStmt); /* avoid memory leak of prepared stmt */
-    if (pzErr)
-      *pzErr = sqlite3_mprintf("SQL statement returns no data: %s", sql);
-    return SQLITE_ERROR;
+    if (iParam > nParam) {
+      char **azNew = sqlite3_realloc(azName, iParam*sizeof(char*));
+      if (azNew == NULL)
+        goto scan_error;
+      azName = azNew;
+      memset(&azName[nParam], 0, (iParam-nParam)*sizeof(char*));
+      nParam = iParam;
+    }
+    if (*zStart != '?' && azName[iParam-1] == NULL) {
+      azName[iParam-1] = sqlite3_mprintf("%.*s", (int)(z-zStart), zStart);
+      if (azName[iParam-1] == NULL)
+        goto scan_error;
+    }
   }
 
-  /*
-  ** Now we begin constructing the CREATE TABLE statement we need to pass
-  ** to the sqlite3_declare_vtab function. This should always work unless
-  ** we run out of memory.
+  *paSubst = aSubst;
+  *pnSubst = nSubst;
+  *pazName = azName;
+  *pnParam = nParam;
+  return SQLITE_OK;
+
+scan_error:
+  sqlite3_free(aSubst);
+  for (int i = 0; i < nParam; i++)
+    sqlite3_free(azName[i]);
+  sqlite3_free(azName);
+  return rc;
+}
+
+/*
+** Build the text of a PRAGMA statement with each parameter token replaced
+** by the value in apArg (or by '' if the parameter has no value). Numbers
+** are substituted as numbers and everything else as a string literal,
+** since PRAGMA arguments cannot be NULL or BLOB literals. Returns NULL if
+** we run out of memory.
+*/
+static char *sqlexecExpandPragma(
+  const char *sql,
+  const sqlexec_subst *aSubst, int nSubst,
+  sqlite3_value **apArg
+){
+  sqlite3_str *pStr = sqlite3_str_new(NULL);
+  int iPos = 0;
+  for (int i = 0; i < nSubst; i++) {
+    sqlite3_value *pVal = apArg ? apArg[aSubst[i].iParam-1] : NULL;
+    sqlite3_str_append(pStr, sql+iPos, aSubst[i].iOfst-iPos);
+    switch (pVal ? sqlite3_value_type(pVal) : SQLITE_NULL) {
+      case SQLITE_INTEGER:
+        sqlite3_str_appendf(pStr, "%lld", sqlite3_value_int64(pVal));
+        break;
+      case SQLITE_FLOAT:
+        sqlite3_str_appendf(pStr, "%!.17g", sqlite3_value_double(pVal));
+        break;
+      case SQLITE_NULL:
+        sqlite3_str_appendall(pStr, "''");
+        break;
+      default:
+        sqlite3_str_appendf(pStr, "%Q", sqlite3_value_text(pVal));
+        break;
+    }
+    iPos = aSubst[i].iOfst + aSubst[i].nByte;
+  }
+  sqlite3_str_appendall(pStr, sql+iPos);
+  return sqlite3_str_finish(pStr);
+}
+
+/*
+** Append the name of the hidden column for parameter number iParam
+** (1-based) to pStr, quoted. Named parameters use their name without the
+** leading ":", "@" or "$". Unnamed and numbered parameters are called "arg"
+** if there is only one parameter, otherwise "arg1", "arg2", etc.
+*/
+static void sqlexecAppendParamColumn(sqlite3_str *pStr, const char *zParam,
+                                     int iParam, int nParam){
+  if (zParam != NULL && zParam[0] != '?')
+    sqlite3_str_appendf(pStr, "\"%w\"", zParam+1);
+  else if (nParam == 1)
+    sqlite3_str_appendall(pStr, "arg");
+  else
+    sqlite3_str_appendf(pStr, "arg%d", iParam);
+}
+
+/*
+** Returns true if zType, the declared type of a column of the SQL, can be
+** copied into the declaration of the virtual table. Anything out of the
+** ordinary, such as quotes or a type which itself says "hidden", is left
+** out, and the column of the virtual table then has no type.
+*/
+static int sqlexecPlainType(const char *zType){
+  if (zType == NULL || *zType == 0)
+    return 0;
+  for (const char *z = zType; *z; z++) {
+    if (!isalnum((unsigned char)*z) && strchr(" _(),+-.", *z) == NULL)
+      return 0;
+    if (sqlite3_strnicmp(z, "hidden", 6) == 0)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+** Returns true if the SQL statement is an ATTACH.
+*/
+static int sqlexecIsAttach(const char *sql){
+  const char *z = sqlexecSkipSpace(sql);
+  return sqlite3_strnicmp(z, "attach", 6) == 0;
+}
+
+/*
+** Returns the time in nanoseconds from a monotonic clock, for timing steps
+** and the timeout_ms option.
+*/
+static sqlite3_int64 sqlexecClock(void){
+  struct timespec ts;
+#ifdef _WIN32
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef SQLEXEC_OMIT_STATS
+# define sqlexecStatAdd(vtab, field, n) ((vtab)->stats.field += (n))
+
+/*
+** Called before a step. Counts it, and returns the time it starts if it is
+** one to time, or else 0.
+*/
+static sqlite3_int64 sqlexecStatStart(sqlexec_vtab *vtab){
+  if (vtab->stats.nStep++ % SQLEXEC_STATS_SAMPLE != 0)
+    return 0;
+  return sqlexecClock();
+}
+
+/*
+** Called after a step, with what sqlexecStatStart returned before it.
+*/
+static void sqlexecStatStep(sqlexec_vtab *vtab, sqlite3_int64 iStart){
+  if (iStart == 0)
+    return;
+  sqlexec_stats *pStats = &vtab->stats;
+  sqlite3_int64 nTime = sqlexecClock() - iStart;
+  sqlite3_int64 nMicro = nTime / 1000;
+  int i = 0;
+  while (nMicro > 0 && i < SQLEXEC_STATS_BUCKETS - 1) {
+    nMicro >>= 1;
+    i++;
+  }
+  pStats->anHist[i]++;
+  pStats->nTimed++;
+  pStats->nStepTime += nTime;
+  if (nTime > pStats->nStepMax)
+    pStats->nStepMax = nTime;
+}
+#else
+# define sqlexecStatAdd(vtab, field, n) ((void)(vtab), (void)(n))
+# define sqlexecStatStart(vtab) ((void)(vtab), 0)
+# define sqlexecStatStep(vtab, iStart) ((void)(iStart))
+#endif
+
+/*
+** Prepare a statement for one of our cursors, leaving an error message in
+** the virtual table if it fails. Statements we are going to keep in the
+** pool are prepared with SQLITE_PREPARE_PERSISTENT, as they are long-lived.
+*/
+static int sqlexecPrepare(
+  sqlexec_vtab *vtab,
+  const char *sql,
+  unsigned int prepFlags,
+  sqlite3_stmt **ppStmt
+){
+  sqlexecStatAdd(vtab, nPrepare, 1);
+  int rc = sqlite3_prepare_v3(vtab->db, sql, -1, prepFlags, ppStmt, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("Error preparing: %s; reason: %s",
+                                         sql, sqlite3_errmsg(vtab->db));
+  }
+  return rc;
+}
+
+/*
+** Returns the error message for a scan stopped by the max_steps or
+** timeout_ms option, named by zOption.
+*/
+static char *sqlexecLimitMessage(const char *zOption){
+  return sqlite3_mprintf("interrupted: the scan went over its %s", zOption);
+}
+
+/*
+** Called after a step of pStmt which returned a row, for a scan with the
+** max_steps or timeout_ms option which must end by iDeadline (if not 0).
+** The steps are counted by SQLite (SQLITE_STMTSTATUS_VM_STEP, reset by
+** sqlexecStartStmt), so the limit only covers the statement we run, not
+** the query it is part of. We can't borrow the progress handler of the
+** connection, which belongs to the application, so a single step which
+** runs for long without returning a row isn't stopped until it does. If
+** the scan has gone over either limit, we count the stop, leave an error
+** message in the virtual table and return true, and the caller ends the
+** scan with SQLITE_INTERRUPT.
+*/
+static int sqlexecLimitOver(
+  sqlexec_vtab *vtab,
+  sqlite3_stmt *pStmt,
+  sqlite3_int64 iDeadline
+){
+  const char *zOver = NULL;
+  if (vtab->opts.nMaxSteps > 0
+      && sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_VM_STEP, 0)
+         > vtab->opts.nMaxSteps)
+    zOver = "max_steps";
+  else if (iDeadline > 0 && sqlexecClock() > iDeadline)
+    zOver = "timeout_ms";
+  if (zOver == NULL)
+    return 0;
+  sqlexecStatAdd(vtab, nStop, 1);
+  sqlite3_free(vtab->base.zErrMsg);
+  vtab->base.zErrMsg = sqlexecLimitMessage(zOver);
+  return 1;
+}
+
+/*
+** Take a statement out of a pool, or prepare a new one if the pool is
+** empty.
+*/
+static int sqlexecStmtCheckout(
+  sqlexec_vtab *vtab,
+  sqlexec_pool *pPool,
+  sqlite3_stmt **ppStmt
+){
+  if (pPool->nStmt > 0) {
+    *ppStmt = pPool->apStmt[--pPool->nStmt];
+    sqlexecStatAdd(vtab, nPoolHit, 1);
+  } else {
+    int rc = sqlexecPrepare(vtab, pPool->zSql, SQLITE_PREPARE_PERSISTENT,
+                            ppStmt);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  pPool->nRef++;
+  return SQLITE_OK;
+}
+
+/*
+** Give back a statement a cursor has finished with. Statements from a pool
+** are reset, so they don't keep a read transaction open, and go back into
+** it if there is room. PRAGMA statements with substituted parameters
+** don't come from a pool (pPool is NULL) and can't be reused, so they are
+** finalized.
+*/
+static void sqlexecStmtCheckin(sqlexec_pool *pPool, sqlite3_stmt *pStmt){
+  if (pPool != NULL) {
+    pPool->nRef--;
+    if (pPool->nStmt < SQLEXEC_POOL_SIZE) {
+      sqlite3_reset(pStmt);
+      pPool->apStmt[pPool->nStmt++] = pStmt;
+      return;
+    }
+  }
+  sqlite3_finalize(pStmt);
+}
+
+/*
+** Finalize all the statements in a pool.
+*/
+static void sqlexecPoolEmpty(sqlexec_pool *pPool){
+  while (pPool->nStmt > 0)
+    sqlite3_finalize(pPool->apStmt[--pPool->nStmt]);
+}
+
+/*
+** Finalize all the idle statements of a virtual table.
+*/
+static void sqlexecPoolClear(sqlexec_vtab *vtab){
+  sqlexecPoolEmpty(&vtab->pool);
+  for (sqlexec_pool *p = vtab->pVariant; p != NULL; p = p->pNext)
+    sqlexecPoolEmpty(p);
+}
+
+/*
+** Find the pool for a rewritten version of the SQL of a virtual table,
+** creating it if there isn't one, and move it to the front of the list.
+** If that makes too many, free the least recently used pool no cursor is
+** using.
+*/
+static int sqlexecVariantPool(
+  sqlexec_vtab *vtab,
+  const char *zSql,
+  sqlexec_pool **ppPool
+){
+  sqlexec_pool **pp = &vtab->pVariant;
+  sqlexec_pool *p;
+  while ((p = *pp) != NULL && strcmp(p->zSql, zSql) != 0)
+    pp = &p->pNext;
+  if (p != NULL) {
+    *pp = p->pNext;
+  } else {
+    p = sqlite3_malloc(sizeof(*p));
+    if (p == NULL)
+      return SQLITE_NOMEM;
+    memset(p, 0, sizeof(*p));
+    p->zSql = sqlite3_mprintf("%s", zSql);
+    if (p->zSql == NULL) {
+      sqlite3_free(p);
+      return SQLITE_NOMEM;
+    }
+    vtab->nVariant++;
+  }
+  p->pNext = vtab->pVariant;
+  vtab->pVariant = p;
+  *ppPool = p;
+
+  if (vtab->nVariant > SQLEXEC_MAX_VARIANT) {
+    sqlexec_pool **ppVictim = NULL;
+    for (pp = &p->pNext; *pp != NULL; pp = &(*pp)->pNext) {
+      if ((*pp)->nRef == 0)
+        ppVictim = pp;
+    }
+    if (ppVictim != NULL) {
+      sqlexec_pool *pVictim = *ppVictim;
+      *ppVictim = pVictim->pNext;
+      sqlexecPoolEmpty(pVictim);
+      sqlite3_free(pVictim->zSql);
+      sqlite3_free(pVictim);
+      vtab->nVariant--;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Allocate a new, empty rowset with nCol columns. Returns NULL if we run out
+** of memory.
+*/
+static sqlexec_rowset *sqlexecRowsetNew(int nCol){
+  sqlexec_rowset *pRows = sqlite3_malloc(sizeof(*pRows));
+  if (pRows == NULL)
+    return NULL;
+  memset(pRows, 0, sizeof(*pRows));
+  pRows->nRef = 1;
+  pRows->nCol = nCol;
+  return pRows;
+}
+
+/*
+** Drop a reference to a rowset, freeing it when there are none left.
+*/
+static void sqlexecRowsetUnref(sqlexec_rowset *pRows){
+  if (pRows != NULL && --pRows->nRef == 0) {
+#ifndef SQLEXEC_OMIT_SNAPSHOT
+    if (pRows->pMap != NULL) {
+      munmap(pRows->pMap, (size_t)pRows->nMap);
+      sqlite3_free(pRows);
+      return;
+    }
+#endif
+    sqlite3_free(pRows->aCell);
+    sqlite3_free(pRows->aHeap);
+    sqlite3_free(pRows);
+  }
+}
+
+/*
+** Make room in a rowset for nAlloc rows, at least as many as it has. The
+** column arrays share one allocation, so this means moving each column to
+** its new place.
+*/
+static int sqlexecRowsetResize(sqlexec_rowset *pRows, int nAlloc){
+  int nCol = pRows->nCol;
+  sqlite3_uint64 nCell = (sqlite3_uint64)nCol * nAlloc;
+  sqlexec_cell *aCell = sqlite3_malloc64(nCell * (sizeof(sqlexec_cell)
+                                                  + sizeof(int) + 1));
+  if (aCell == NULL)
+    return SQLITE_NOMEM;
+  int *anByte = (int*)&aCell[nCell];
+  unsigned char *aType = (unsigned char*)&anByte[nCell];
+  for (int iCol = 0; iCol < nCol && pRows->nRow > 0; iCol++) {
+    /* Not before the first row: the old arrays are NULL then */
+    int iOld = iCol * pRows->nRowAlloc;
+    int iNew = iCol * nAlloc;
+    memcpy(&aCell[iNew], &pRows->aCell[iOld], pRows->nRow*sizeof(*aCell));
+    memcpy(&anByte[iNew], &pRows->anByte[iOld], pRows->nRow*sizeof(int));
+    memcpy(&aType[iNew], &pRows->aType[iOld], pRows->nRow);
+  }
+  sqlite3_free(pRows->aCell);
+  pRows->aCell = aCell;
+  pRows->anByte = anByte;
+  pRows->aType = aType;
+  pRows->nRowAlloc = nAlloc;
+  return SQLITE_OK;
+}
+
+/*
+** Make room in a rowset for at least one more row.
+*/
+static int sqlexecRowsetGrow(sqlexec_rowset *pRows){
+  return sqlexecRowsetResize(pRows,
+                             pRows->nRowAlloc ? pRows->nRowAlloc*2 : 16);
+}
+
+/*
+** Give back the room a rowset has for rows and values it hasn't used, as
+** it goes into the result cache, where it may stay for long and is counted
+** by the bytes it takes. This is worth doing for small results such as a
+** catalog PRAGMA's, which would otherwise take several times what their
+** rows are. If we can't, it is left as it is.
+*/
+static void sqlexecRowsetTrim(sqlexec_rowset *pRows){
+  if (pRows->nRow > 0 && pRows->nRow < pRows->nRowAlloc)
+    sqlexecRowsetResize(pRows, pRows->nRow);
+  if (pRows->nHeap > 0 && pRows->nHeap < pRows->nHeapAlloc) {
+    char *aHeap = sqlite3_realloc64(pRows->aHeap, pRows->nHeap);
+    if (aHeap != NULL) {
+      pRows->aHeap = aHeap;
+      pRows->nHeapAlloc = pRows->nHeap;
+    }
+  }
+}
+
+/*
+** Copy nByte bytes of TEXT or BLOB content into the heap of a rowset, as
+** the value of cell iCell.
+*/
+static int sqlexecRowsetCopy(
+  sqlexec_rowset *pRows,
+  int iCell,
+  const void *pData, int nByte
+){
+  if (nByte > 0 && pData == NULL)
+    return SQLITE_NOMEM;
+  sqlite3_int64 iHdr = (pRows->nHeap + SQLEXEC_HEAP_ALIGN - 1)
+                     & ~(SQLEXEC_HEAP_ALIGN - 1);
+  sqlite3_int64 nNeed = iHdr + SQLEXEC_HEAP_ALIGN + nByte;
+  if (nNeed > pRows->nHeapAlloc) {
+    sqlite3_int64 nAlloc = pRows->nHeapAlloc ? pRows->nHeapAlloc*2 : 1024;
+    while (nAlloc < nNeed)
+      nAlloc *= 2;
+    char *aHeap = sqlite3_realloc64(pRows->aHeap, nAlloc);
+    if (aHeap == NULL)
+      return SQLITE_NOMEM;
+    pRows->aHeap = aHeap;
+    pRows->nHeapAlloc = nAlloc;
+  }
+  memcpy(&pRows->aHeap[iHdr], &pRows, sizeof(pRows));
+  if (nByte > 0)
+    memcpy(&pRows->aHeap[iHdr + SQLEXEC_HEAP_ALIGN], pData, nByte);
+  pRows->aCell[iCell].i = iHdr + SQLEXEC_HEAP_ALIGN;
+  pRows->nHeap = nNeed;
+  return SQLITE_OK;
+}
+
+/*
+** Copy the current row of pStmt onto the end of a rowset.
+*/
+static int sqlexecRowsetAppend(sqlexec_rowset *pRows, sqlite3_stmt *pStmt){
+  if (pRows->nRow == pRows->nRowAlloc) {
+    int rc = sqlexecRowsetGrow(pRows);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  for (int iCol = 0; iCol < pRows->nCol; iCol++) {
+    int iCell = iCol * pRows->nRowAlloc + pRows->nRow;
+    int eType = sqlite3_column_type(pStmt, iCol);
+    int nByte = 0;
+    switch (eType) {
+      case SQLITE_INTEGER:
+        pRows->aCell[iCell].i = sqlite3_column_int64(pStmt, iCol);
+        break;
+      case SQLITE_FLOAT:
+        pRows->aCell[iCell].r = sqlite3_column_double(pStmt, iCol);
+        break;
+      case SQLITE_TEXT: {
+        const unsigned char *pData = sqlite3_column_text(pStmt, iCol);
+        nByte = sqlite3_column_bytes(pStmt, iCol);
+        int rc = sqlexecRowsetCopy(pRows, iCell, pData, nByte);
+        if (rc != SQLITE_OK)
+          return rc;
+        break;
+      }
+      case SQLITE_BLOB: {
+        const void *pData = sqlite3_column_blob(pStmt, iCol);
+        nByte = sqlite3_column_bytes(pStmt, iCol);
+        int rc = sqlexecRowsetCopy(pRows, iCell, pData, nByte);
+        if (rc != SQLITE_OK)
+          return rc;
+        break;
+      }
+    }
+    pRows->anByte[iCell] = nByte;
+    pRows->aType[iCell] = (unsigned char)eType;
+  }
+  pRows->nRow++;
+  return SQLITE_OK;
+}
+
+/*
+** Set column iCol of the row after the last of a rowset, which the caller
+** has made room for, to a copy of pVal (NULL for SQL NULL). The caller
+** adds the row by incrementing nRow once all its columns are set.
+*/
+static int sqlexecRowsetPut(
+  sqlexec_rowset *pRows,
+  int iCol,
+  sqlite3_value *pVal
+){
+  int iCell = iCol * pRows->nRowAlloc + pRows->nRow;
+  int eType = pVal ? sqlite3_value_type(pVal) : SQLITE_NULL;
+  int nByte = 0;
+  int rc = SQLITE_OK;
+  switch (eType) {
+    case SQLITE_INTEGER:
+      pRows->aCell[iCell].i = sqlite3_value_int64(pVal);
+      break;
+    case SQLITE_FLOAT:
+      pRows->aCell[iCell].r = sqlite3_value_double(pVal);
+      break;
+    case SQLITE_TEXT: {
+      const unsigned char *pData = sqlite3_value_text(pVal);
+      nByte = sqlite3_value_bytes(pVal);
+      rc = sqlexecRowsetCopy(pRows, iCell, pData, nByte);
+      break;
+    }
+    case SQLITE_BLOB: {
+      const void *pData = sqlite3_value_blob(pVal);
+      nByte = sqlite3_value_bytes(pVal);
+      rc = sqlexecRowsetCopy(pRows, iCell, pData, nByte);
+      break;
+    }
+  }
+  pRows->anByte[iCell] = nByte;
+  pRows->aType[iCell] = (unsigned char)eType;
+  return rc;
+}
+
+/*
+** Bind a column of a rowset to parameter iParam of pStmt, if pStmt has
+** that many. TEXT and BLOB content is not copied, so the rowset must not
+** change before the bindings are cleared.
+*/
+static int sqlexecRowsetBind(
+  sqlexec_rowset *pRows,
+  int iRow, int iCol,
+  sqlite3_stmt *pStmt,
+  int iParam
+){
+  if (iParam > sqlite3_bind_parameter_count(pStmt))
+    return SQLITE_OK;
+  int iCell = iCol * pRows->nRowAlloc + iRow;
+  const sqlexec_cell *pCell = &pRows->aCell[iCell];
+  switch (pRows->aType[iCell]) {
+    case SQLITE_INTEGER:
+      return sqlite3_bind_int64(pStmt, iParam, pCell->i);
+    case SQLITE_FLOAT:
+      return sqlite3_bind_double(pStmt, iParam, pCell->r);
+    case SQLITE_TEXT:
+      return sqlite3_bind_text64(pStmt, iParam, &pRows->aHeap[pCell->i],
+                                 pRows->anByte[iCell], SQLITE_STATIC,
+                                 SQLITE_UTF8);
+    case SQLITE_BLOB:
+      return sqlite3_bind_blob64(pStmt, iParam, &pRows->aHeap[pCell->i],
+                                 pRows->anByte[iCell], SQLITE_STATIC);
+  }
+  return sqlite3_bind_null(pStmt, iParam);
+}
+
+/*
+** Destructor for TEXT and BLOB values handed out by sqlexecRowsetResult:
+** drops the reference to the rowset whose heap p points into.
+*/
+static void sqlexecRowsetRelease(void *p){
+  sqlexec_rowset *pRows;
+  memcpy(&pRows, (char*)p - SQLEXEC_HEAP_ALIGN, sizeof(pRows));
+  sqlexecRowsetUnref(pRows);
+}
+
+/*
+** Return the value of a column of a rowset as the result of ctx. TEXT and
+** BLOB content is not copied; the result references the rowset instead,
+** unless it is a snapshot. Returns the size of the value in bytes (8 for a
+** number, 0 for NULL).
+*/
+static int sqlexecRowsetResult(
+  sqlexec_rowset *pRows,
+  int iRow, int iCol,
+  sqlite3_context *ctx
+){
+  int iCell = iCol * pRows->nRowAlloc + iRow;
+  const sqlexec_cell *pCell = &pRows->aCell[iCell];
+  int eType = pRows->aType[iCell];
+  if (pRows->pMap != NULL && (eType == SQLITE_TEXT || eType == SQLITE_BLOB)) {
+    /* The file may have been damaged: check the value is in the heap */
+    sqlite3_int64 nByte = pRows->anByte[iCell];
+    if (pCell->i < 0 || nByte < 0 || pCell->i > pRows->nHeap - nByte) {
+      sqlite3_result_null(ctx);
+      return 0;
+    }
+    if (eType == SQLITE_TEXT)
+      sqlite3_result_text64(ctx, &pRows->aHeap[pCell->i], nByte,
+                            SQLITE_TRANSIENT, SQLITE_UTF8);
+    else
+      sqlite3_result_blob64(ctx, &pRows->aHeap[pCell->i], nByte,
+                            SQLITE_TRANSIENT);
+    return (int)nByte;
+  }
+  switch (eType) {
+    case SQLITE_INTEGER:
+      sqlite3_result_int64(ctx, pCell->i);
+      return 8;
+    case SQLITE_FLOAT:
+      sqlite3_result_double(ctx, pCell->r);
+      return 8;
+    case SQLITE_TEXT:
+      pRows->nRef++;
+      sqlite3_result_text64(ctx, &pRows->aHeap[pCell->i],
+                            pRows->anByte[iCell], sqlexecRowsetRelease,
+                            SQLITE_UTF8);
+      return pRows->anByte[iCell];
+    case SQLITE_BLOB:
+      pRows->nRef++;
+      sqlite3_result_blob64(ctx, &pRows->aHeap[pCell->i],
+                            pRows->anByte[iCell], sqlexecRowsetRelease);
+      return pRows->anByte[iCell];
+  }
+  return 0;
+}
+
+/*
+** Returns an estimate of the memory used by a rowset.
+*/
+static sqlite3_int64 sqlexecRowsetBytes(const sqlexec_rowset *pRows){
+  if (pRows->pMap != NULL)
+    return sizeof(*pRows);
+  return sizeof(*pRows) + pRows->nHeapAlloc
+       + (sqlite3_int64)pRows->nCol * pRows->nRowAlloc
+         * (sizeof(sqlexec_cell) + sizeof(int) + 1);
+}
+
+/*
+** Bind the values in apArg to the parameters of pStmt, skipping NULL
+** entries. Values beyond the parameters pStmt has are ignored.
+*/
+static int sqlexecBindArgs(
+  sqlite3_stmt *pStmt,
+  int nArg, sqlite3_value **apArg
+){
+  sqlite3_clear_bindings(pStmt);
+  int nBind = sqlite3_bind_parameter_count(pStmt);
+  for (int i = 0; i < nArg && i < nBind; i++) {
+    if (apArg[i] == NULL)
+      continue;
+    int rc = sqlite3_bind_value(pStmt, i+1, apArg[i]);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  return SQLITE_OK;
+}
+
+#if !defined(SQLEXEC_OMIT_PREFETCH) || !defined(SQLEXEC_OMIT_SNAPSHOT)
+/*
+** Write into *pzSig the ATTACH statements which give a new connection the
+** same attached databases as ours, for prefetch workers and for building
+** snapshots. Databases with no file (in memory, say) are left out, as
+** another connection can't open them.
+*/
+static int sqlexecPrefetchSig(sqlexec_vtab *vtab, char **pzSig){
+  sqlite3_stmt *pStmt;
+  int rc = sqlexecPrepare(vtab, "pragma database_list", 0, &pStmt);
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_str *pStr = sqlite3_str_new(vtab->db);
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    const char *zName = (const char*)sqlite3_column_text(pStmt, 1);
+    const char *zFile = (const char*)sqlite3_column_text(pStmt, 2);
+    if (sqlite3_column_int(pStmt, 0) > 1 && zName && zFile && zFile[0])
+      sqlite3_str_appendf(pStr, "attach %Q as %Q;", zFile, zName);
+  }
+  rc = sqlite3_finalize(pStmt);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_str_errcode(pStr);
+  *pzSig = sqlite3_str_finish(pStr);
+  if (rc == SQLITE_OK && *pzSig == NULL)
+    *pzSig = sqlite3_mprintf("");
+  if (rc == SQLITE_OK && *pzSig == NULL)
+    rc = SQLITE_NOMEM;
+  if (rc != SQLITE_OK) {
+    sqlite3_free(*pzSig);
+    *pzSig = NULL;
+  }
+  return rc;
+}
+#endif
+
+#ifndef SQLEXEC_OMIT_PREFETCH
+/*
+** Called by a worker to wake its cursor, if it is waiting, after making
+** more rows available or finishing a scan, and to tell the application
+** through the file descriptor of sqlexec_notify_fd, if it gave one. We
+** write an 8 byte count of 1, as an eventfd takes. If the descriptor is
+** full the application has been told already, so we don't wait.
+*/
+static void sqlexecPrefetchNotify(sqlexec_prefetch *p){
+  sqlexec_merge *pMerge = p->pMerge;
+  if (atomic_load(&pMerge->bWait)) {
+    pthread_mutex_lock(&pMerge->mutex);
+    pthread_cond_signal(&pMerge->cond);
+    pthread_mutex_unlock(&pMerge->mutex);
+  }
+  int fd = atomic_load(&pMerge->pEnv->fdNotify);
+  if (fd >= 0) {
+    sqlite3_uint64 iOne = 1;
+    if (sqlexecWrite(fd, &iOne, sizeof(iOne)) < 0) {
+      /* Nothing to be done */
+    }
+  }
+}
+
+/*
+** Called by the worker to put a batch of rows into the ring, waiting for
+** room if it is full. Returns false if the scan was cancelled instead, in
+** which case the batch still belongs to the caller.
+*/
+static int sqlexecPrefetchPush(sqlexec_prefetch *p, sqlexec_rowset *pRows){
+  unsigned int iTail = atomic_load(&p->iTail);
+  if (iTail - atomic_load(&p->iHead) >= (unsigned int)p->nSlot) {
+    pthread_mutex_lock(&p->mutex);
+    atomic_store(&p->bWorkerWait, 1);
+    while (iTail - atomic_load(&p->iHead) >= (unsigned int)p->nSlot
+           && !atomic_load(&p->bCancel))
+      pthread_cond_wait(&p->condWorker, &p->mutex);
+    atomic_store(&p->bWorkerWait, 0);
+    pthread_mutex_unlock(&p->mutex);
+  }
+  if (atomic_load(&p->bCancel))
+    return 0;
+  p->apSlot[iTail % p->nSlot] = pRows;
+  atomic_store(&p->iTail, iTail + 1);
+  sqlexecPrefetchNotify(p);
+  return 1;
+}
+
+/*
+** Returns true if the ring of a worker has a batch for the cursor to take.
+*/
+static int sqlexecPrefetchReady(sqlexec_prefetch *p){
+  return atomic_load(&p->iTail) != atomic_load(&p->iHead);
+}
+
+/*
+** Called by the cursor to take the next batch of rows out of the ring of a
+** worker, which must have one (see sqlexecPrefetchReady).
+*/
+static sqlexec_rowset *sqlexecPrefetchTake(sqlexec_prefetch *p){
+  unsigned int iHead = atomic_load(&p->iHead);
+  sqlexec_rowset *pRows = p->apSlot[iHead % p->nSlot];
+  atomic_store(&p->iHead, iHead + 1);
+  if (atomic_load(&p->bWorkerWait)) {
+    pthread_mutex_lock(&p->mutex);
+    pthread_cond_signal(&p->condWorker);
+    pthread_mutex_unlock(&p->mutex);
+  }
+  return pRows;
+}
+
+/*
+** Progress handler of a worker's connection, while it runs a scan with the
+** max_steps or timeout_ms option. The connection is ours, so unlike the
+** cursor (see sqlexecLimitOver) the worker can stop in the middle of a
+** step. Records the limit the scan went over in zOver.
+*/
+static int sqlexecPrefetchProgress(void *pArg){
+  sqlexec_prefetch *p = (sqlexec_prefetch*)pArg;
+  sqlexec_merge *pMerge = p->pMerge;
+  if (pMerge->nMaxSteps > 0
+      && sqlite3_stmt_status(p->pStmt, SQLITE_STMTSTATUS_VM_STEP, 0)
+         > pMerge->nMaxSteps)
+    p->zOver = "max_steps";
+  else if (pMerge->iDeadline > 0 && sqlexecClock() > pMerge->iDeadline)
+    p->zOver = "timeout_ms";
+  return p->zOver != NULL;
+}
+
+/*
+** Run one scan on the worker, putting the rows into the ring in batches of
+** up to nBatch rows.
+*/
+static int sqlexecPrefetchRun(sqlexec_prefetch *p){
+  sqlexec_rowset *pRows = NULL;
+  int rc;
+  while ((rc = sqlite3_step(p->pStmt)) == SQLITE_ROW) {
+    if (pRows == NULL && (pRows = sqlexecRowsetNew(p->nCol)) == NULL) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    rc = sqlexecRowsetAppend(pRows, p->pStmt);
+    if (rc != SQLITE_OK)
+      break;
+    if (pRows->nRow == p->nBatch) {
+      if (!sqlexecPrefetchPush(p, pRows)) {
+        rc = SQLITE_INTERRUPT;
+        break;
+      }
+      pRows = NULL;
+    }
+  }
+  if (rc == SQLITE_DONE && pRows != NULL && sqlexecPrefetchPush(p, pRows))
+    pRows = NULL;
+  sqlexecRowsetUnref(pRows);
+  sqlite3_reset(p->pStmt);
+  if (!sqlite3_get_autocommit(p->db))
+    /* End the read of a snapshot (see sqlexecPrefetchPin) */
+    sqlite3_exec(p->db, "COMMIT", NULL, NULL, NULL);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/*
+** Body of the worker thread: run scans until told to exit. The cursor is
+** told about the end of a scan with mutex still held, so once it has taken
+** mutex itself it knows the worker is done with the sqlexec_merge.
+*/
+static void *sqlexecPrefetchMain(void *pArg){
+  sqlexec_prefetch *p = (sqlexec_prefetch*)pArg;
+  pthread_mutex_lock(&p->mutex);
+  for (;;) {
+    while (atomic_load(&p->eJob) == SQLEXEC_JOB_IDLE)
+      pthread_cond_wait(&p->condWorker, &p->mutex);
+    if (atomic_load(&p->eJob) == SQLEXEC_JOB_QUIT)
+      break;
+    pthread_mutex_unlock(&p->mutex);
+    int rc = sqlexecPrefetchRun(p);
+    char *zErr = NULL;
+    if (rc != SQLITE_OK && p->zOver != NULL)
+      zErr = sqlexecLimitMessage(p->zOver);
+    else if (rc != SQLITE_OK)
+      zErr = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    pthread_mutex_lock(&p->mutex);
+    p->rc = rc;
+    p->zErr = zErr;
+    atomic_store(&p->eJob, SQLEXEC_JOB_IDLE);
+    sqlexecPrefetchNotify(p);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+/*
+** Stop the worker and free it. The worker must not be running a scan.
+*/
+static void sqlexecPrefetchFree(sqlexec_prefetch *p){
+  if (p == NULL)
+    return;
+  if (p->bThread) {
+    pthread_mutex_lock(&p->mutex);
+    atomic_store(&p->eJob, SQLEXEC_JOB_QUIT);
+    pthread_cond_signal(&p->condWorker);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, NULL);
+  }
+  pthread_cond_destroy(&p->condWorker);
+  pthread_mutex_destroy(&p->mutex);
+  sqlite3_finalize(p->pStmt);
+  sqlite3_close(p->db);
+  sqlite3_free(p->zSql);
+  sqlite3_free(p->zSig);
+  sqlite3_free(p->zErr);
+  sqlite3_free(p->apSlot);
+  sqlite3_free(p);
+}
+
+/*
+** Free all the idle workers of a virtual table.
+*/
+static void sqlexecPrefetchFreeIdle(sqlexec_vtab *vtab){
+  while (vtab->pFetchIdle != NULL) {
+    sqlexec_prefetch *p = vtab->pFetchIdle;
+    vtab->pFetchIdle = p->pNext;
+    sqlexecPrefetchFree(p);
+  }
+  vtab->nFetchIdle = 0;
+}
+
+/*
+** Start a new worker with its own read-only connection having the same
+** databases open as vtab->db, as listed by zSig (see sqlexecPrefetchSig).
+** Sets *ppFetch to NULL if the connection can't be opened.
+*/
+static int sqlexecPrefetchNew(
+  sqlexec_vtab *vtab,
+  const char *zSig,
+  sqlexec_prefetch **ppFetch
+){
+  *ppFetch = NULL;
+  sqlexec_prefetch *p = sqlite3_malloc(sizeof(*p));
+  if (p == NULL)
+    return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->condWorker, NULL);
+  atomic_init(&p->eJob, SQLEXEC_JOB_IDLE);
+  atomic_init(&p->iHead, 0);
+  atomic_init(&p->iTail, 0);
+  atomic_init(&p->bWorkerWait, 0);
+  atomic_init(&p->bCancel, 0);
+  sqlite3_int64 nPrefetch = vtab->opts.nPrefetch;
+  p->nBatch = nPrefetch < SQLEXEC_PREFETCH_BATCH
+            ? (int)nPrefetch : SQLEXEC_PREFETCH_BATCH;
+  p->nSlot = (int)((nPrefetch + p->nBatch - 1) / p->nBatch);
+  if (p->nSlot < 2)
+    p->nSlot = 2;
+  p->apSlot = sqlite3_malloc64(p->nSlot * sizeof(*p->apSlot));
+  p->zSig = sqlite3_mprintf("%s", zSig);
+  if (p->apSlot == NULL || p->zSig == NULL) {
+    sqlexecPrefetchFree(p);
+    return SQLITE_NOMEM;
+  }
+
+  int rc = sqlite3_open_v2(sqlite3_db_filename(vtab->db, "main"), &p->db,
+                           SQLITE_OPEN_READONLY, NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec(p->db, zSig, NULL, NULL, NULL);
+  if (rc == SQLITE_OK
+      && pthread_create(&p->thread, NULL, sqlexecPrefetchMain, p) == 0) {
+    p->bThread = 1;
+    *ppFetch = p;
+    return SQLITE_OK;
+  }
+  sqlexecPrefetchFree(p);
+  return rc == SQLITE_NOMEM ? rc : SQLITE_OK;
+}
+
+/*
+** Make sure a cursor has at least nWorker prefetch workers, taking them from
+** the virtual table's idle ones if their connections still have the same
+** databases open as ours, or else starting new ones. Leaves pMerge->nHave
+** short if we can't have workers (the main database is in memory, say),
+** and then we don't try again.
+*/
+static int sqlexecPrefetchCheckout(
+  sqlexec_vtab *vtab,
+  sqlexec_merge *pMerge,
+  int nWorker
+){
+  const char *zMain = sqlite3_db_filename(vtab->db, "main");
+  if (zMain == NULL || zMain[0] == 0) {
+    vtab->bPrefetchOff = 1;
+    return SQLITE_OK;
+  }
+  char *zSig;
+  int rc = sqlexecPrefetchSig(vtab, &zSig);
+  if (rc != SQLITE_OK)
+    return rc;
+  for (int i = 0; i < pMerge->nHave; i++) {
+    if (strcmp(pMerge->apWorker[i]->zSig, zSig) != 0) {
+      /* Attached databases changed: start over */
+      for (int j = 0; j < pMerge->nHave; j++)
+        sqlexecPrefetchFree(pMerge->apWorker[j]);
+      pMerge->nHave = 0;
+      break;
+    }
+  }
+  while (pMerge->nHave < nWorker && rc == SQLITE_OK) {
+    sqlexec_prefetch *p = vtab->pFetchIdle;
+    if (p != NULL) {
+      vtab->pFetchIdle = p->pNext;
+      vtab->nFetchIdle--;
+      if (strcmp(p->zSig, zSig) != 0
+          || strcmp(sqlite3_db_filename(p->db, "main"), zMain) != 0) {
+        sqlexecPrefetchFree(p);
+        continue;
+      }
+    } else {
+      rc = sqlexecPrefetchNew(vtab, zSig, &p);
+      if (rc != SQLITE_OK)
+        break;
+      if (p == NULL) {
+        vtab->bPrefetchOff = 1;
+        break;
+      }
+    }
+    pMerge->apWorker[pMerge->nHave++] = p;
+  }
+  sqlite3_free(zSig);
+  return rc;
+}
+
+/*
+** Stop the scan the prefetch workers of a cursor are running, if any, and
+** throw away the rows they fetched which the cursor hasn't taken.
+*/
+static void sqlexecPrefetchStop(sqlexec_cursor *pCur){
+  sqlexec_merge *pMerge = pCur->pMerge;
+  if (pMerge == NULL || !pCur->bFetching)
+    return;
+  pCur->bFetching = 0;
+  for (int i = 0; i < pMerge->nWorker; i++) {
+    sqlexec_prefetch *p = pMerge->apWorker[i];
+    atomic_store(&p->bCancel, 1);
+    pthread_mutex_lock(&p->mutex);
+    if (atomic_load(&p->eJob) == SQLEXEC_JOB_RUN)
+      sqlite3_interrupt(p->db);
+    pthread_cond_signal(&p->condWorker);
+    pthread_mutex_unlock(&p->mutex);
+  }
+  pthread_mutex_lock(&pMerge->mutex);
+  atomic_store(&pMerge->bWait, 1);
+  for (int i = 0; i < pMerge->nWorker; i++) {
+    while (atomic_load(&pMerge->apWorker[i]->eJob) == SQLEXEC_JOB_RUN)
+      pthread_cond_wait(&pMerge->cond, &pMerge->mutex);
+  }
+  atomic_store(&pMerge->bWait, 0);
+  pthread_mutex_unlock(&pMerge->mutex);
+  for (int i = 0; i < pMerge->nWorker; i++) {
+    sqlexec_prefetch *p = pMerge->apWorker[i];
+    unsigned int iTail = atomic_load(&p->iTail);
+    for (unsigned int j = atomic_load(&p->iHead); j != iTail; j++)
+      sqlexecRowsetUnref(p->apSlot[j % p->nSlot]);
+    atomic_store(&p->iHead, iTail);
+    atomic_store(&p->bCancel, 0);
+  }
+}
+
+/*
+** Give the prefetch workers of a closing cursor to the virtual table to
+** keep, as many as one cursor uses, and free the rest.
+*/
+static void sqlexecPrefetchCheckin(sqlexec_vtab *vtab, sqlexec_cursor *pCur){
+  sqlexec_merge *pMerge = pCur->pMerge;
+  sqlexecPrefetchStop(pCur);
+  /* Last first, so the next cursor gets them back in the same order */
+  for (int i = pMerge->nHave - 1; i >= 0; i--) {
+    sqlexec_prefetch *p = pMerge->apWorker[i];
+    /* Wait for the worker to be done telling us its scan ended */
+    pthread_mutex_lock(&p->mutex);
+    pthread_mutex_unlock(&p->mutex);
+    if (vtab->nFetchIdle < pMerge->nAlloc) {
+      p->pNext = vtab->pFetchIdle;
+      vtab->pFetchIdle = p;
+      vtab->nFetchIdle++;
+    } else {
+      sqlexecPrefetchFree(p);
+    }
+  }
+  sqlexec_merge **pp = &pMerge->pEnv->pMerge;
+  while (*pp != pMerge)
+    pp = &(*pp)->pNextMerge;
+  *pp = pMerge->pNextMerge;
+  pthread_cond_destroy(&pMerge->cond);
+  pthread_mutex_destroy(&pMerge->mutex);
+  sqlite3_free(pMerge->apWorker);
+  sqlite3_free(pMerge);
+  pCur->pMerge = NULL;
+}
+
+/*
+** Find the smallest and largest values of the partition column among the
+** rows zSql returns, so we can divide the range between them into slices.
+** Sets *pbOk if they are integers. Each is found by a statement of its
+** own, which SQLite can often answer from the first row of an index rather
+** than by scanning all the rows. (One statement using SQLEXEC_SRC twice
+** would have it materialized.) If zSql is a rewrite, the statements keep
+** its WHERE clause, the rest of it after the name of SQLEXEC_SRC.
+*/
+static int sqlexecPartitionRange(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zSql,
+  sqlite3_int64 *piMin,
+  sqlite3_int64 *piMax,
+  int *pbOk
+){
+  int rc = SQLITE_OK;
+  int nOk = 0;
+  *pbOk = 0;
+  const char *zWhere = "";
+  if (zSql != vtab->sql) {
+    zWhere = strstr(zSql + strlen(vtab->zSrc), " FROM " SQLEXEC_SRC);
+    zWhere = zWhere ? zWhere + strlen(" FROM " SQLEXEC_SRC) : "";
+  }
+  for (int i = 0; i < 2 && rc == SQLITE_OK; i++) {
+    char *zRange = sqlite3_mprintf("%s SELECT %s(c%d) FROM " SQLEXEC_SRC "%s",
+                                   vtab->zSrc, i ? "max" : "min",
+                                   vtab->iPartCol, zWhere);
+    if (zRange == NULL)
+      return SQLITE_NOMEM;
+    if (vtab->azRangeSql[i] == NULL
+        || strcmp(vtab->azRangeSql[i], zRange) != 0) {
+      sqlite3_finalize(vtab->apRangeStmt[i]);
+      sqlite3_free(vtab->azRangeSql[i]);
+      vtab->apRangeStmt[i] = NULL;
+      vtab->azRangeSql[i] = NULL;
+      rc = sqlexecPrepare(vtab, zRange, SQLITE_PREPARE_PERSISTENT,
+                          &vtab->apRangeStmt[i]);
+      if (rc != SQLITE_OK) {
+        sqlite3_free(zRange);
+        return rc;
+      }
+      vtab->azRangeSql[i] = zRange;
+    } else {
+      sqlite3_free(zRange);
+    }
+    sqlite3_stmt *pStmt = vtab->apRangeStmt[i];
+    rc = sqlexecBindArgs(pStmt, pCur->nArg, pCur->apArg);
+    if (rc == SQLITE_OK && (rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+      rc = SQLITE_OK;
+      if (sqlite3_column_type(pStmt, 0) == SQLITE_INTEGER) {
+        *(i ? piMax : piMin) = sqlite3_column_int64(pStmt, 0);
+        nOk++;
+      }
+    } else if (rc != SQLITE_OK) {
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    }
+    sqlite3_reset(pStmt);
+  }
+  *pbOk = nOk == 2;
+  return rc;
+}
+
+/*
+** Build the SQL for slice iSlice of nSlice of a partitioned scan of zSql,
+** which is vtab->sql or a rewrite of it. The rewrite reads the rows from
+** SQLEXEC_SRC, so we rename the SQL to SQLEXEC_ALL and make SQLEXEC_SRC
+** the rows of the slice: those whose partition column is from parameter
+** nArg+1 up to, but not including, parameter nArg+2. The first slice has
+** no lower limit, and the last no upper one. Rows where the column is NULL
+** are in no slice: taking them in the first would cost a full scan when
+** the column is a rowid, which never is NULL.
+*/
+static char *sqlexecSliceSql(
+  sqlexec_vtab *vtab,
+  const char *zSql,
+  int iSlice, int nSlice,
+  int nArg
+){
+  const char *zTail = zSql == vtab->sql ? " SELECT * FROM " SQLEXEC_SRC
+                    : zSql + strlen(vtab->zSrc);
+  const char *zDefn = vtab->zSrc + strlen("WITH " SQLEXEC_SRC);
+  int iCol = vtab->iPartCol;
+  sqlite3_str *pStr = sqlite3_str_new(vtab->db);
+  sqlite3_str_appendf(pStr, "WITH " SQLEXEC_ALL "%s, " SQLEXEC_SRC
+                      " AS (SELECT * FROM " SQLEXEC_ALL " WHERE ", zDefn);
+  if (iSlice > 0)
+    sqlite3_str_appendf(pStr, "c%d >= ?%d", iCol, nArg + 1);
+  if (iSlice > 0 && iSlice < nSlice - 1)
+    sqlite3_str_appendall(pStr, " AND ");
+  if (iSlice < nSlice - 1)
+    sqlite3_str_appendf(pStr, "c%d < ?%d", iCol, nArg + 2);
+  sqlite3_str_appendf(pStr, ")%s", zTail);
+  return sqlite3_str_finish(pStr);
+}
+
+/*
+** End the transactions sqlexecPrefetchPin began for workers iFrom up to,
+** but not including, iTo of pMerge, which aren't running a scan.
+*/
+static void sqlexecPrefetchUnpin(sqlexec_merge *pMerge, int iFrom, int iTo){
+  for (int i = iFrom; i < iTo; i++) {
+    sqlite3 *db = pMerge->apWorker[i]->db;
+    if (!sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  }
+}
+
+/*
+** Make sure the first nWorker prefetch workers of pMerge will read what
+** our connection reads, and set *pbPinned if they will. A worker reads the
+** latest data, which another connection may have committed since our read
+** transaction began; and SQLite begins one on the database of the virtual
+** table before any scan of it, so we are always in one.
+**
+** In rollback journal mode our read lock keeps out any commit, so that is
+** enough. In WAL mode it isn't, and the workers must be made to read the
+** snapshot we read, which needs a SQLite built with SQLITE_ENABLE_SNAPSHOT
+** and our connection in an explicit transaction, for sqlite3_snapshot_get.
+** Each worker is then left in a transaction its scan ends (see
+** sqlexecPrefetchRun). A database we aren't reading yet could change
+** between two scans of one statement, so we don't pin that either.
+*/
+static int sqlexecPrefetchPin(
+  sqlexec_vtab *vtab,
+  sqlexec_merge *pMerge,
+  int nWorker,
+  int *pbPinned
+){
+  *pbPinned = 0;
+  sqlite3_stmt *pList;
+  int rc = sqlexecPrepare(vtab, "pragma database_list", 0, &pList);
+  if (rc != SQLITE_OK)
+    return rc;
+  int bOk = 1;
+  while (bOk && rc == SQLITE_OK && sqlite3_step(pList) == SQLITE_ROW) {
+    const char *zName = (const char*)sqlite3_column_text(pList, 1);
+    const char *zFile = (const char*)sqlite3_column_text(pList, 2);
+    if (zName == NULL || zFile == NULL || zFile[0] == 0
+        || sqlite3_stricmp(zName, "temp") == 0)
+      continue;   /* The workers don't have it (see sqlexecPrefetchSig) */
+    if (sqlite3_txn_state(vtab->db, zName) == SQLITE_TXN_NONE) {
+      bOk = 0;
+      break;
+    }
+    char *sql = sqlite3_mprintf("pragma \"%w\".journal_mode", zName);
+    sqlite3_stmt *pMode = NULL;
+    rc = sql ? sqlexecPrepare(vtab, sql, 0, &pMode) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+      break;
+    int bWal = sqlite3_step(pMode) == SQLITE_ROW
+            && sqlite3_stricmp((const char*)sqlite3_column_text(pMode, 0),
+                               "wal") == 0;
+    sqlite3_finalize(pMode);
+    if (!bWal)
+      continue;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    sqlite3_snapshot *pSnap;
+    if (sqlite3_get_autocommit(vtab->db)
+        || sqlite3_snapshot_get(vtab->db, zName, &pSnap) != SQLITE_OK) {
+      bOk = 0;
+      break;
+    }
+    for (int i = 0; i < nWorker && bOk; i++) {
+      sqlite3 *db = pMerge->apWorker[i]->db;
+      bOk = (!sqlite3_get_autocommit(db)
+             || sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK)
+         && sqlite3_snapshot_open(db, zName, pSnap) == SQLITE_OK;
+    }
+    sqlite3_snapshot_free(pSnap);
+#else
+    bOk = 0;
+#endif
+  }
+  sqlite3_finalize(pList);
+  if (rc != SQLITE_OK || !bOk) {
+    sqlexecPrefetchUnpin(pMerge, 0, nWorker);
+    return rc;
+  }
+  *pbPinned = 1;
+  return SQLITE_OK;
+}
+
+/*
+** Have prefetch worker p run zSql, binding the nArg values in apArg, and
+** then iLo and iHi to the next two parameters if zSql has them.
+*/
+static int sqlexecPrefetchRunSql(
+  sqlexec_vtab *vtab,
+  sqlexec_merge *pMerge,
+  sqlexec_prefetch *p,
+  const char *zSql,
+  int nArg, sqlite3_value **apArg,
+  sqlite3_int64 iLo, sqlite3_int64 iHi
+){
+  int rc;
+  if (p->zSql == NULL || strcmp(p->zSql, zSql) != 0) {
+    sqlite3_finalize(p->pStmt);
+    sqlite3_free(p->zSql);
+    p->pStmt = NULL;
+    p->zSql = NULL;
+    rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                            &p->pStmt, NULL);
+    if (rc != SQLITE_OK)
+      return rc;
+    p->zSql = sqlite3_mprintf("%s", zSql);
+    if (p->zSql == NULL)
+      return SQLITE_NOMEM;
+  }
+  rc = sqlexecBindArgs(p->pStmt, nArg, apArg);
+  int nBind = sqlite3_bind_parameter_count(p->pStmt);
+  if (rc == SQLITE_OK && nArg + 1 <= nBind)
+    rc = sqlite3_bind_int64(p->pStmt, nArg + 1, iLo);
+  if (rc == SQLITE_OK && nArg + 2 <= nBind)
+    rc = sqlite3_bind_int64(p->pStmt, nArg + 2, iHi);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  /* Taking mutex also waits for the worker to finish with its last scan */
+  pthread_mutex_lock(&p->mutex);
+  p->nCol = vtab->nCol;
+  p->pMerge = pMerge;
+  p->bDrained = 0;
+  p->zOver = NULL;
+  sqlite3_stmt_status(p->pStmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+  if (pMerge->nMaxSteps > 0 || pMerge->iDeadline > 0)
+    sqlite3_progress_handler(p->db, SQLEXEC_PROGRESS_OPS,
+                             sqlexecPrefetchProgress, p);
+  else
+    sqlite3_progress_handler(p->db, 0, NULL, NULL);
+  sqlite3_free(p->zErr);
+  p->zErr = NULL;
+  p->rc = SQLITE_OK;
+  atomic_store(&p->eJob, SQLEXEC_JOB_RUN);
+  pthread_cond_signal(&p->condWorker);
+  pthread_mutex_unlock(&p->mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Have the prefetch workers of a cursor run zSql, with the values in
+** pCur->apArg bound to it, and set *pbStarted. With the partition option,
+** each worker runs a slice of the rows (see sqlexecSliceSql), dividing the
+** range of values of the partition column evenly between them. All the
+** slices read one snapshot, the one our connection reads.
+**
+** If the workers can't run the scan (zSql uses something only our
+** connection has, like a temp table, or we are in a write transaction
+** whose changes the workers wouldn't see), we leave *pbStarted clear and
+** the cursor runs the scan itself. So we do if the workers can't be made
+** to read what our connection reads (see sqlexecPrefetchPin).
+*/
+static int sqlexecPrefetchStart(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zSql,
+  int *pbStarted
+){
+  int rc;
+  *pbStarted = 0;
+  if (vtab->bPrefetchOff
+      || sqlite3_txn_state(vtab->db, NULL) == SQLITE_TXN_WRITE)
+    return SQLITE_OK;
+
+  sqlexec_merge *pMerge = pCur->pMerge;
+  if (pMerge == NULL) {
+    int nAlloc = vtab->nPart > 1 ? vtab->nPart : 1;
+    pMerge = sqlite3_malloc(sizeof(*pMerge));
+    if (pMerge == NULL)
+      return SQLITE_NOMEM;
+    memset(pMerge, 0, sizeof(*pMerge));
+    pMerge->apWorker = sqlite3_malloc64(nAlloc * sizeof(*pMerge->apWorker));
+    if (pMerge->apWorker == NULL) {
+      sqlite3_free(pMerge);
+      return SQLITE_NOMEM;
+    }
+    pMerge->nAlloc = nAlloc;
+    pthread_mutex_init(&pMerge->mutex, NULL);
+    pthread_cond_init(&pMerge->cond, NULL);
+    atomic_init(&pMerge->bWait, 0);
+    pMerge->pEnv = vtab->pEnv;
+    pMerge->pCur = pCur;
+    pMerge->pNextMerge = vtab->pEnv->pMerge;
+    vtab->pEnv->pMerge = pMerge;
+    pCur->pMerge = pMerge;
+  }
+  int nWant = vtab->nPart > 1 ? vtab->nPart : 1;
+  rc = sqlexecPrefetchCheckout(vtab, pMerge, nWant);
+  if (rc != SQLITE_OK || pMerge->nHave < nWant)
+    return rc;
+  int bPinned;
+  rc = sqlexecPrefetchPin(vtab, pMerge, nWant, &bPinned);
+  if (rc != SQLITE_OK || !bPinned)
+    return rc;
+
+  /*
+  ** The range of the partition column is read by our connection, so from
+  ** the snapshot the slices read too: otherwise a row whose value changed
+  ** in between could be in two slices or in none.
+  */
+  int nSlice = 1;
+  sqlite3_int64 iMin = 0;
+  sqlite3_uint64 iStep = 0;
+  if (vtab->nPart > 1) {
+    sqlite3_int64 iMax;
+    int bOk;
+    rc = sqlexecPartitionRange(vtab, pCur, zSql, &iMin, &iMax, &bOk);
+    if (rc != SQLITE_OK) {
+      sqlexecPrefetchUnpin(pMerge, 0, nWant);
+      return rc;
+    }
+    if (bOk) {
+      sqlite3_uint64 nSpan = (sqlite3_uint64)iMax - (sqlite3_uint64)iMin;
+      nSlice = nSpan < (sqlite3_uint64)vtab->nPart - 1
+             ? (int)nSpan + 1 : vtab->nPart;
+      iStep = nSpan / nSlice + 1;
+    }
+  }
+  sqlexecPrefetchUnpin(pMerge, nSlice, nWant);
+
+  /* Don't hold a read transaction open on a statement we aren't using */
+  if (pCur->pStmt != NULL)
+    sqlite3_reset(pCur->pStmt);
+
+  pMerge->nWorker = 0;
+  pMerge->iNext = 0;
+  pMerge->bOrdered = vtab->bPartOrdered;
+  pMerge->nMaxSteps = vtab->opts.nMaxSteps;
+  pMerge->iDeadline = pCur->iDeadline;
+  pCur->bFetching = 1;
+  for (int i = 0; i < nSlice; i++) {
+    char *zSlice = NULL;
+    if (nSlice > 1) {
+      zSlice = sqlexecSliceSql(vtab, zSql, i, nSlice, pCur->nArg);
+      if (zSlice == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    sqlite3_uint64 iLo = (sqlite3_uint64)i * iStep;
+    sqlite3_uint64 iHi = iLo + iStep;
+    rc = sqlexecPrefetchRunSql(vtab, pMerge, pMerge->apWorker[i],
+                               zSlice ? zSlice : zSql,
+                               pCur->nArg, pCur->apArg,
+                               (sqlite3_int64)((sqlite3_uint64)iMin + iLo),
+                               (sqlite3_int64)((sqlite3_uint64)iMin + iHi));
+    sqlite3_free(zSlice);
+    if (rc != SQLITE_OK)
+      break;
+    pMerge->nWorker++;
+  }
+  if (rc != SQLITE_OK) {
+    sqlexecPrefetchStop(pCur);
+    sqlexecPrefetchUnpin(pMerge, 0, nSlice);
+    if (rc == SQLITE_NOMEM)
+      return rc;
+    vtab->bPrefetchOff = 1;
+    return SQLITE_OK;
+  }
+  *pbStarted = 1;
+  return SQLITE_OK;
+}
+
+/*
+** Returns true if the cursor has to wait for its workers before it can take
+** another batch or see the end of the scan: in order, the next worker has
+** no batch and is still running; otherwise all of them are in that state.
+*/
+static int sqlexecMergeBusy(sqlexec_merge *pMerge){
+  for (int i = pMerge->iNext; i < pMerge->nWorker; i++) {
+    sqlexec_prefetch *p = pMerge->apWorker[i];
+    int bBusy = !sqlexecPrefetchReady(p)
+             && atomic_load(&p->eJob) == SQLEXEC_JOB_RUN;
+    if (pMerge->bOrdered)
+      return bBusy;
+    if (!p->bDrained && !bBusy)
+      return 0;
+  }
+  for (int i = 0; i < pMerge->iNext; i++) {
+    sqlexec_prefetch *p = pMerge->apWorker[i];
+    if (!p->bDrained && (sqlexecPrefetchReady(p)
+                         || atomic_load(&p->eJob) != SQLEXEC_JOB_RUN))
+      return 0;
+  }
+  return !pMerge->bOrdered;
+}
+
+/*
+** Move a cursor on to the next batch of rows from its prefetch workers,
+** waiting for one if need be. If the merge is ordered we take every batch
+** of one worker before moving on to the next, so the slices come out in
+** order; otherwise we go round the workers taking whatever is ready. At
+** the end of the scan pCur->pRows is left NULL, and if a worker failed we
+** return its error.
+*/
+static int sqlexecPrefetchNext(sqlexec_cursor *pCur){
+  sqlexec_merge *pMerge = pCur->pMerge;
+  sqlexecRowsetUnref(pCur->pRows);
+  pCur->pRows = NULL;
+  for (;;) {
+    int bRunning = 0;
+    int n = 0;
+    while (n < pMerge->nWorker && pMerge->iNext < pMerge->nWorker) {
+      int i = pMerge->bOrdered ? pMerge->iNext
+            : (pMerge->iNext + n) % pMerge->nWorker;
+      sqlexec_prefetch *p = pMerge->apWorker[i];
+      if (p->bDrained) {
+        n++;
+        continue;
+      }
+      /* Look at eJob first: a worker pushes its last batch before it ends */
+      int eJob = atomic_load(&p->eJob);
+      if (sqlexecPrefetchReady(p)) {
+        pCur->pRows = sqlexecPrefetchTake(p);
+        pCur->iRowBase = pCur->iRowid;
+        if (!pMerge->bOrdered)
+          pMerge->iNext = (i + 1) % pMerge->nWorker;
+        return SQLITE_OK;
+      }
+      if (eJob == SQLEXEC_JOB_RUN) {
+        bRunning = 1;
+        if (pMerge->bOrdered)
+          break;
+        n++;
+        continue;
+      }
+      p->bDrained = 1;
+      if (p->rc != SQLITE_OK) {
+        sqlite3_vtab *pVtab = pCur->base.pVtab;
+        if (p->zOver != NULL)
+          sqlexecStatAdd((sqlexec_vtab*)pVtab, nStop, 1);
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("%s", p->zErr);
+        sqlexecPrefetchStop(pCur);
+        return p->rc;
+      }
+      if (pMerge->bOrdered)
+        pMerge->iNext++;
+      else
+        n++;
+    }
+    if (!bRunning) {
+      pCur->bFetching = 0;
+      return SQLITE_OK;
+    }
+    pthread_mutex_lock(&pMerge->mutex);
+    atomic_store(&pMerge->bWait, 1);
+    while (sqlexecMergeBusy(pMerge))
+      pthread_cond_wait(&pMerge->cond, &pMerge->mutex);
+    atomic_store(&pMerge->bWait, 0);
+    pthread_mutex_unlock(&pMerge->mutex);
+  }
+}
+#else
+# define sqlexecPrefetchFreeIdle(vtab) ((void)0)
+# define sqlexecPrefetchStop(pCur) ((void)0)
+# define sqlexecPrefetchCheckin(vtab, pCur) ((void)0)
+# define sqlexecPrefetchStart(vtab, pCur, zSql, pbStarted) \
+         (*(pbStarted) = 0, SQLITE_OK)
+# define sqlexecPrefetchNext(pCur) SQLITE_OK
+#endif /* SQLEXEC_OMIT_PREFETCH */
+
+/*
+** Add n bytes at p to FNV-1a hash h.
+*/
+static unsigned int sqlexecHashBytes(unsigned int h, const void *p, int n){
+  for (int i = 0; i < n; i++)
+    h = (h ^ ((const unsigned char*)p)[i]) * 16777619u;
+  return h;
+}
+
+/*
+** Add a value to 64-bit FNV-1a hash h: the datatype eType, then nByte bytes
+** at p, which are the number for an INTEGER or a FLOAT.
+*/
+static sqlite3_uint64 sqlexecHashValue64(
+  sqlite3_uint64 h,
+  int eType,
+  const void *p, sqlite3_int64 nByte
+){
+  h = (h ^ (unsigned char)eType) * 1099511628211ull;
+  for (sqlite3_int64 i = 0; i < nByte; i++)
+    h = (h ^ ((const unsigned char*)p)[i]) * 1099511628211ull;
+  return h;
+}
+
+/*
+** Hash SQL text and an array of parameter values.
+*/
+static unsigned int sqlexecHashKey(
+  const char *zSql,
+  int nArg, sqlite3_value **apArg
+){
+  unsigned int h = sqlexecHashBytes(2166136261u, zSql, (int)strlen(zSql));
+  for (int i = 0; i < nArg; i++) {
+    sqlite3_value *pVal = apArg[i];
+    unsigned char eType = pVal ? sqlite3_value_type(pVal) : 0;
+    h = sqlexecHashBytes(h, &eType, 1);
+    if (eType == SQLITE_INTEGER) {
+      sqlite3_int64 v = sqlite3_value_int64(pVal);
+      h = sqlexecHashBytes(h, &v, sizeof(v));
+    } else if (eType == SQLITE_FLOAT) {
+      double v = sqlite3_value_double(pVal);
+      h = sqlexecHashBytes(h, &v, sizeof(v));
+    } else if (eType == SQLITE_TEXT) {
+      h = sqlexecHashBytes(h, sqlite3_value_text(pVal),
+                           sqlite3_value_bytes(pVal));
+    } else if (eType == SQLITE_BLOB) {
+      h = sqlexecHashBytes(h, sqlite3_value_blob(pVal),
+                           sqlite3_value_bytes(pVal));
+    }
+  }
+  return h;
+}
+
+/*
+** Returns true if two parameter values (either of which may be NULL, for an
+** unbound parameter) are the same value of the same datatype.
+*/
+static int sqlexecValueSame(sqlite3_value *a, sqlite3_value *b){
+  int eType = a ? sqlite3_value_type(a) : 0;
+  if (eType != (b ? sqlite3_value_type(b) : 0))
+    return 0;
+  switch (eType) {
+    case SQLITE_INTEGER:
+      return sqlite3_value_int64(a) == sqlite3_value_int64(b);
+    case SQLITE_FLOAT:
+      return sqlite3_value_double(a) == sqlite3_value_double(b);
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+      const void *pA = eType == SQLITE_TEXT ? (const void*)sqlite3_value_text(a)
+                                            : sqlite3_value_blob(a);
+      const void *pB = eType == SQLITE_TEXT ? (const void*)sqlite3_value_text(b)
+                                            : sqlite3_value_blob(b);
+      int n = sqlite3_value_bytes(a);
+      return n == sqlite3_value_bytes(b) && (n == 0 || memcmp(pA, pB, n) == 0);
+    }
+  }
+  return 1;
+}
+
+/*
+** Unlink an entry from the LRU list of a cache.
+*/
+static void sqlexecLruUnlink(sqlexec_cache *pCache, sqlexec_cache_entry *p){
+  if (p->pLruPrev)
+    p->pLruPrev->pLruNext = p->pLruNext;
+  else
+    pCache->pLruFirst = p->pLruNext;
+  if (p->pLruNext)
+    p->pLruNext->pLruPrev = p->pLruPrev;
+  else
+    pCache->pLruLast = p->pLruPrev;
+  p->pLruNext = p->pLruPrev = NULL;
+}
+
+/*
+** Link an entry onto the front (most recently used end) of the LRU list.
+*/
+static void sqlexecLruPush(sqlexec_cache *pCache, sqlexec_cache_entry *p){
+  p->pLruPrev = NULL;
+  p->pLruNext = pCache->pLruFirst;
+  if (pCache->pLruFirst)
+    pCache->pLruFirst->pLruPrev = p;
+  else
+    pCache->pLruLast = p;
+  pCache->pLruFirst = p;
+}
+
+/*
+** Remove an entry from a cache and free it.
+*/
+static void sqlexecCacheRemove(sqlexec_cache *pCache, sqlexec_cache_entry *p){
+  sqlexec_cache_entry **pp = &pCache->apBucket[p->iHash % pCache->nBucket];
+  while (*pp != p)
+    pp = &(*pp)->pHashNext;
+  *pp = p->pHashNext;
+  sqlexecLruUnlink(pCache, p);
+  pCache->nEntry--;
+  pCache->nByte -= p->nByte;
+  for (int i = 0; i < p->nArg; i++)
+    sqlite3_value_free(p->apArg[i]);
+  sqlite3_free(p->zSql);
+  sqlexecRowsetUnref(p->pRows);
+  sqlite3_free(p);
+}
+
+/*
+** Remove all entries from a cache. The hit and miss counters are kept.
+*/
+static void sqlexecCacheClear(sqlexec_cache *pCache){
+  while (pCache->pLruFirst)
+    sqlexecCacheRemove(pCache, pCache->pLruFirst);
+  sqlite3_free(pCache->apBucket);
+  pCache->apBucket = NULL;
+  pCache->nBucket = 0;
+}
+
+/*
+** Look up the rows for zSql with parameter values apArg. If found, the entry
+** becomes the most recently used, and a new reference to its rows is
+** returned. Otherwise returns NULL.
+*/
+static sqlexec_rowset *sqlexecCacheLookup(
+  sqlexec_cache *pCache,
+  unsigned int iHash,
+  const char *zSql,
+  int nArg, sqlite3_value **apArg
+){
+  sqlexec_cache_entry *p = NULL;
+  if (pCache->nBucket > 0)
+    p = pCache->apBucket[iHash % pCache->nBucket];
+  for (; p != NULL; p = p->pHashNext) {
+    if (p->iHash != iHash || p->nArg != nArg || strcmp(p->zSql, zSql) != 0)
+      continue;
+    int i;
+    for (i = 0; i < nArg && sqlexecValueSame(p->apArg[i], apArg[i]); i++)
+      ;
+    if (i == nArg)
+      break;
+  }
+  if (p == NULL) {
+    pCache->nMiss++;
+    return NULL;
+  }
+  pCache->nHit++;
+  sqlexecLruUnlink(pCache, p);
+  sqlexecLruPush(pCache, p);
+  p->pRows->nRef++;
+  return p->pRows;
+}
+
+/*
+** Add rows to a cache, throwing out least recently used entries until the
+** cache fits within its budget of nBudget bytes. Rows which would take up
+** the budget all by themselves are not added. The cache takes a reference
+** of its own to pRows.
+*/
+static int sqlexecCacheInsert(
+  sqlexec_cache *pCache,
+  sqlite3_int64 nBudget,
+  unsigned int iHash,
+  const char *zSql,
+  int nArg, sqlite3_value **apArg,
+  sqlexec_rowset *pRows
+){
+  sqlite3_int64 nByte = sizeof(sqlexec_cache_entry) + strlen(zSql) + 1
+                      + nArg * sizeof(sqlite3_value*)
+                      + sqlexecRowsetBytes(pRows);
+  for (int i = 0; i < nArg; i++)
+    nByte += apArg[i] ? sqlite3_value_bytes(apArg[i]) + 64 : 0;
+  if (nByte > nBudget)
+    return SQLITE_OK;
+  while (pCache->nByte + nByte > nBudget)
+    sqlexecCacheRemove(pCache, pCache->pLruLast);
+
+  if (pCache->nEntry >= pCache->nBucket) {
+    int nNew = pCache->nBucket ? pCache->nBucket*2 : 16;
+    sqlexec_cache_entry **apNew = sqlite3_malloc64(nNew * sizeof(*apNew));
+    if (apNew == NULL)
+      return SQLITE_NOMEM;
+    memset(apNew, 0, nNew * sizeof(*apNew));
+    for (int i = 0; i < pCache->nBucket; i++) {
+      sqlexec_cache_entry *p = pCache->apBucket[i];
+      while (p) {
+        sqlexec_cache_entry *pNext = p->pHashNext;
+        p->pHashNext = apNew[p->iHash % nNew];
+        apNew[p->iHash % nNew] = p;
+        p = pNext;
+      }
+    }
+    sqlite3_free(pCache->apBucket);
+    pCache->apBucket = apNew;
+    pCache->nBucket = nNew;
+  }
+
+  sqlexec_cache_entry *p = sqlite3_malloc64(sizeof(*p)
+                                            + nArg * sizeof(sqlite3_value*));
+  if (p == NULL)
+    return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  p->apArg = (sqlite3_value**)&p[1];
+  p->zSql = sqlite3_mprintf("%s", zSql);
+  if (p->zSql == NULL) {
+    sqlite3_free(p);
+    return SQLITE_NOMEM;
+  }
+  for (int i = 0; i < nArg; i++) {
+    if (apArg[i] == NULL)
+      continue;
+    p->apArg[i] = sqlite3_value_dup(apArg[i]);
+    if (p->apArg[i] == NULL) {
+      for (int j = 0; j < i; j++)
+        sqlite3_value_free(p->apArg[j]);
+      sqlite3_free(p->zSql);
+      sqlite3_free(p);
+      return SQLITE_NOMEM;
+    }
+  }
+  p->nArg = nArg;
+  p->iHash = iHash;
+  p->pRows = pRows;
+  pRows->nRef++;
+  p->nByte = nByte;
+  p->pHashNext = pCache->apBucket[iHash % pCache->nBucket];
+  pCache->apBucket[iHash % pCache->nBucket] = p;
+  sqlexecLruPush(pCache, p);
+  pCache->nEntry++;
+  pCache->nByte += nByte;
+  return SQLITE_OK;
+}
+
+/*
+** Parse the options which follow the SQL in the USING clause. Each is
+** either a bare name, which turns the option on, or name=value.
+*/
+static int sqlexecParseOptions(
+  sqlexec_options *pOpts,
+  int nArg, const char *const*azArg,
+  char **pzErr
+){
+  memset(pOpts, 0, sizeof(*pOpts));
+  pOpts->nRowsHint = -1;
+  pOpts->nCacheSize = -1;
+  for (int i = 0; i < nArg; i++) {
+    const char *zName = sqlexecSkipSpace(azArg[i]);
+    int nName = 0;
+    while (isalnum((unsigned char)zName[nName]) || zName[nName] == '_')
+      nName++;
+    const char *zValue = sqlexecSkipSpace(zName + nName);
+    if (*zValue == '=')
+      zValue = sqlexecSkipSpace(zValue + 1);
+    else if (*zValue == 0)
+      zValue = NULL;
+    else
+      nName = 0; /* not a name followed by = or end of argument */
+
+    if (nName == 11 && sqlite3_strnicmp(zName, "materialize", nName) == 0) {
+      pOpts->bMaterialize = zValue == NULL || atoi(zValue) != 0;
+    } else if (nName == 11
+               && sqlite3_strnicmp(zName, "transaction", nName) == 0) {
+      pOpts->bTransaction = zValue == NULL || atoi(zValue) != 0;
+    } else if (nName == 6 && sqlite3_strnicmp(zName, "unique", nName) == 0) {
+      pOpts->bUnique = zValue == NULL || atoi(zValue) != 0;
+    } else if (nName == 4 && sqlite3_strnicmp(zName, "rows", nName) == 0
+               && zValue != NULL) {
+      char *zEnd;
+      pOpts->nRowsHint = strtoll(zValue, &zEnd, 10);
+      if (zEnd == zValue || *sqlexecSkipSpace(zEnd) || pOpts->nRowsHint < 0) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad row count: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+    } else if (nName == 5 && sqlite3_strnicmp(zName, "order", nName) == 0
+               && zValue != NULL) {
+      pOpts->zOrder = zValue;
+    } else if (nName == 5 && sqlite3_strnicmp(zName, "cache", nName) == 0
+               && zValue != NULL) {
+      char *zEnd;
+      pOpts->nCacheSize = strtoll(zValue, &zEnd, 10);
+      if (zEnd == zValue || *sqlexecSkipSpace(zEnd) || pOpts->nCacheSize < 0) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad cache size: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+    } else if (nName == 8 && sqlite3_strnicmp(zName, "prefetch", nName) == 0
+               && zValue != NULL) {
+      char *zEnd;
+      pOpts->nPrefetch = strtoll(zValue, &zEnd, 10);
+      if (zEnd == zValue || *sqlexecSkipSpace(zEnd) || pOpts->nPrefetch < 0
+          || pOpts->nPrefetch > INT_MAX) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad prefetch size: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+    } else if (nName == 9 && sqlite3_strnicmp(zName, "partition", nName) == 0
+               && zValue != NULL) {
+      pOpts->zPartition = zValue;
+    } else if (nName == 3 && sqlite3_strnicmp(zName, "key", nName) == 0
+               && zValue != NULL) {
+      pOpts->zKey = zValue;
+    } else if (nName == 6 && sqlite3_strnicmp(zName, "insert", nName) == 0
+               && zValue != NULL) {
+      pOpts->azWrite[SQLEXEC_WRITE_INSERT] = zValue;
+    } else if (nName == 6 && sqlite3_strnicmp(zName, "update", nName) == 0
+               && zValue != NULL) {
+      pOpts->azWrite[SQLEXEC_WRITE_UPDATE] = zValue;
+    } else if (nName == 6 && sqlite3_strnicmp(zName, "delete", nName) == 0
+               && zValue != NULL) {
+      pOpts->azWrite[SQLEXEC_WRITE_DELETE] = zValue;
+    } else if (nName == 9 && sqlite3_strnicmp(zName, "max_steps", nName) == 0
+               && zValue != NULL) {
+      char *zEnd;
+      pOpts->nMaxSteps = strtoll(zValue, &zEnd, 10);
+      if (zEnd == zValue || *sqlexecSkipSpace(zEnd) || pOpts->nMaxSteps < 0
+          || pOpts->nMaxSteps > INT_MAX) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad step limit: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+    } else if (nName == 10 && sqlite3_strnicmp(zName, "timeout_ms", nName) == 0
+               && zValue != NULL) {
+      char *zEnd;
+      pOpts->nTimeout = strtoll(zValue, &zEnd, 10);
+      if (zEnd == zValue || *sqlexecSkipSpace(zEnd) || pOpts->nTimeout < 0
+          || pOpts->nTimeout > INT_MAX) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad timeout: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+    } else if (nName == 8 && sqlite3_strnicmp(zName, "snapshot", nName) == 0
+               && zValue != NULL) {
+      pOpts->zSnapshot = zValue;
+    } else if (nName == 5 && sqlite3_strnicmp(zName, "block", nName) == 0) {
+      char *zEnd = NULL;
+      sqlite3_int64 nBlock = SQLEXEC_BLOCK_ROWS;
+      if (zValue != NULL)
+        nBlock = strtoll(zValue, &zEnd, 10);
+      if ((zValue != NULL && (zEnd == zValue || *sqlexecSkipSpace(zEnd)))
+          || nBlock < 0 || nBlock > 65536) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("sqlexecConnect: bad block size: %s",
+                                   zValue);
+        return SQLITE_ERROR;
+      }
+      pOpts->nBlock = (int)nBlock;
+    } else {
+      if (pzErr)
+        *pzErr = sqlite3_mprintf("sqlexecConnect: unknown option: %s",
+                                 azArg[i]);
+      return SQLITE_ERROR;
+    }
+  }
+
+  /* A snapshot is a materialized result set kept on disk */
+  if (pOpts->zSnapshot != NULL)
+    pOpts->bMaterialize = 1;
+
+  /* The rowid of a row is only its position in the scan */
+  if ((pOpts->azWrite[SQLEXEC_WRITE_UPDATE] != NULL
+       || pOpts->azWrite[SQLEXEC_WRITE_DELETE] != NULL)
+      && pOpts->zKey == NULL) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: update and delete need the "
+                               "key option");
+    return SQLITE_ERROR;
+  }
+
+  /* Partitioning hands the slices to prefetch workers */
+  if (pOpts->zPartition != NULL && pOpts->nPrefetch == 0)
+    pOpts->nPrefetch = 4 * SQLEXEC_PREFETCH_BATCH;
+#ifdef SQLEXEC_OMIT_PREFETCH
+  if (pOpts->nPrefetch > 0) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: %s is not available in "
+                               "this build", pOpts->zPartition ? "partition"
+                               : "prefetch");
+    return SQLITE_ERROR;
+  }
+#else
+  if (pOpts->nPrefetch > 0 && !sqlite3_threadsafe()) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: %s needs SQLite built to be "
+                               "threadsafe", pOpts->zPartition ? "partition"
+                               : "prefetch");
+    return SQLITE_ERROR;
+  }
+#endif
+  return SQLITE_OK;
+}
+
+/*
+** Classify the affinity of a column with declared type zType, following
+** the rules of section 3.1 of https://sqlite.org/datatype3.html: 'n' for
+** INTEGER, REAL or NUMERIC affinity, 't' for TEXT, or 0 for BLOB. Columns
+** which are expressions have no declared type, and get 0.
+*/
+static char sqlexecAffinityClass(const char *zType){
+  if (zType == NULL || *zType == 0)
+    return 0;
+  int bText = 0;
+  int bBlob = 0;
+  for (const char *z = zType; *z; z++) {
+    if (sqlite3_strnicmp(z, "int", 3) == 0)
+      return 'n';
+    if (sqlite3_strnicmp(z, "char", 4) == 0
+        || sqlite3_strnicmp(z, "clob", 4) == 0
+        || sqlite3_strnicmp(z, "text", 4) == 0)
+      bText = 1;
+    if (sqlite3_strnicmp(z, "blob", 4) == 0)
+      bBlob = 1;
+  }
+  if (bText)
+    return 't';
+  return bBlob ? 0 : 'n';
+}
+
+/*
+** Parse a column name, which may be quoted, at *pz and advance *pz past it.
+** zName must have room for a copy of the rest of *pz. Returns the number
+** of the column of pStmt with that name, or -1 if there isn't one or *pz
+** doesn't start with a name.
+*/
+static int sqlexecParseColumn(
+  sqlite3_stmt *pStmt,
+  const char **pz,
+  char *zName
+){
+  const char *z = sqlexecSkipSpace(*pz);
+  int nName = 0;
+  if (*z == '"' || *z == '`' || *z == '[') {
+    char cEnd = *z == '[' ? ']' : *z;
+    for (z++; *z != cEnd || (cEnd != ']' && z[1] == cEnd); z++) {
+      if (*z == 0)
+        return -1;
+      if (*z == cEnd)
+        z++; /* doubled quote */
+      zName[nName++] = *z;
+    }
+    z++;
+  } else {
+    while (isalnum((unsigned char)*z) || *z == '_' || (*z & 0x80))
+      zName[nName++] = *z++;
+  }
+  zName[nName] = 0;
+  *pz = z;
+  int iCol = 0;
+  int nCol = sqlite3_column_count(pStmt);
+  while (iCol < nCol
+         && sqlite3_stricmp(sqlite3_column_name(pStmt, iCol), zName) != 0)
+    iCol++;
+  return nName == 0 || iCol == nCol ? -1 : iCol;
+}
+
+/*
+** Parse the value of the order option, which lists the columns the rows of
+** pStmt are sorted by, each optionally followed by ASC or DESC, like the
+** terms of an ORDER BY clause. More than one column needs parenthesis,
+** as in order=(a, b desc). Column names may be quoted.
+*/
+static int sqlexecParseOrder(
+  sqlite3_stmt *pStmt,
+  const char *zOrder,
+  sqlexec_order **paOrder,
+  int *pnOrder,
+  char **pzErr
+){
+  const char *z = sqlexecSkipSpace(zOrder);
+  int bParen = *z == '(';
+  int nAlloc = 1;
+  for (const char *p = z; *p; p++) {
+    if (*p == ',')
+      nAlloc++;
+  }
+  sqlexec_order *aOrder = sqlite3_malloc64(nAlloc * sizeof(*aOrder));
+  char *zName = sqlite3_malloc64(strlen(z) + 1);
+  int nOrder = 0;
+  int rc = SQLITE_OK;
+  if (aOrder == NULL || zName == NULL) {
+    rc = SQLITE_NOMEM;
+    goto order_done;
+  }
+  if (bParen)
+    z++;
+
+  for (;;) {
+    int iCol = sqlexecParseColumn(pStmt, &z, zName);
+    if (iCol < 0)
+      goto order_error;
+
+    /* Optional direction */
+    int bDesc = 0;
+    z = sqlexecSkipSpace(z);
+    if (sqlite3_strnicmp(z, "desc", 4) == 0 && !isalnum((unsigned char)z[4])) {
+      bDesc = 1;
+      z += 4;
+    } else if (sqlite3_strnicmp(z, "asc", 3) == 0
+               && !isalnum((unsigned char)z[3])) {
+      z += 3;
+    }
+    aOrder[nOrder].iCol = iCol;
+    aOrder[nOrder].bDesc = bDesc;
+    nOrder++;
+
+    z = sqlexecSkipSpace(z);
+    if (*z == ',' && nOrder < nAlloc) {
+      z++;
+    } else {
+      if (bParen && *z == ')')
+        z = sqlexecSkipSpace(z + 1);
+      else if (bParen)
+        goto order_error;
+      if (*z != 0)
+        goto order_error;
+      break;
+    }
+  }
+  goto order_done;
+
+order_error:
+  if (pzErr)
+    *pzErr = sqlite3_mprintf("sqlexecConnect: bad order: %s", zOrder);
+  rc = SQLITE_ERROR;
+order_done:
+  sqlite3_free(zName);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(aOrder);
+    return rc;
+  }
+  *paOrder = aOrder;
+  *pnOrder = nOrder;
+  return SQLITE_OK;
+}
+
+/*
+** Parse the value of the key option, the name of the column which
+** identifies a row for the update and delete options. Sets *piCol to the
+** number of the column of pStmt.
+*/
+static int sqlexecParseKey(
+  sqlite3_stmt *pStmt,
+  const char *zKey,
+  int *piCol,
+  char **pzErr
+){
+  const char *z = zKey;
+  char *zName = sqlite3_malloc64(strlen(z) + 1);
+  if (zName == NULL)
+    return SQLITE_NOMEM;
+  int iCol = sqlexecParseColumn(pStmt, &z, zName);
+  sqlite3_free(zName);
+  if (iCol < 0 || *sqlexecSkipSpace(z) != 0) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: bad key: %s", zKey);
+    return SQLITE_ERROR;
+  }
+  *piCol = iCol;
+  return SQLITE_OK;
+}
+
+/*
+** Parse the value of the partition option, (column, K), which says to
+** divide the range of values of the column into K slices and scan them in
+** parallel. Sets *piCol to the number of the column of pStmt.
+*/
+static int sqlexecParsePartition(
+  sqlite3_stmt *pStmt,
+  const char *zPartition,
+  int *piCol,
+  int *pnPart,
+  char **pzErr
+){
+  const char *z = sqlexecSkipSpace(zPartition);
+  char *zName = sqlite3_malloc64(strlen(z) + 1);
+  if (zName == NULL)
+    return SQLITE_NOMEM;
+  int iCol = -1;
+  long nPart = 0;
+  if (*z == '(') {
+    z++;
+    iCol = sqlexecParseColumn(pStmt, &z, zName);
+    z = sqlexecSkipSpace(z);
+  }
+  if (iCol >= 0 && *z == ',') {
+    char *zEnd;
+    nPart = strtol(z + 1, &zEnd, 10);
+    z = sqlexecSkipSpace(zEnd);
+  }
+  sqlite3_free(zName);
+  if (iCol < 0 || *z != ')' || *sqlexecSkipSpace(z + 1) != 0
+      || nPart < 1 || nPart > SQLEXEC_MAX_PARTITION) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: bad partition: %s",
+                               zPartition);
+    return SQLITE_ERROR;
+  }
+  *piCol = iCol;
+  *pnPart = (int)nPart;
+  return SQLITE_OK;
+}
+
+/*
+** If we can rewrite the SQL of a virtual table (see sqlexecBestIndex),
+** return the WITH clause each rewrite starts with, which makes the results
+** of the SQL available as SQLEXEC_SRC, with columns c0, c1, etc. because
+** the names the SQL gives its columns might not be usable. Only queries
+** (SELECT, VALUES, or WITH ... SELECT) can go in a WITH clause, and if
+** bTest is set we check by preparing the simplest rewrite, so anything
+** else gets NULL.
+** The SQL goes on lines of its own, so that a comment at the end of it
+** can't swallow the rest, and without any trailing semicolon.
+*/
+static char *sqlexecRewriteSource(
+  sqlite3 *db,
+  const char *sql,
+  int nCol,
+  int bTest
+){
+  const char *z = sqlexecSkipSpace(sql);
+  if (sqlite3_strnicmp(z, "select", 6) != 0
+      && sqlite3_strnicmp(z, "values", 6) != 0
+      && sqlite3_strnicmp(z, "with", 4) != 0)
+    return NULL;
+  int n = (int)strlen(z);
+  while (n > 0 && (isspace((unsigned char)z[n-1]) || z[n-1] == ';'))
+    n--;
+
+  sqlite3_str *pStr = sqlite3_str_new(db);
+  sqlite3_str_appendall(pStr, "WITH " SQLEXEC_SRC "(");
+  for (int i = 0; i < nCol; i++)
+    sqlite3_str_appendf(pStr, "%sc%d", i ? "," : "", i);
+  sqlite3_str_appendf(pStr, ") AS (\n%.*s\n)", n, z);
+  char *zSrc = sqlite3_str_finish(pStr);
+  if (zSrc == NULL || !bTest)
+    return zSrc;
+
+  char *zTest = sqlite3_mprintf("%s SELECT * FROM " SQLEXEC_SRC, zSrc);
+  sqlite3_stmt *pStmt = NULL;
+  if (zTest == NULL
+      || sqlite3_prepare_v2(db, zTest, -1, &pStmt, NULL) != SQLITE_OK
+      || sqlite3_column_count(pStmt) != nCol) {
+    sqlite3_free(zSrc);
+    zSrc = NULL;
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zTest);
+  return zSrc;
+}
+
+/*
+** Split SQL holding more than one statement into the setup statements and
+** the last statement, which is the one returning rows. Each setup statement
+** is copied into *pazSetup, and *pzLast is set to point at the start of the
+** last statement in sql. We can't prepare the statements to find where
+** they end, as a statement can depend on what the ones before it do (e.g.
+** create a table), so we look for a semicolon which sqlite3_complete says
+** ends a statement. Empty statements are dropped.
+*/
+static int sqlexecSplitSetup(
+  const char *sql,
+  char ***pazSetup,
+  int *pnSetup,
+  const char **pzLast
+){
+  char **azSetup = NULL;
+  int nSetup = 0;
+  const char *zStart = sql;
+  char *zBuf = NULL;
+  int rc = SQLITE_OK;
+
+  for (const char *z = sql; *z; z++) {
+    if (*z != ';')
+      continue;
+    if (zBuf == NULL) {
+      zBuf = sqlite3_malloc64(strlen(sql) + 1);
+      if (zBuf == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    int n = (int)(z - zStart) + 1;
+    memcpy(zBuf, zStart, n);
+    zBuf[n] = 0;
+    if (!sqlite3_complete(zBuf))
+      continue;
+    if (*sqlexecSkipSpace(z + 1) == 0)
+      break;
+    if (sqlexecSkipSpace(zStart) != z) {
+      char **azNew = sqlite3_realloc64(azSetup,
+                                       (nSetup + 1) * sizeof(*azNew));
+      if (azNew == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      azSetup = azNew;
+      azSetup[nSetup] = sqlite3_mprintf("%s", zBuf);
+      if (azSetup[nSetup] == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      nSetup++;
+    }
+    zStart = z + 1;
+  }
+  sqlite3_free(zBuf);
+
+  if (rc != SQLITE_OK) {
+    for (int i = 0; i < nSetup; i++)
+      sqlite3_free(azSetup[i]);
+    sqlite3_free(azSetup);
+    return rc;
+  }
+  *pazSetup = azSetup;
+  *pnSetup = nSetup;
+  *pzLast = zStart;
+  return SQLITE_OK;
+}
+
+static int sqlexecDisconnect(sqlite3_vtab *pVtab);
+
+/*
+** Add a new virtual table to the list of them in pEnv. sqlexecDisconnect
+** takes it off again.
+*/
+static void sqlexecEnvLink(sqlexec_env *pEnv, sqlexec_vtab *vtab){
+  vtab->pEnv = pEnv;
+  vtab->pNext = pEnv->pFirst;
+  if (vtab->pNext)
+    vtab->pNext->ppPrev = &vtab->pNext;
+  vtab->ppPrev = &pEnv->pFirst;
+  pEnv->pFirst = vtab;
+}
+
+/*
+** Free what a sqlexec_schema holds.
+*/
+static void sqlexecSchemaFree(sqlexec_schema *pSchema){
+  sqlite3_free(pSchema->zDecl);
+  sqlite3_free(pSchema->aClass);
+  sqlite3_free(pSchema->aOrder);
+  memset(pSchema, 0, sizeof(*pSchema));
+}
+
+/*
+** Copy *pFrom into *pTo, which holds nothing yet. Returns SQLITE_NOMEM,
+** leaving *pTo empty, if we run out of memory.
+*/
+static int sqlexecSchemaCopy(sqlexec_schema *pTo, const sqlexec_schema *pFrom){
+  *pTo = *pFrom;
+  pTo->zDecl = sqlite3_mprintf("%s", pFrom->zDecl);
+  pTo->aClass = sqlite3_malloc(pFrom->nCol);
+  pTo->aOrder = NULL;
+  if (pFrom->nOrder > 0)
+    pTo->aOrder = sqlite3_malloc64(pFrom->nOrder * sizeof(sqlexec_order));
+  if (pTo->zDecl == NULL || pTo->aClass == NULL
+      || (pFrom->nOrder > 0 && pTo->aOrder == NULL)) {
+    sqlexecSchemaFree(pTo);
+    return SQLITE_NOMEM;
+  }
+  memcpy(pTo->aClass, pFrom->aClass, pFrom->nCol);
+  if (pFrom->nOrder > 0)
+    memcpy(pTo->aOrder, pFrom->aOrder, pFrom->nOrder * sizeof(sqlexec_order));
+  return SQLITE_OK;
+}
+
+/*
+** Prepare the SQL of a virtual table (sqlPrepare, which is sql with any
+** PRAGMA parameters substituted) to validate its syntax and find out the
+** columns it returns, and fill in *pSchema. If the SQL is a PRAGMA with
+** parameters, azParam has their names and *pnParam their number, or else
+** we get them from the statement. For CREATE VIRTUAL TABLE (bCreate), if
+** the SQL doesn't prepare we run the setup statements and try again.
+*/
+static int sqlexecSchemaPrepare(
+  sqlite3 *db,
+  const char *sql,
+  const char *sqlPrepare,
+  const sqlexec_options *pOpts,
+  char **azParam,
+  int *pnParam,
+  char **azSetup,
+  int nSetup,
+  char *abSetupDone,
+  int bCreate,
+  sqlexec_schema *pSchema,
+  char **pzErr
+){
+  sqlite3_stmt * pStmt;
+  int rc = sqlite3_prepare_v2(db, sqlPrepare, -1, &pStmt, NULL);
+  if (rc != SQLITE_OK && nSetup > 0 && bCreate) {
+    /*
+    ** The statement may depend on what the setup statements do, such as
+    ** attaching a database or creating a temp table, so run them and try
+    ** again. We only do this for CREATE VIRTUAL TABLE, which runs as a
+    ** statement of its own. When SQLite connects to us, it is in the middle
+    ** of preparing some other statement.
+    */
+    for (int i = 0; i < nSetup; i++) {
+      rc = sqlite3_exec(db, azSetup[i], NULL, NULL, NULL);
+      if (rc != SQLITE_OK) {
+        if (pzErr)
+          *pzErr = sqlite3_mprintf("Error running setup: %s; reason: %s",
+                                   azSetup[i], sqlite3_errmsg(db));
+        return rc;
+      }
+      abSetupDone[i] = (char)sqlexecIsAttach(azSetup[i]);
+    }
+    rc = sqlite3_prepare_v2(db, sqlPrepare, -1, &pStmt, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("Error preparing: %s; reason: %s", sql,
+          sqlite3_errmsg(db));
+    return rc;
+  }
+  if (azParam == NULL)
+    *pnParam = sqlite3_bind_parameter_count(pStmt);
+  int nParam = *pnParam;
+  if (nParam > SQLEXEC_MAX_PARAM) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: too many parameters in: %s",
+                               sql);
+    rc = SQLITE_ERROR;
+    goto prepare_error;
+  }
+
+  /*
+  ** Find out number of columns prepared SQL returns. If it returns zero
+  ** columns we return an error here.
+  */
+  int colCount = sqlite3_column_count(pStmt);
+  if (colCount == 0) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("SQL statement returns no data: %s", sql);
+    rc = SQLITE_ERROR;
+    goto prepare_error;
+  }
+  if (pOpts->zOrder != NULL) {
+    rc = sqlexecParseOrder(pStmt, pOpts->zOrder, &pSchema->aOrder,
+                           &pSchema->nOrder, pzErr);
+    if (rc != SQLITE_OK)
+      goto prepare_error;
+  }
+  if (pOpts->zPartition != NULL) {
+    rc = sqlexecParsePartition(pStmt, pOpts->zPartition, &pSchema->iPartCol,
+                               &pSchema->nPart, pzErr);
+    if (rc != SQLITE_OK)
+      goto prepare_error;
+  }
+  int iKey = -1;
+  if (pOpts->zKey != NULL) {
+    rc = sqlexecParseKey(pStmt, pOpts->zKey, &iKey, pzErr);
+    if (rc != SQLITE_OK)
+      goto prepare_error;
+  }
+  pSchema->aClass = sqlite3_malloc(colCount);
+  if (pSchema->aClass == NULL) {
+    rc = SQLITE_NOMEM;
+    goto prepare_error;
+  }
+  for (int i = 0; i < colCount; i++)
+    pSchema->aClass[i] =
+      sqlexecAffinityClass(sqlite3_column_decltype(pStmt, i));
+
+  /*
+  ** Now we build the CREATE TABLE statement we need to pass to the
+  ** sqlite3_declare_vtab function: the columns returned by the statement,
+  ** with their declared types so that they have the same affinity outside
+  ** the table as inside, then a hidden column for each parameter. With the
+  ** key option, the table is WITHOUT ROWID, so that xUpdate is given the
+  ** key of the row to change rather than its position in the scan. This
+  ** should always work unless we run out of memory.
+  */
+  sqlite3_str *pDecl = sqlite3_str_new(db);
+  sqlite3_str_appendall(pDecl, "create table x(");
+  for (int i = 0; i < colCount; i++) {
+    const char *colName = sqlite3_column_name(pStmt, i);
+    const char *zType = sqlite3_column_decltype(pStmt, i);
+    if (colName == NULL) {
+      sqlite3_free(sqlite3_str_finish(pDecl));
+      rc = SQLITE_NOMEM;
+      goto prepare_error;
+    }
+    sqlite3_str_appendf(pDecl, "%s\"%w\"", i == 0 ? "" : ",", colName);
+    if (sqlexecPlainType(zType))
+      sqlite3_str_appendf(pDecl, " %s", zType);
+  }
+  for (int iParam = 1; iParam <= nParam; iParam++) {
+    sqlite3_str_appendchar(pDecl, 1, ',');
+    const char *zParam = azParam ? azParam[iParam-1]
+                                 : sqlite3_bind_parameter_name(pStmt, iParam);
+    sqlexecAppendParamColumn(pDecl, zParam, iParam, nParam);
+    sqlite3_str_appendall(pDecl, " hidden");
+  }
+  if (iKey >= 0)
+    sqlite3_str_appendf(pDecl, ",primary key(\"%w\")) without rowid",
+                        sqlite3_column_name(pStmt, iKey));
+  else
+    sqlite3_str_appendchar(pDecl, 1, ')');
+  rc = sqlite3_str_errcode(pDecl);
+  char *decl = sqlite3_str_finish(pDecl);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(decl);
+    goto prepare_error;
+  }
+  pSchema->zDecl = decl;
+  pSchema->nCol = colCount;
+  pSchema->nParam = nParam;
+
+  /*
+  ** Now we have constructed the CREATE TABLE statement we don't need the
+  ** statement handle any more.
+  */
+  rc = sqlite3_finalize(pStmt);
+  if (rc != SQLITE_OK) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: sqlite3_finalize failed"
+                               " for: %s\n", sql);
+    sqlexecSchemaFree(pSchema);
+  }
+  return rc;
+
+prepare_error:
+  sqlite3_finalize(pStmt);
+  sqlexecSchemaFree(pSchema);
+  return rc;
+}
+
+/*
+** The schema table of a virtual table v is v_schema, in the same database.
+** CREATE VIRTUAL TABLE makes it, with one row recording the sqlexec_schema
+** learned from the SQL, the arguments of the USING clause it was learned
+** for, and the schema cookie of the database at the time. The order and
+** partition options are kept as the column numbers they resolve to, with
+** "iCol" or "iCol desc" for each term of the order, and the affinity
+** classes as one character per column, '-' for none.
+**
+** When the database is opened again, xConnect declares the virtual table
+** from the row, if the USING clause is the same and the schema cookie
+** hasn't changed since, instead of preparing the SQL. The SQL is prepared
+** when the first cursor is opened (see sqlexecSchemaCheck). If the cookie
+** has changed, xConnect prepares the SQL, but it never writes the row:
+** it runs while some statement of the user is prepared, and a read would
+** take a write lock. The row is updated later, by a cursor opened in a
+** transaction already writing the database (see sqlexecSchemaRefresh).
+**
+** The schema table is a shadow table of the virtual table (see
+** sqlexecShadowName), which SQL can't write in defensive mode.
+*/
+#define SQLEXEC_SCHEMA_SUFFIX "_schema"
+
+/*
+** Read the schema cookie of database zDb into *piCookie.
+*/
+static int sqlexecReadCookie(sqlite3 *db, const char *zDb, int *piCookie){
+  char *sql = sqlite3_mprintf("pragma \"%w\".schema_version", zDb);
+  if (sql == NULL)
+    return SQLITE_NOMEM;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    *piCookie = sqlite3_column_int(pStmt, 0);
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/*
+** Returns the arguments of the USING clause (argv[3] onwards), separated
+** by commas, or NULL if we run out of memory.
+*/
+static char *sqlexecSchemaArgs(int argc, const char *const*argv){
+  sqlite3_str *pStr = sqlite3_str_new(NULL);
+  for (int i = 3; i < argc; i++)
+    sqlite3_str_appendf(pStr, "%s%s", i > 3 ? "," : "", argv[i]);
+  return sqlite3_str_finish(pStr);
+}
+
+/*
+** Parse the order kept in a schema table row into pSchema. Returns false
+** if it isn't what sqlexecSchemaSave writes.
+*/
+static int sqlexecSchemaLoadOrder(const char *zOrder, sqlexec_schema *pSchema){
+  if (zOrder == NULL)
+    return 1;
+  int nAlloc = 1;
+  for (const char *p = zOrder; *p; p++) {
+    if (*p == ',')
+      nAlloc++;
+  }
+  pSchema->aOrder = sqlite3_malloc64(nAlloc * sizeof(sqlexec_order));
+  if (pSchema->aOrder == NULL)
+    return 0;
+  const char *z = zOrder;
+  for (int i = 0; i < nAlloc; i++) {
+    char *zEnd;
+    long iCol = strtol(z, &zEnd, 10);
+    if (zEnd == z || iCol < 0 || iCol >= pSchema->nCol)
+      return 0;
+    pSchema->aOrder[i].iCol = (int)iCol;
+    pSchema->aOrder[i].bDesc = strncmp(zEnd, " desc", 5) == 0;
+    z = zEnd + (pSchema->aOrder[i].bDesc ? 5 : 0);
+    if (*z != (i + 1 < nAlloc ? ',' : 0))
+      return 0;
+    z++;
+  }
+  pSchema->nOrder = nAlloc;
+  return 1;
+}
+
+/*
+** Fill in *pSchema from the schema table of virtual table zName of
+** database zDb, if it has a row for the USING clause zArgs which is still
+** valid. With bStale, a row made before the schema cookie last changed
+** will do. Returns true if it did.
+*/
+static int sqlexecSchemaLoad(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs,
+  int bStale,
+  sqlexec_schema *pSchema
+){
+  int iCookie;
+  if (sqlexecReadCookie(db, zDb, &iCookie) != SQLITE_OK)
+    return 0;
+  char *sql = sqlite3_mprintf(
+      "select ncol, nparam, decl, class, src, ord, part_col, part_n"
+      " from \"%w\".\"%w" SQLEXEC_SCHEMA_SUFFIX "\""
+      " where rowid = 1 and args = ?1 and (cookie = ?2 or ?3)", zDb, zName);
+  if (sql == NULL)
+    return 0;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) /* No schema table */
+    return 0;
+  sqlite3_bind_text(pStmt, 1, zArgs, -1, SQLITE_STATIC);
+  sqlite3_bind_int(pStmt, 2, iCookie);
+  sqlite3_bind_int(pStmt, 3, bStale);
+  int bOk = 0;
+  if (sqlite3_step(pStmt) == SQLITE_ROW) {
+    pSchema->nCol = sqlite3_column_int(pStmt, 0);
+    pSchema->nParam = sqlite3_column_int(pStmt, 1);
+    const char *zDecl = (const char*)sqlite3_column_text(pStmt, 2);
+    const char *zClass = (const char*)sqlite3_column_text(pStmt, 3);
+    pSchema->bSrc = sqlite3_column_int(pStmt, 4);
+    pSchema->iPartCol = sqlite3_column_int(pStmt, 6);
+    pSchema->nPart = sqlite3_column_int(pStmt, 7);
+    bOk = zDecl != NULL && zClass != NULL
+       && pSchema->nCol > 0 && (int)strlen(zClass) == pSchema->nCol
+       && pSchema->nParam >= 0 && pSchema->nParam <= SQLEXEC_MAX_PARAM
+       && pSchema->iPartCol >= 0 && pSchema->iPartCol < pSchema->nCol
+       && sqlexecSchemaLoadOrder((const char*)sqlite3_column_text(pStmt, 5),
+                                 pSchema);
+    if (bOk) {
+      pSchema->zDecl = sqlite3_mprintf("%s", zDecl);
+      pSchema->aClass = sqlite3_malloc(pSchema->nCol);
+      bOk = pSchema->zDecl != NULL && pSchema->aClass != NULL;
+    }
+    if (bOk) {
+      for (int i = 0; i < pSchema->nCol; i++)
+        pSchema->aClass[i] = zClass[i] == '-' ? 0 : zClass[i];
+    }
+  }
+  sqlite3_finalize(pStmt);
+  if (!bOk)
+    sqlexecSchemaFree(pSchema);
+  return bOk;
+}
+
+/*
+** Record *pSchema in the schema table of virtual table zName of database
+** zDb, with the USING clause zArgs and the current schema cookie. For
+** CREATE VIRTUAL TABLE (bCreate) we create the schema table first, and
+** fail if there is a table of that name already. Otherwise we are in the
+** middle of some other statement (see sqlexecSchemaRefresh), so we only
+** update the row of a schema table which is there already, and give up
+** quietly if we can't.
+*/
+static int sqlexecSchemaSave(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs,
+  const sqlexec_schema *pSchema,
+  int bCreate
+){
+  int rc;
+  if (bCreate) {
+    char *sql = sqlite3_mprintf(
+        "create table \"%w\".\"%w" SQLEXEC_SCHEMA_SUFFIX "\"("
+        "args, cookie, ncol, nparam, decl, class, src, ord, part_col, part_n)",
+        zDb, zName);
+    if (sql == NULL)
+      return SQLITE_NOMEM;
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+      return rc;
+  } else if (sqlite3_db_readonly(db, zDb) != 0) {
+    return SQLITE_OK;
+  }
+
+  int iCookie;
+  rc = sqlexecReadCookie(db, zDb, &iCookie);
+  if (rc != SQLITE_OK)
+    return bCreate ? rc : SQLITE_OK;
+  sqlite3_str *pOrder = sqlite3_str_new(db);
+  for (int i = 0; i < pSchema->nOrder; i++)
+    sqlite3_str_appendf(pOrder, "%s%d%s", i ? "," : "",
+                        pSchema->aOrder[i].iCol,
+                        pSchema->aOrder[i].bDesc ? " desc" : "");
+  char *zOrder = sqlite3_str_finish(pOrder);
+  char *zClass = sqlite3_malloc(pSchema->nCol + 1);
+  char *sql = sqlite3_mprintf(
+      "insert or replace into \"%w\".\"%w" SQLEXEC_SCHEMA_SUFFIX "\""
+      "(rowid, args, cookie, ncol, nparam, decl, class, src, ord, part_col,"
+      " part_n) values(1, ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)",
+      zDb, zName);
+  sqlite3_stmt *pStmt = NULL;
+  if (zClass == NULL || sql == NULL
+      || (pSchema->nOrder > 0 && zOrder == NULL)) {
+    rc = SQLITE_NOMEM;
+  } else {
+    for (int i = 0; i < pSchema->nCol; i++)
+      zClass[i] = pSchema->aClass[i] ? pSchema->aClass[i] : '-';
+    zClass[pSchema->nCol] = 0;
+    rc = sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(pStmt, 1, zArgs, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 2, iCookie);
+    sqlite3_bind_int(pStmt, 3, pSchema->nCol);
+    sqlite3_bind_int(pStmt, 4, pSchema->nParam);
+    sqlite3_bind_text(pStmt, 5, pSchema->zDecl, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 6, zClass, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 7, pSchema->bSrc);
+    if (pSchema->nOrder > 0)
+      sqlite3_bind_text(pStmt, 8, zOrder, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 9, pSchema->iPartCol);
+    sqlite3_bind_int(pStmt, 10, pSchema->nPart);
+    rc = sqlite3_step(pStmt);
+    rc = rc == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(sql);
+  sqlite3_free(zClass);
+  sqlite3_free(zOrder);
+  return bCreate ? rc : SQLITE_OK;
+}
+
+/*
+** Returns true if database zDb has a table, view, index or trigger named
+** like the schema table of virtual table zName, which would stop CREATE
+** VIRTUAL TABLE making it.
+*/
+static int sqlexecSchemaExists(sqlite3 *db, const char *zDb,
+                               const char *zName){
+  char *sql = sqlite3_mprintf(
+      "select 1 from \"%w\".sqlite_master"
+      " where name = '%q' || ?1 collate nocase", zDb, zName);
+  if (sql == NULL)
+    return 0;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK)
+    return 0;
+  sqlite3_bind_text(pStmt, 1, SQLEXEC_SCHEMA_SUFFIX, -1, SQLITE_STATIC);
+  int bExists = sqlite3_step(pStmt) == SQLITE_ROW;
+  sqlite3_finalize(pStmt);
+  return bExists;
+}
+
+/*
+** Record what xConnect learned by preparing the SQL (stale) in the schema
+** table, or the out of date row it declared the table from, now that
+** sqlexecSchemaCheck has found it holds, or what sqlexecSchemaRelearn
+** found instead. We can only write it in a transaction which is already
+** writing the database, or we would take a write lock for a read, so
+** until then we keep it. If the schema changed since, it may be out of
+** date.
+*/
+static void sqlexecSchemaRefresh(sqlexec_vtab *vtab){
+  if (sqlite3_txn_state(vtab->db, vtab->zDb) != SQLITE_TXN_WRITE)
+    return;
+  int iCookie;
+  if (sqlexecReadCookie(vtab->db, vtab->zDb, &iCookie) == SQLITE_OK
+      && iCookie == vtab->iStaleCookie)
+    sqlexecSchemaSave(vtab->db, vtab->zDb, vtab->zName, vtab->zArgs,
+                      &vtab->stale, 0);
+  sqlexecSchemaFree(&vtab->stale);
+}
+
+/*
+** The schema cache shared by all the connections of the process, most
+** recently used first, and the number of entries in it. A server keeping
+** a pool of connections to one database would otherwise have each of them
+** read the schema table of every sqlexec table it uses (or prepare its
+** SQL) when it first connects to it. The cache lasts while any connection
+** has our modules, as listed in sqlexecEnvList: once none do, a loadable
+** extension may be unloaded, losing the cache, so we free it first. The
+** lists and count are protected by the SQLITE_MUTEX_STATIC_APP1 mutex.
+*/
+static sqlexec_shared *sqlexecSharedList = NULL;
+static int sqlexecSharedCount = 0;
+static sqlexec_env *sqlexecEnvList = NULL;
+
+/*
+** Put the env of a connection declaring our modules on sqlexecEnvList.
+*/
+static void sqlexecEnvRegister(sqlexec_env *pEnv){
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  pEnv->pNextEnv = sqlexecEnvList;
+  sqlexecEnvList = pEnv;
+  sqlite3_mutex_leave(pMutex);
+}
+
+/*
+** Take the env of a connection dropping our modules off sqlexecEnvList,
+** and free the shared schema cache if no connection has them now.
+*/
+static void sqlexecEnvUnregister(sqlexec_env *pEnv){
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  sqlexec_env **pp = &sqlexecEnvList;
+  while (*pp != pEnv)
+    pp = &(*pp)->pNextEnv;
+  *pp = pEnv->pNextEnv;
+  sqlexec_shared *pList = NULL;
+  if (sqlexecEnvList == NULL) {
+    pList = sqlexecSharedList;
+    sqlexecSharedList = NULL;
+    sqlexecSharedCount = 0;
+  }
+  sqlite3_mutex_leave(pMutex);
+  while (pList != NULL) {
+    sqlexec_shared *pNext = pList->pNext;
+    sqlexecSchemaFree(&pList->schema);
+    sqlite3_free(pList->zKey);
+    sqlite3_free(pList);
+    pList = pNext;
+  }
+}
+
+/*
+** Fill in the key of the shared schema cache for virtual table zName of
+** database zDb, with the USING clause zArgs, in *pKey: zKey and its hash,
+** the device and inode of the database file, so that another file put in
+** its place isn't taken for it, and the schema cookie. Returns
+** false if the schema can't be shared: the database has no file (it is in
+** memory, say), or we are in a write transaction on it, which may yet be
+** rolled back.
+*/
+static int sqlexecSharedKey(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs,
+  sqlexec_shared *pKey
+){
+  memset(pKey, 0, sizeof(*pKey));
+  const char *zFile = sqlite3_db_filename(db, zDb);
+  struct stat st;
+  if (zFile == NULL || zFile[0] == 0 || stat(zFile, &st) != 0
+      || sqlite3_txn_state(db, zDb) == SQLITE_TXN_WRITE
+      || sqlexecReadCookie(db, zDb, &pKey->iCookie) != SQLITE_OK)
+    return 0;
+  sqlite3_str *pStr = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(pStr, zFile);
+  sqlite3_str_appendchar(pStr, 1, 0);
+  sqlite3_str_appendall(pStr, zName);
+  sqlite3_str_appendchar(pStr, 1, 0);
+  sqlite3_str_appendall(pStr, zArgs);
+  pKey->nKey = sqlite3_str_length(pStr);
+  pKey->zKey = sqlite3_str_finish(pStr);
+  if (pKey->zKey == NULL)
+    return 0;
+  pKey->iHash = sqlexecHashBytes(2166136261u, pKey->zKey, pKey->nKey);
+  pKey->iDev = (sqlite3_int64)st.st_dev;
+  pKey->iIno = (sqlite3_int64)st.st_ino;
+  return 1;
+}
+
+/*
+** Find the entry of the shared schema cache with the same zKey as pKey,
+** returning the pointer to it in the list, which points to NULL if there
+** is none. The caller holds the mutex.
+*/
+static sqlexec_shared **sqlexecSharedFind(const sqlexec_shared *pKey){
+  sqlexec_shared **pp = &sqlexecSharedList;
+  while (*pp != NULL
+         && ((*pp)->iHash != pKey->iHash || (*pp)->nKey != pKey->nKey
+             || memcmp((*pp)->zKey, pKey->zKey, pKey->nKey) != 0))
+    pp = &(*pp)->pNext;
+  return pp;
+}
+
+/*
+** Fill in *pSchema from the shared schema cache, if some connection of
+** this process has put the schema of virtual table zName of database zDb
+** with the USING clause zArgs there (see sqlexecSharedPut) since the
+** schema of the database last changed. Returns true if it did. Like a
+** schema loaded from the schema table, it is checked against the SQL when
+** the first cursor is opened.
+*/
+static int sqlexecSharedGet(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs,
+  sqlexec_schema *pSchema
+){
+  sqlexec_shared key;
+  if (!sqlexecSharedKey(db, zDb, zName, zArgs, &key)) {
+    sqlite3_free(key.zKey);
+    return 0;
+  }
+  int bFound = 0;
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  sqlexec_shared **pp = sqlexecSharedFind(&key);
+  sqlexec_shared *p = *pp;
+  if (p != NULL && p->iCookie == key.iCookie && p->iDev == key.iDev
+      && p->iIno == key.iIno) {
+    bFound = sqlexecSchemaCopy(pSchema, &p->schema) == SQLITE_OK;
+    *pp = p->pNext;
+    p->pNext = sqlexecSharedList;
+    sqlexecSharedList = p;
+  }
+  sqlite3_mutex_leave(pMutex);
+  sqlite3_free(key.zKey);
+  return bFound;
+}
+
+/*
+** Put *pSchema into the shared schema cache as the schema of virtual
+** table zName of database zDb with the USING clause zArgs, replacing any
+** older one, and throwing out the least recently used entry if there are
+** more than SQLEXEC_SHARED_SCHEMAS. If we run out of memory, the schema
+** just isn't shared.
+*/
+static void sqlexecSharedPut(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs,
+  const sqlexec_schema *pSchema
+){
+  sqlexec_shared *pNew = sqlite3_malloc(sizeof(*pNew));
+  if (pNew == NULL)
+    return;
+  if (!sqlexecSharedKey(db, zDb, zName, zArgs, pNew)
+      || sqlexecSchemaCopy(&pNew->schema, pSchema) != SQLITE_OK) {
+    sqlite3_free(pNew->zKey);
+    sqlite3_free(pNew);
+    return;
+  }
+  sqlexec_shared *pOld = NULL;
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  sqlexec_shared **pp = sqlexecSharedFind(pNew);
+  if (*pp != NULL) {
+    pOld = *pp;
+    *pp = pOld->pNext;
+    sqlexecSharedCount--;
+  }
+  pNew->pNext = sqlexecSharedList;
+  sqlexecSharedList = pNew;
+  if (++sqlexecSharedCount > SQLEXEC_SHARED_SCHEMAS) {
+    pp = &sqlexecSharedList;
+    while ((*pp)->pNext != NULL)
+      pp = &(*pp)->pNext;
+    pOld = *pp;
+    *pp = NULL;
+    sqlexecSharedCount--;
+  }
+  sqlite3_mutex_leave(pMutex);
+  if (pOld != NULL) {
+    sqlexecSchemaFree(&pOld->schema);
+    sqlite3_free(pOld->zKey);
+    sqlite3_free(pOld);
+  }
+}
+
+/*
+** Take the schema of virtual table zName of database zDb with the USING
+** clause zArgs out of the shared schema cache, once sqlexecSchemaCheck has
+** found it out of date without the schema cookie having changed.
+*/
+static void sqlexecSharedDrop(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zName,
+  const char *zArgs
+){
+  sqlexec_shared key;
+  if (!sqlexecSharedKey(db, zDb, zName, zArgs, &key)) {
+    sqlite3_free(key.zKey);
+    return;
+  }
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  sqlexec_shared **pp = sqlexecSharedFind(&key);
+  sqlexec_shared *pOld = *pp;
+  if (pOld != NULL) {
+    *pp = pOld->pNext;
+    sqlexecSharedCount--;
+  }
+  sqlite3_mutex_leave(pMutex);
+  sqlite3_free(key.zKey);
+  if (pOld != NULL) {
+    sqlexecSchemaFree(&pOld->schema);
+    sqlite3_free(pOld->zKey);
+    sqlite3_free(pOld);
+  }
+}
+
+/*
+** Copy SQL given in the USING clause, as the first argument or the value
+** of an option. Optionally it is surrounded by parenthesis so that any
+** commas in it are ignored (and not considered another USING clause
+** argument). So we check if the argument starts with ( and ends with )
+** and if so we strip the ( and ) off the start/end. We allow whitespace
+** before the ( and after the ) but not any other character. Returns NULL
+** if we run out of memory.
+*/
+static char *sqlexecUnparen(const char *zArg){
+  char *sql = NULL;
+  const char *parenOpen = strchr(zArg,'(');
+  if (parenOpen != NULL) {
+    for (const char *p = zArg; p != parenOpen; p++) {
+      if (!isspace(*p)) {
+        parenOpen = NULL;
+        break;
+      }
+    }
+  }
+  if (parenOpen != NULL) {
+    const char *parenClose = strrchr(zArg,')');
+    if (parenClose != NULL) {
+      for (const char *p = strchr(zArg,0)-1; p != parenClose; p--) {
+        if (!isspace(*p)) {
+          parenClose = NULL;
+          break;
+        }
+      }
+    }
+    if (parenClose != NULL) {
+      sql = sqlite3_mprintf("%s", parenOpen+1);
+      if (sql == NULL)
+        return NULL;
+      *(strrchr(sql,')')) = 0;
+    }
+  }
+  if (sql == NULL)
+    sql = sqlite3_mprintf("%s", zArg);
+  return sql;
+}
+
+/*
+** Set abUpdateCol of a virtual table with the update option, to flag the
+** columns whose values the update statement takes, so that xColumn can
+** leave out any others an UPDATE doesn't change. The parameters are found
+** as for a PRAGMA, which works for any SQL. If there are too many to tell,
+** abUpdateCol stays NULL, meaning every column.
+*/
+static int sqlexecFindUpdateCols(sqlexec_vtab *vtab){
+  sqlexec_subst *aSubst;
+  int nSubst;
+  char **azName;
+  int nParam;
+  int rc = sqlexecScanPragmaParams(vtab->azWrite[SQLEXEC_WRITE_UPDATE],
+                                   &aSubst, &nSubst, &azName, &nParam);
+  if (rc == SQLITE_RANGE)
+    return SQLITE_OK;
+  if (rc != SQLITE_OK)
+    return rc;
+  for (int i = 0; i < nParam; i++)
+    sqlite3_free(azName[i]);
+  sqlite3_free(azName);
+  vtab->abUpdateCol = sqlite3_malloc(vtab->nCol > 0 ? vtab->nCol : 1);
+  if (vtab->abUpdateCol != NULL) {
+    memset(vtab->abUpdateCol, 0, vtab->nCol);
+    for (int i = 0; i < nSubst; i++) {
+      if (aSubst[i].iParam <= vtab->nCol)
+        vtab->abUpdateCol[aSubst[i].iParam - 1] = 1;
+    }
+  }
+  sqlite3_free(aSubst);
+  return vtab->abUpdateCol == NULL ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+/*
+** Sqlite calls this function when CREATE VIRTUAL TABLE is executed (with
+** bCreate set), and when it needs the virtual table again after that, e.g.
+** when the database is reopened. We get passed the USING clause. We need
+** to declare the columns of the virtual table, allocate the virtual table
+** object, and do anything else needed to get the virtual table ready. In
+** our case, that means preparing the underlying SQL (passed via the USING
+** clause) to validate its syntax and find out what columns it returns.
+*/
+static int sqlexecInit(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr,
+  int bCreate
+){
+  sqlexec_vtab *pNew;
+  int rc;
+
+  /*
+  ** Check passed arguments are what we expected. Note that argv vector looks
+  ** like this:
+  ** argv[0]: module name (in our case "sqlexec")
+  ** argv[1]: name of database (most commonly "main")
+  ** argv[2]: name of virtual table
+  ** argv[3]: first USING clause argument
+  ** argv[4...]: options (see sqlexecParseOptions)
+  **
+  ** Note although we are module/database/table names, we don't use them for
+  ** anything at the moment; all we use is what is in the USING clause. We
+  ** expect at least one parameter in the USING clause so that is what we
+  ** are validating for below.
+  */
+  if (argc < 4) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: expected at least 1 argument"
+                               " in USING clause, got %d\n", argc - 3);
+    return SQLITE_ERROR;
+  }
+  sqlexec_options opts;
+  rc = sqlexecParseOptions(&opts, argc - 4, argv + 4, pzErr);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  /* In first parameter of USING clause we were passed SQL to execute */
+  char *sql = sqlexecUnparen(argv[3]);
+  if (sql == NULL)
+    return SQLITE_NOMEM;
+
+  /*
+  ** If there is more than one statement, the last returns the rows and the
+  ** ones before it are setup statements.
+  */
+  char **azSetup = NULL;
+  int nSetup = 0;
+  const char *zLast;
+  rc = sqlexecSplitSetup(sql, &azSetup, &nSetup, &zLast);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(sql);
+    return rc;
+  }
+  char *abSetupDone = NULL;
+  if (nSetup > 0) {
+    char *sqlLast = sqlite3_mprintf("%s", zLast);
+    sqlite3_free(sql);
+    sql = sqlLast;
+    abSetupDone = sqlite3_malloc(nSetup);
+    if (sql == NULL || abSetupDone == NULL) {
+      sqlite3_free(sql);
+      rc = SQLITE_NOMEM;
+      goto setup_error;
+    }
+    memset(abSetupDone, 0, nSetup);
+  }
+
+  if (opts.nPrefetch > 0 && (nSetup > 0 || sqlexecIsPragma(sql))) {
+    /* The worker's connection would not see what these do to ours */
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: %s can't be used with %s",
+                               opts.zPartition ? "partition" : "prefetch",
+                               nSetup > 0 ? "setup statements"
+                               : "a PRAGMA");
+    sqlite3_free(sql);
+    rc = SQLITE_ERROR;
+    goto setup_error;
+  }
+
+  /*
+  ** If the SQL is a PRAGMA, find the parameters in it and substitute
+  ** placeholder values for them, since otherwise it will not prepare.
+  */
+  sqlexec_subst *aSubst = NULL;
+  int nSubst = 0;
+  sqlexec_schema schema;
+  memset(&schema, 0, sizeof(schema));
+  char **azParam = NULL;
+  int nParam = 0;
+  char *zArgs = NULL;
+  char *zSrc = NULL;
+  char *zExpanded = NULL; /* sql with PRAGMA parameters substituted */
+  if (sqlexecIsPragma(sql)) {
+    rc = sqlexecScanPragmaParams(sql, &aSubst, &nSubst, &azParam, &nParam);
+    if (rc != SQLITE_OK) {
+      if (pzErr && rc == SQLITE_RANGE)
+        *pzErr = sqlite3_mprintf("sqlexecConnect: too many parameters in: %s",
+                                 sql);
+      if (rc == SQLITE_RANGE)
+        rc = SQLITE_ERROR;
+      goto connect_error;
+    }
+    if (nSubst > 0) {
+      zExpanded = sqlexecExpandPragma(sql, aSubst, nSubst, NULL);
+      if (zExpanded == NULL) {
+        rc = SQLITE_NOMEM;
+        goto connect_error;
+      }
+    }
+  }
+
+  /*
+  ** Find out the columns the SQL returns, from the shared schema cache or
+  ** the schema table if they are up to date (see sqlexecSharedGet and
+  ** sqlexecSchemaLoad), or else by preparing the SQL.
+  */
+  zArgs = sqlexecSchemaArgs(argc, argv);
+  if (zArgs == NULL) {
+    rc = SQLITE_NOMEM;
+    goto connect_error;
+  }
+  if (bCreate && sqlexecSchemaExists(db, argv[1], argv[2])) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecCreate: %s" SQLEXEC_SCHEMA_SUFFIX
+                               " already exists, and would be the schema"
+                               " table of %s", argv[2], argv[2]);
+    rc = SQLITE_ERROR;
+    goto connect_error;
+  }
+  int bShared = !bCreate
+             && sqlexecSharedGet(db, argv[1], argv[2], zArgs, &schema);
+  int bStale = 0;          /* Declared from an out of date row */
+  int bUnchecked = bShared
+                || (!bCreate
+                    && sqlexecSchemaLoad(db, argv[1], argv[2], zArgs, 0,
+                                         &schema));
+  if (!bUnchecked) {
+    rc = sqlexecSchemaPrepare(db, sql, zExpanded ? zExpanded : sql, &opts,
+                              aSubst ? azParam : NULL, &nParam,
+                              azSetup, nSetup, abSetupDone, bCreate,
+                              &schema, pzErr);
+    if (rc != SQLITE_OK && !bCreate && nSetup > 0
+        && sqlexecSchemaLoad(db, argv[1], argv[2], zArgs, 1, &schema)) {
+      /*
+      ** The SQL may need what its setup statements do, and they can't run
+      ** while SQLite is preparing the statement which connected us. So we
+      ** declare the table as CREATE VIRTUAL TABLE recorded it, even if the
+      ** schema has changed since, and check the SQL once the setup has
+      ** run, when the first cursor is opened (see sqlexecSchemaCheck).
+      */
+      if (pzErr) {
+        sqlite3_free(*pzErr);
+        *pzErr = NULL;
+      }
+      bUnchecked = 1;
+      bStale = 1;
+      rc = SQLITE_OK;
+    }
+    if (rc != SQLITE_OK)
+      goto connect_error;
+  }
+  if (!bUnchecked) {
+    if (nSubst == 0)
+      zSrc = sqlexecRewriteSource(db, sql, schema.nCol, 1);
+    schema.bSrc = zSrc != NULL;
+  } else if (schema.bSrc) {
+    zSrc = sqlexecRewriteSource(db, sql, schema.nCol, 0);
+    if (zSrc == NULL) {
+      rc = SQLITE_NOMEM;
+      goto connect_error;
+    }
+  }
+  /* For sqlexecSchemaRelearn, copied below */
+  const char *azSchemaOpt[3] = { opts.zOrder, opts.zPartition, opts.zKey };
+  opts.zOrder = NULL;
+  opts.zPartition = NULL;
+
+  /*
+  ** Declare columns of this virtual table.
+  */
+  rc = sqlite3_declare_vtab(db, schema.zDecl);
+  if (rc != SQLITE_OK) {
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: sqlite3_declare_vtab failed for %s\n",
+                               schema.zDecl);
+    goto connect_error;
+  }
+  if (bCreate) {
+    rc = sqlexecSchemaSave(db, argv[1], argv[2], zArgs, &schema, 1);
+    if (rc != SQLITE_OK) {
+      if (pzErr)
+        *pzErr = sqlite3_mprintf("sqlexecConnect: can't create %s"
+                                 SQLEXEC_SCHEMA_SUFFIX ": %s", argv[2],
+                                 sqlite3_errmsg(db));
+      goto connect_error;
+    }
+  }
+  if (!bCreate && !bShared)
+    sqlexecSharedPut(db, argv[1], argv[2], zArgs, &schema);
+
+  /*
+  ** Allocate memory for virtual table object.
+  */
+  pNew = sqlite3_malloc( sizeof(*pNew) );
+  if( pNew==0 ){
+    rc = SQLITE_NOMEM;
+    goto connect_error;
+  }
+  memset(pNew, 0, sizeof(*pNew));
+  if (!bCreate && (!bUnchecked || bStale)
+      && sqlite3_db_readonly(db, argv[1]) == 0
+      && sqlexecReadCookie(db, argv[1], &pNew->iStaleCookie) == SQLITE_OK)
+    /* Recorded by sqlexecSchemaRefresh, or not at all if we run out */
+    sqlexecSchemaCopy(&pNew->stale, &schema);
+  pNew->zArgs = zArgs;
+  zArgs = NULL;
+  pNew->db = db;
+  pNew->sql = sql;
+  pNew->pool.zSql = sql;
+  sql = NULL;
+  pNew->nCol = schema.nCol;
+  pNew->nParam = schema.nParam;
+  pNew->nSubst = nSubst;
+  pNew->aSubst = aSubst;
+  pNew->opts = opts;
+  pNew->bCatalog = nSetup == 0 && sqlexecIsCatalog(pNew->sql);
+  if (pNew->opts.nCacheSize < 0)
+    pNew->opts.nCacheSize = pNew->bCatalog ? SQLEXEC_CATALOG_CACHE : 0;
+  pNew->nCatalogSig = -1;
+  pNew->aRowEstimate[0] = (double)opts.nRowsHint;
+  pNew->aRowEstimate[1] = -1.0;
+  aSubst = NULL;
+  pNew->nOrder = schema.nOrder;
+  pNew->aOrder = schema.aOrder;
+  schema.aOrder = NULL;
+  pNew->iPartCol = schema.iPartCol;
+  pNew->nPart = schema.nPart;
+  pNew->bPartOrdered = pNew->nPart > 1 && pNew->nOrder > 0
+                    && pNew->aOrder[0].iCol == pNew->iPartCol
+                    && !pNew->aOrder[0].bDesc;
+  pNew->aClass = schema.aClass;
+  schema.aClass = NULL;
+  pNew->bUnchecked = bUnchecked;
+  pNew->nSetup = nSetup;
+  pNew->azSetup = azSetup;
+  azSetup = NULL;
+  pNew->abSetupDone = abSetupDone;
+  abSetupDone = NULL;
+  if (nSetup > 0) {
+    pNew->apSetup = sqlite3_malloc64(nSetup * sizeof(sqlite3_stmt*));
+    if (pNew->apSetup == NULL) {
+      sqlexecDisconnect((sqlite3_vtab*)pNew);
+      rc = SQLITE_NOMEM;
+      goto connect_error;
+    }
+    memset(pNew->apSetup, 0, nSetup * sizeof(sqlite3_stmt*));
+  }
+  pNew->zSrc = zSrc;
+  zSrc = NULL;
+  if (pNew->nPart > 1 && pNew->zSrc == NULL) {
+    /* Slices are made by rewriting the SQL */
+    if (pzErr)
+      *pzErr = sqlite3_mprintf("sqlexecConnect: partition needs a query: %s",
+                               pNew->sql);
+    sqlexecDisconnect((sqlite3_vtab*)pNew);
+    rc = SQLITE_ERROR;
+    goto connect_error;
+  }
+  pNew->zDb = sqlite3_mprintf("%s", argv[1]);
+  pNew->zName = sqlite3_mprintf("%s", argv[2]);
+  if (pNew->zDb == NULL || pNew->zName == NULL) {
+    sqlexecDisconnect((sqlite3_vtab*)pNew);
+    rc = SQLITE_NOMEM;
+    goto connect_error;
+  }
+  pNew->opts.zKey = NULL;
+  for (int i = 0; i < 3; i++) {
+    if (azSchemaOpt[i] == NULL)
+      continue;
+    pNew->azSchemaOpt[i] = sqlite3_mprintf("%s", azSchemaOpt[i]);
+    if (pNew->azSchemaOpt[i] == NULL) {
+      sqlexecDisconnect((sqlite3_vtab*)pNew);
+      rc = SQLITE_NOMEM;
+      goto connect_error;
+    }
+  }
+  if (opts.zSnapshot != NULL) {
+    pNew->opts.zSnapshot = NULL;
+    pNew->zSnapshot = sqlexecUnparen(opts.zSnapshot);
+    if (pNew->zSnapshot == NULL) {
+      sqlexecDisconnect((sqlite3_vtab*)pNew);
+      rc = SQLITE_NOMEM;
+      goto connect_error;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    pNew->opts.azWrite[i] = NULL;
+    if (opts.azWrite[i] == NULL)
+      continue;
+    pNew->azWrite[i] = sqlexecUnparen(opts.azWrite[i]);
+    if (pNew->azWrite[i] == NULL) {
+      sqlexecDisconnect((sqlite3_vtab*)pNew);
+      rc = SQLITE_NOMEM;
+      goto connect_error;
+    }
+  }
+  if (pNew->azWrite[SQLEXEC_WRITE_UPDATE] != NULL
+      && sqlexecFindUpdateCols(pNew) != SQLITE_OK) {
+    sqlexecDisconnect((sqlite3_vtab*)pNew);
+    rc = SQLITE_NOMEM;
+    goto connect_error;
+  }
+  sqlexecEnvLink((sqlexec_env*)pAux, pNew);
+  rc = SQLITE_OK;
+
+  /*
+  ** Return to caller.
+  */
+  *ppVtab = (sqlite3_vtab *) pNew;
+
+connect_error:
+  sqlite3_free(zExpanded);
+  sqlite3_free(sql);
+  sqlite3_free(zSrc);
+  sqlite3_free(zArgs);
+  sqlite3_free(aSubst);
+  sqlexecSchemaFree(&schema);
+  if (azParam != NULL) {
+    for (int i = 0; i < nParam; i++)
+      sqlite3_free(azParam[i]);
+    sqlite3_free(azParam);
+  }
+setup_error:
+  sqlite3_free(abSetupDone);
+  if (azSetup != NULL) {
+    for (int i = 0; i < nSetup; i++)
+      sqlite3_free(azSetup[i]);
+    sqlite3_free(azSetup);
+  }
+  return rc;
+}
+
+static int sqlexecCreate(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  return sqlexecInit(db, pAux, argc, argv, ppVtab, pzErr, 1);
+}
+
+static int sqlexecConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  return sqlexecInit(db, pAux, argc, argv, ppVtab, pzErr, 0);
+}
+
+/*
+** Free a closed cursor and what it keeps for reuse.
+*/
+static void sqlexecCursorFree(sqlexec_cursor *pCur){
+  sqlexecRowsetUnref(pCur->apBlock[0]);
+  sqlexecRowsetUnref(pCur->apBlock[1]);
+  sqlite3_free(pCur->apArg);
+  sqlite3_free(pCur);
+}
+
+/*
+** Disconnect virtual table. All we need to do is make sure that memory for
+** virtual table object is deallocated, and finalize any pooled statements.
+*/
+static int sqlexecDisconnect(sqlite3_vtab *pVtab){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  if (vtab->ppPrev) {
+    *vtab->ppPrev = vtab->pNext;
+    if (vtab->pNext)
+      vtab->pNext->ppPrev = vtab->ppPrev;
+  }
+  sqlexecPoolClear(vtab);
+  while (vtab->pVariant != NULL) {
+    sqlexec_pool *p = vtab->pVariant;
+    vtab->pVariant = p->pNext;
+    sqlite3_free(p->zSql);
+    sqlite3_free(p);
+  }
+  sqlite3_finalize(vtab->pCookieStmt);
+  sqlite3_finalize(vtab->pSentinel);
+  sqlite3_free(vtab->zSentinelDbs);
+  sqlexecRowsetUnref(vtab->pMat);
+  sqlexecCacheClear(&vtab->cache);
+  sqlite3_free(vtab->zDb);
+  sqlite3_free(vtab->zName);
+  sqlite3_free(vtab->sql);
+  sqlite3_free(vtab->aSubst);
+  sqlite3_free(vtab->zSrc);
+  sqlite3_free(vtab->aOrder);
+  sqlite3_free(vtab->aClass);
+  sqlexecSchemaFree(&vtab->stale);
+  sqlite3_free(vtab->zArgs);
+  for (int i = 0; i < 3; i++)
+    sqlite3_free(vtab->azSchemaOpt[i]);
+  for (int i = 0; i < vtab->nSetup; i++) {
+    if (vtab->apSetup != NULL)
+      sqlite3_finalize(vtab->apSetup[i]);
+    sqlite3_free(vtab->azSetup[i]);
+  }
+  sqlite3_free(vtab->apSetup);
+  sqlite3_free(vtab->azSetup);
+  sqlite3_free(vtab->abSetupDone);
+  sqlexecPrefetchFreeIdle(vtab);
+  sqlexecRowsetUnref(vtab->pPending);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < SQLEXEC_CONFLICT_MODES; j++)
+      sqlite3_finalize(vtab->apWrite[i][j]);
+    sqlite3_free(vtab->azWrite[i]);
+  }
+  sqlite3_free(vtab->abUpdateCol);
+  sqlite3_free(vtab->zSnapshot);
+  sqlexecRowsetUnref(vtab->pSnap);
+  while (vtab->pIdleCursor != NULL) {
+    sqlexec_cursor *pCur = vtab->pIdleCursor;
+    vtab->pIdleCursor = pCur->pNextIdle;
+    sqlexecCursorFree(pCur);
+  }
+  for (int i = 0; i < 2; i++) {
+    sqlite3_finalize(vtab->apRangeStmt[i]);
+    sqlite3_free(vtab->azRangeSql[i]);
+  }
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+/*
+** Drop the virtual table, and its schema table with it.
+*/
+static int sqlexecDestroy(sqlite3_vtab *pVtab){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  char *sql = sqlite3_mprintf("drop table if exists \"%w\".\"%w"
+                              SQLEXEC_SCHEMA_SUFFIX "\"", vtab->zDb,
+                              vtab->zName);
+  if (sql == NULL)
+    return SQLITE_NOMEM;
+  int rc = sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK)
+    return rc;
+  return sqlexecDisconnect(pVtab);
+}
+
+/*
+** Rename the schema table along with the virtual table. A virtual table
+** created before there were schema tables has none, which doesn't matter.
+*/
+static int sqlexecRename(sqlite3_vtab *pVtab, const char *zNew){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  char *zName = sqlite3_mprintf("%s", zNew);
+  char *sql = sqlite3_mprintf("alter table \"%w\".\"%w" SQLEXEC_SCHEMA_SUFFIX
+                              "\" rename to \"%w" SQLEXEC_SCHEMA_SUFFIX "\"",
+                              vtab->zDb, vtab->zName, zNew);
+  if (zName == NULL || sql == NULL) {
+    sqlite3_free(zName);
+    sqlite3_free(sql);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  sqlite3_free(vtab->zName);
+  vtab->zName = zName;
+  return SQLITE_OK;
+}
+
+/*
+** Learn the schema of a virtual table again by preparing its SQL, as
+** xConnect does, once sqlexecSchemaCheck has found the columns it was
+** declared with out of date, and keep it in vtab->stale for recording.
+** Our own declaration can't change, but the next connection declares
+** the table from the schema table.
+*/
+static int sqlexecSchemaRelearn(sqlexec_vtab *vtab){
+  sqlexec_options opts = vtab->opts;
+  opts.zOrder = vtab->azSchemaOpt[0];
+  opts.zPartition = vtab->azSchemaOpt[1];
+  opts.zKey = vtab->azSchemaOpt[2];
+  sqlexec_subst *aSubst = NULL;
+  int nSubst = 0;
+  char **azParam = NULL;
+  int nParam = 0;
+  char *zExpanded = NULL;
+  sqlexec_schema schema;
+  memset(&schema, 0, sizeof(schema));
+  int rc = SQLITE_OK;
+  if (sqlexecIsPragma(vtab->sql)) {
+    rc = sqlexecScanPragmaParams(vtab->sql, &aSubst, &nSubst, &azParam,
+                                 &nParam);
+    if (rc == SQLITE_OK && nSubst > 0) {
+      zExpanded = sqlexecExpandPragma(vtab->sql, aSubst, nSubst, NULL);
+      if (zExpanded == NULL)
+        rc = SQLITE_NOMEM;
+    }
+  }
+  if (rc == SQLITE_OK)
+    rc = sqlexecSchemaPrepare(vtab->db, vtab->sql,
+                              zExpanded ? zExpanded : vtab->sql, &opts,
+                              aSubst ? azParam : NULL, &nParam,
+                              NULL, 0, NULL, 0, &schema, NULL);
+  if (rc == SQLITE_OK && nSubst == 0) {
+    char *zSrc = sqlexecRewriteSource(vtab->db, vtab->sql, schema.nCol, 1);
+    schema.bSrc = zSrc != NULL;
+    sqlite3_free(zSrc);
+  }
+  if (rc == SQLITE_OK)
+    rc = sqlexecReadCookie(vtab->db, vtab->zDb, &vtab->iStaleCookie);
+  if (rc == SQLITE_OK) {
+    sqlexecSchemaFree(&vtab->stale);
+    vtab->stale = schema;
+  } else {
+    sqlexecSchemaFree(&schema);
+  }
+  sqlite3_free(aSubst);
+  sqlite3_free(zExpanded);
+  if (azParam != NULL) {
+    for (int i = 0; i < nParam; i++)
+      sqlite3_free(azParam[i]);
+    sqlite3_free(azParam);
+  }
+  return rc;
+}
+
+/*
+** A virtual table declared from its schema table (see sqlexecSchemaLoad)
+** hasn't had its SQL prepared yet. Prepare it for the first cursor, after
+** any setup statements it needs, leaving the statement in the pool, and
+** check that it still returns the columns we declared. The schema cookie
+** of our database only tells us of changes to it, not to attached or temp
+** databases the SQL reads, so it may not.
+*/
+static int sqlexecRunSetup(sqlexec_vtab *vtab);
+
+static int sqlexecSchemaCheck(sqlexec_vtab *vtab){
+  sqlite3_stmt *pStmt;
+  int rc = sqlexecRunSetup(vtab);
+  if (rc != SQLITE_OK)
+    return rc;
+  int nCol;
+  if (vtab->nSubst > 0) {
+    /* Prepared for each scan, with the values substituted */
+    char *sql = sqlexecExpandPragma(vtab->sql, vtab->aSubst, vtab->nSubst,
+                                    NULL);
+    if (sql == NULL)
+      return SQLITE_NOMEM;
+    rc = sqlexecPrepare(vtab, sql, 0, &pStmt);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+      return rc;
+    nCol = sqlite3_column_count(pStmt);
+    sqlite3_finalize(pStmt);
+  } else {
+    rc = sqlexecStmtCheckout(vtab, &vtab->pool, &pStmt);
+    if (rc != SQLITE_OK)
+      return rc;
+    nCol = sqlite3_column_count(pStmt);
+    sqlexecStmtCheckin(&vtab->pool, pStmt);
+  }
+  if (nCol != vtab->nCol) {
+    /*
+    ** Record the columns it returns now, so that the next connection
+    ** declares those, in the shared schema cache as well, where this
+    ** connection may have found the old ones. This statement fails, so in
+    ** autocommit mode its transaction ends with it and we may as well
+    ** write the schema table at once.
+    */
+    sqlexecSharedDrop(vtab->db, vtab->zDb, vtab->zName, vtab->zArgs);
+    if (sqlexecSchemaRelearn(vtab) == SQLITE_OK) {
+      sqlexecSharedPut(vtab->db, vtab->zDb, vtab->zName, vtab->zArgs,
+                       &vtab->stale);
+      if (sqlite3_get_autocommit(vtab->db)) {
+        sqlexecSchemaSave(vtab->db, vtab->zDb, vtab->zName, vtab->zArgs,
+                          &vtab->stale, 0);
+        sqlexecSchemaFree(&vtab->stale);
+      } else {
+        sqlexecSchemaRefresh(vtab);
+      }
+    }
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("Error preparing: %s; reason: "
+                                         "returns %d columns, not %d",
+                                         vtab->sql, nCol, vtab->nCol);
+    return SQLITE_ERROR;
+  }
+  vtab->bUnchecked = 0;
+  return SQLITE_OK;
+}
+
+/*
+** Get a cursor for vtab, in the state of a new one: from the cursors
+** closed earlier if there are any, or else a newly allocated one.
+*/
+static sqlexec_cursor *sqlexecCursorNew(sqlexec_vtab *vtab){
+  sqlexec_cursor *pCur = vtab->pIdleCursor;
+  if (pCur != NULL) {
+    vtab->pIdleCursor = pCur->pNextIdle;
+    vtab->nIdleCursor--;
+    sqlite3_value **apArg = pCur->apArg;
+    int nArgAlloc = pCur->nArgAlloc;
+    sqlexec_rowset *apBlock[2] = { pCur->apBlock[0], pCur->apBlock[1] };
+    memset(pCur, 0, sizeof(*pCur));
+    pCur->apArg = apArg;
+    pCur->nArgAlloc = nArgAlloc;
+    pCur->apBlock[0] = apBlock[0];
+    pCur->apBlock[1] = apBlock[1];
+    return pCur;
+  }
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == NULL)
+    return NULL;
+  memset(pCur, 0, sizeof(*pCur));
+  if (vtab->nParam > 0) {
+    pCur->apArg = sqlite3_malloc(vtab->nParam * sizeof(sqlite3_value*));
+    if (pCur->apArg == NULL) {
+      sqlite3_free(pCur);
+      return NULL;
+    }
+    memset(pCur->apArg, 0, vtab->nParam * sizeof(sqlite3_value*));
+  }
+  pCur->nArgAlloc = vtab->nParam;
+  sqlexecStatAdd(vtab, nAlloc, 1);
+  return pCur;
+}
+
+/*
+** Opens a cursor on our virtual table. The cursor gets its statement when
+** xFilter tells it which version of the SQL to run.
+*/
+static int sqlexecOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  sqlexec_vtab *vtab = (sqlexec_vtab*)p;
+  if (vtab->bUnchecked) {
+    int rc = sqlexecSchemaCheck(vtab);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  if (vtab->stale.zDecl != NULL)
+    sqlexecSchemaRefresh(vtab);
+
+  sqlexec_cursor *pCur = sqlexecCursorNew(vtab);
+  if (pCur == NULL)
+    return SQLITE_NOMEM;
+  pCur->bEof = 1; /* no data until xFilter starts a scan */
+  pCur->nArg = vtab->nParam;
+
+  /*
+  ** Success: provide cursor object to caller and return SQLITE_OK.
+  */
+  if (vtab->nOpen++ == 0)
+    vtab->iGeneration++;
+  sqlexecStatAdd(vtab, nCursor, 1);
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+/*
+** Close the cursor. We have to give the underlying statement handle back
+** to the pool, and keep the cursor for reuse or deallocate it.
+*/
+static int sqlexecClose(sqlite3_vtab_cursor *cur){
+  sqlexec_cursor *pCur = (sqlexec_cursor *)cur;
+  sqlexec_vtab *vtab = (sqlexec_vtab *)cur->pVtab;
+  if (pCur->pMerge != NULL)
+    sqlexecPrefetchCheckin(vtab, pCur);
+  if (pCur->pStmt != NULL) {
+    sqlexecStmtCheckin(pCur->pPool, pCur->pStmt);
+    pCur->pStmt = NULL;
+  }
+  sqlexecRowsetUnref(pCur->pRows);
+  pCur->pRows = NULL;
+  vtab->nOpen--;
+  for (int i = 0; i < pCur->nArgAlloc; i++) {
+    sqlite3_value_free(pCur->apArg[i]);
+    pCur->apArg[i] = NULL;
+  }
+  if (vtab->nIdleCursor < SQLEXEC_IDLE_CURSORS) {
+    pCur->pNextIdle = vtab->pIdleCursor;
+    vtab->pIdleCursor = pCur;
+    vtab->nIdleCursor++;
+  } else {
+    sqlexecCursorFree(pCur);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Record the number of rows a scan returned once it reaches the end, so we
+** can give the planner a better idea how big the virtual table is. Scans
+** which bind parameters are counted separately from those which don't.
+** We keep a moving average, so the estimates follow the data if it grows
+** or shrinks. Scans which returned only some of the rows (because of a
+** WHERE or LIMIT we put into the SQL) don't count.
+*/
+static void sqlexecObserveRows(sqlexec_cursor *pCur){
+  sqlexec_vtab *vtab = (sqlexec_vtab*)pCur->base.pVtab;
+  double *pEst = &vtab->aRowEstimate[pCur->bBound];
+  if (pCur->bSubset)
+    return;
+  if (*pEst < 0)
+    *pEst = (double)pCur->iRowid;
+  else
+    *pEst = (*pEst * 3 + pCur->iRowid) / 4;
+}
+
+/*
+** With the block option, read the next block of up to nBlock rows from the
+** statement into the cursor's rowset, so that xNext and xColumn only have
+** to look in the arrays of the rowset until the block is used up. Leaves
+** pCur->pRows NULL if the statement has no more rows.
+**
+** TEXT and BLOB values returned from a rowset reference it rather than
+** being copied (see sqlexecRowsetResult), and SQLite still holds the
+** values of the last row of a block when it asks for the next row, so the
+** rowset of the last block can't be changed yet. We fill the one of the
+** block before instead, which nothing should reference any more, and
+** only start a new rowset if something does. So once the two have grown
+** to the size of a block, nothing more is allocated.
+*/
+static int sqlexecBlockFill(sqlexec_vtab *vtab, sqlexec_cursor *pCur){
+  if (pCur->pRows != NULL) {
+    pCur->iRowBase += pCur->pRows->nRow;
+    sqlexecRowsetUnref(pCur->pRows);
+    pCur->pRows = NULL;
+  }
+  if (pCur->bBlockDone)
+    return SQLITE_OK;
+  sqlexec_rowset *pRows = pCur->apBlock[1];
+  if (pRows != NULL && pRows->nRef > 1) {
+    sqlexecRowsetUnref(pRows);
+    pRows = NULL;
+  }
+  if (pRows == NULL) {
+    pRows = sqlexecRowsetNew(vtab->nCol);
+    if (pRows == NULL) {
+      pCur->apBlock[1] = NULL;
+      return SQLITE_NOMEM;
+    }
+    sqlexecStatAdd(vtab, nAlloc, 1);
+  }
+  pCur->apBlock[1] = pCur->apBlock[0];
+  pCur->apBlock[0] = pRows;
+  pRows->nRow = 0;
+  pRows->nHeap = 0;
+  while (pRows->nRow < vtab->opts.nBlock) {
+    sqlite3_int64 iStart = sqlexecStatStart(vtab);
+    int rc = sqlite3_step(pCur->pStmt);
+    sqlexecStatStep(vtab, iStart);
+    if (rc == SQLITE_DONE) {
+      sqlite3_reset(pCur->pStmt); /* release read locks held by statement */
+      pCur->bBlockDone = 1;
+      break;
+    }
+    if (rc == SQLITE_ROW && pCur->bLimit
+        && sqlexecLimitOver(vtab, pCur->pStmt, pCur->iDeadline))
+      return SQLITE_INTERRUPT;
+    if (rc == SQLITE_ROW)
+      rc = sqlexecRowsetAppend(pRows, pCur->pStmt);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  if (pRows->nRow > 0) {
+    pRows->nRef++;
+    pCur->pRows = pRows;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Advance to next row.
+*/
+static int sqlexecNext(sqlite3_vtab_cursor *cur){
+  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
+  sqlexec_vtab *vtab = (sqlexec_vtab*)cur->pVtab;
+
+  /*
+  ** If we are at end of data, don't advance any further.
+  */
+  if (pCur->bEof)
+    return SQLITE_OK;
+
+  /*
+  ** Take the next batch of rows from the prefetch workers when we have been
+  ** through the last one.
+  */
+  if (pCur->bFetching
+      && (pCur->pRows == NULL
+          || pCur->iRowid - pCur->iRowBase >= pCur->pRows->nRow)) {
+    sqlite3_int64 iStart = sqlexecStatStart(vtab);
+    int rc = sqlexecPrefetchNext(pCur);
+    sqlexecStatStep(vtab, iStart);
+    if (rc != SQLITE_OK) {
+      pCur->bEof = 1;
+      return rc;
+    }
+    if (pCur->pRows == NULL) {
+      sqlexecObserveRows(pCur);
+      pCur->bEof = 1;
+      return SQLITE_OK;
+    }
+  }
+
+  /*
+  ** Or the next block of rows from the statement.
+  */
+  if (pCur->bBlock
+      && (pCur->pRows == NULL
+          || pCur->iRowid - pCur->iRowBase >= pCur->pRows->nRow)) {
+    int rc = sqlexecBlockFill(vtab, pCur);
+    if (rc != SQLITE_OK)
+      return rc;
+    if (pCur->pRows == NULL) {
+      sqlexecObserveRows(pCur);
+      pCur->bEof = 1;
+      return SQLITE_OK;
+    }
+  }
+
+  /*
+  ** Advance through materialized result set.
+  */
+  if (pCur->pRows != NULL) {
+    if (pCur->iRowid - pCur->iRowBase >= pCur->pRows->nRow) {
+      sqlexecObserveRows(pCur);
+      pCur->bEof = 1;
+    } else {
+      pCur->iRowid++;
+      sqlexecStatAdd(vtab, nRow, 1);
+    }
+    return SQLITE_OK;
+  }
+
+  /*
+  ** Or count up to the number of rows the statement counted.
+  */
+  if (pCur->bCount) {
+    if (pCur->nCount < 0) {
+      sqlite3_int64 iStart = sqlexecStatStart(vtab);
+      int rc = sqlite3_step(pCur->pStmt);
+      sqlexecStatStep(vtab, iStart);
+      if (rc == SQLITE_ROW)
+        pCur->nCount = sqlite3_column_int64(pCur->pStmt, 0);
+      sqlite3_reset(pCur->pStmt);
+      if (rc != SQLITE_ROW)
+        return rc == SQLITE_DONE ? SQLITE_ERROR : rc;
+    }
+    if (pCur->iRowid >= pCur->nCount) {
+      sqlexecObserveRows(pCur);
+      pCur->bEof = 1;
+    } else {
+      pCur->iRowid++;
+      sqlexecStatAdd(vtab, nRow, 1);
+    }
+    return SQLITE_OK;
+  }
+
+  /*
+  ** Advance underlying statement handle.
   */
-  char *decl = sqlite3_mprintf("%s", "create table x(");
-  if (decl == NULL) {
-    sqlite3_free(sql);       /* avoid memory leak of SQL text */
-    sqlite3_finalize(pStmt); /* avoid memory leak of prepared stmt */
+  sqlite3_int64 iStart = sqlexecStatStart(vtab);
+  int rc = sqlite3_step(pCur->pStmt);
+  sqlexecStatStep(vtab, iStart);
+  if (rc == SQLITE_DONE) { /* Handle end of data */
+    sqlite3_reset(pCur->pStmt); /* release read locks held by statement */
+    sqlexecObserveRows(pCur);
+    pCur->bEof = 1;
+    return SQLITE_OK;
+  }
+  if (rc == SQLITE_ROW && pCur->bLimit
+      && sqlexecLimitOver(vtab, pCur->pStmt, pCur->iDeadline))
+    return SQLITE_INTERRUPT;
+  if (rc == SQLITE_ROW) { /* Handle a row */
+    pCur->iRowid++;
+    sqlexecStatAdd(vtab, nRow, 1);
+    return SQLITE_OK;
+  }
+  return rc; /* Anything else means an error, just return the error */
+}
+
+/*
+** Purpose of this method is to determine if we are at EOF.
+*/
+static int sqlexecEof(sqlite3_vtab_cursor *cur){
+  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
+  return pCur->bEof;
+}
+
+/*
+** Return value for a specific column of the current row. Values come from
+** the cursor's rowset, or else from the underlying statement. Statement
+** TEXT and BLOB content is overwritten by the next step, so SQLite has to
+** take a copy of it, but we ask for exactly that rather than copying the
+** whole sqlite3_value through sqlite3_result_value.
+*/
+static int sqlexecColumn(
+  sqlite3_vtab_cursor *cur,
+  sqlite3_context *ctx,
+  int i
+){
+  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
+  sqlexec_vtab *vtab = (sqlexec_vtab*)cur->pVtab;
+  if (sqlite3_vtab_nochange(ctx)
+      && (i >= vtab->nCol
+          || (vtab->abUpdateCol != NULL && !vtab->abUpdateCol[i])))
+    return SQLITE_OK; /* UPDATE leaving alone a column it needn't be given */
+  if (i >= vtab->nCol) { /* Hidden column: value bound to the parameter */
+    if (pCur->apArg[i - vtab->nCol] != NULL)
+      sqlite3_result_value(ctx, pCur->apArg[i - vtab->nCol]);
+    return SQLITE_OK;
+  }
+  if (pCur->bCount) /* The query uses no columns, but just in case */
+    return SQLITE_OK;
+  if (pCur->pRows != NULL) {
+    int nByte = sqlexecRowsetResult(pCur->pRows,
+                                    (int)(pCur->iRowid - pCur->iRowBase) - 1,
+                                    i, ctx);
+    sqlexecStatAdd(vtab, nByte, nByte);
+    return SQLITE_OK;
+  }
+  sqlite3_stmt *pStmt = pCur->pStmt;
+  const void *pData;
+  int nByte = 8;
+  switch (sqlite3_column_type(pStmt, i)) {
+    case SQLITE_INTEGER:
+      sqlite3_result_int64(ctx, sqlite3_column_int64(pStmt, i));
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_result_double(ctx, sqlite3_column_double(pStmt, i));
+      break;
+    case SQLITE_TEXT:
+      pData = sqlite3_column_text(pStmt, i);
+      if (pData == NULL)
+        return SQLITE_NOMEM;
+      nByte = sqlite3_column_bytes(pStmt, i);
+      sqlite3_result_text64(ctx, pData, nByte, SQLITE_TRANSIENT,
+                            SQLITE_UTF8);
+      break;
+    case SQLITE_BLOB:
+      pData = sqlite3_column_blob(pStmt, i);
+      nByte = sqlite3_column_bytes(pStmt, i);
+      if (pData == NULL) /* Zero-length, or out of memory */
+        sqlite3_result_value(ctx, sqlite3_column_value(pStmt, i));
+      else
+        sqlite3_result_blob64(ctx, pData, nByte, SQLITE_TRANSIENT);
+      break;
+    default:
+      nByte = 0;
+      break;
+  }
+  sqlexecStatAdd(vtab, nByte, nByte);
+  return SQLITE_OK;
+}
+
+/*
+** Return row identifier for current row: a hash of the values of all its
+** columns, hidden ones included. SQLite only asks for it when it needs to
+** tell rows apart, as in a MULTI-INDEX OR plan, which runs a scan for each
+** term of the OR and drops the rows of one scan whose rowids an earlier
+** one returned. So the same row must get the same rowid in every scan,
+** and different rows different ones. Rows which are the same in every
+** column the query uses get the same rowid, but they can't match one
+** term of the OR and not another, so both are returned by the same scan,
+** which is never checked against itself.
+*/
+static int sqlexecRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
+  sqlexec_vtab *vtab = (sqlexec_vtab*)cur->pVtab;
+  sqlite3_uint64 h = 14695981039346656037ull;
+  for (int i = 0; i < vtab->nParam; i++) {
+    sqlite3_value *pVal = pCur->apArg[i];
+    int eType = pVal ? sqlite3_value_type(pVal) : 0;
+    sqlite3_int64 iVal = 0;
+    double rVal = 0.0;
+    const void *p = NULL;
+    sqlite3_int64 nByte = 0;
+    if (eType == SQLITE_INTEGER) {
+      iVal = sqlite3_value_int64(pVal);
+      p = &iVal;
+      nByte = sizeof(iVal);
+    } else if (eType == SQLITE_FLOAT) {
+      rVal = sqlite3_value_double(pVal);
+      p = &rVal;
+      nByte = sizeof(rVal);
+    } else if (eType == SQLITE_TEXT || eType == SQLITE_BLOB) {
+      p = eType == SQLITE_TEXT ? (const void*)sqlite3_value_text(pVal)
+                               : sqlite3_value_blob(pVal);
+      nByte = sqlite3_value_bytes(pVal);
+    }
+    h = sqlexecHashValue64(h, eType, p, nByte);
+  }
+  for (int i = 0; i < vtab->nCol && !pCur->bCount; i++) {
+    int eType;
+    sqlite3_int64 iVal = 0;
+    double rVal = 0.0;
+    const void *p = NULL;
+    sqlite3_int64 nByte = 0;
+    if (pCur->pRows != NULL) {
+      sqlexec_rowset *pRows = pCur->pRows;
+      int iCell = i * pRows->nRowAlloc
+                + (int)(pCur->iRowid - pCur->iRowBase) - 1;
+      eType = pRows->aType[iCell];
+      if (eType == SQLITE_INTEGER || eType == SQLITE_FLOAT) {
+        p = &pRows->aCell[iCell];
+        nByte = sizeof(sqlexec_cell);
+      } else if (eType == SQLITE_TEXT || eType == SQLITE_BLOB) {
+        nByte = pRows->anByte[iCell];
+        if (pRows->aCell[iCell].i < 0 || nByte < 0
+            || pRows->aCell[iCell].i > pRows->nHeap - nByte)
+          nByte = 0; /* Damaged snapshot file, see sqlexecRowsetResult */
+        else
+          p = &pRows->aHeap[pRows->aCell[iCell].i];
+      }
+    } else {
+      eType = sqlite3_column_type(pCur->pStmt, i);
+      if (eType == SQLITE_INTEGER) {
+        iVal = sqlite3_column_int64(pCur->pStmt, i);
+        p = &iVal;
+        nByte = sizeof(iVal);
+      } else if (eType == SQLITE_FLOAT) {
+        rVal = sqlite3_column_double(pCur->pStmt, i);
+        p = &rVal;
+        nByte = sizeof(rVal);
+      } else if (eType == SQLITE_TEXT || eType == SQLITE_BLOB) {
+        p = eType == SQLITE_TEXT
+          ? (const void*)sqlite3_column_text(pCur->pStmt, i)
+          : sqlite3_column_blob(pCur->pStmt, i);
+        nByte = sqlite3_column_bytes(pCur->pStmt, i);
+      }
+      if (p == NULL)
+        nByte = 0;
+    }
+    h = sqlexecHashValue64(h, eType, p, nByte);
+  }
+  *pRowid = (sqlite3_int64)h;
+  return SQLITE_OK;
+}
+
+/*
+** How xFilter should rewrite the SQL of a virtual table for a scan, as
+** decided by sqlexecBestIndex. Values the rewrite needs are passed to
+** xFilter after the parameters of the SQL, and get the parameter numbers
+** which follow those of the SQL.
+*/
+typedef struct sqlexec_plan sqlexec_plan;
+struct sqlexec_plan {
+  int bRewrite;   /* True if the SQL needs rewriting at all */
+  int bUnbound;   /* True if some parameters are left unbound */
+  int bOrder;     /* Any rewrite must keep to the ORDER BY of the query */
+  int bProject;   /* Only return the columns in colUsed */
+  int bCount;     /* Only count the rows (see sqlexecPlanCount) */
+  int nExtra;     /* Number of values passed after the parameters */
+  int iLimit;     /* Parameter number of the LIMIT value, or 0 */
+  int iOffset;    /* Parameter number of the OFFSET value, or 0 */
+  sqlite3_str *pWhere;  /* Terms of the WHERE clause */
+  sqlite3_str *pExact;  /* The terms which don't depend on affinity */
+  sqlite3_str *pClass;  /* Kind of value each extra value needs */
+};
+
+/*
+** Decide whether the rows of a scan can come out in the order of the ORDER
+** BY in pIdxInfo, so SQLite needn't sort them. They can if the order
+** option says the SQL returns them in that order already, or if there is
+** at most one. Otherwise, if the SQL can be rewritten, we put the ORDER BY
+** into the rewrite. There it might be satisfied by an index on the
+** underlying tables, and in any case it is no more work than the sort
+** SQLite would do.
+**
+** The slices of a partitioned scan each sort only their own rows, so they
+** are no help unless merged in order (bPartOrdered), and then only for the
+** order option: a rewrite is not worth it for what SQLite would sort anyway.
+*/
+static void sqlexecPlanOrder(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  sqlexec_plan *pPlan
+){
+  int nOrderBy = pIdxInfo->nOrderBy;
+  const struct sqlite3_index_orderby *aOrderBy = pIdxInfo->aOrderBy;
+  for (int i = 0; i < nOrderBy; i++) {
+    if (aOrderBy[i].iColumn < 0 || aOrderBy[i].iColumn >= vtab->nCol)
+      return;
+  }
+  if (pIdxInfo->idxFlags & SQLITE_INDEX_SCAN_UNIQUE) {
+    pIdxInfo->orderByConsumed = 1;
+    return;
+  }
+  if (vtab->nPart > 1 && !vtab->bPartOrdered)
+    return;
+  if (nOrderBy <= vtab->nOrder) {
+    int i = 0;
+    while (i < nOrderBy && aOrderBy[i].iColumn == vtab->aOrder[i].iCol
+           && !aOrderBy[i].desc == !vtab->aOrder[i].bDesc)
+      i++;
+    if (i == nOrderBy) {
+      pIdxInfo->orderByConsumed = 1;
+      pPlan->bOrder = 1;
+      return;
+    }
+  }
+  if (vtab->zSrc == NULL || vtab->opts.bMaterialize || vtab->nPart > 1)
+    return;
+  pIdxInfo->orderByConsumed = 1;
+  pPlan->bOrder = 1;
+  pPlan->bRewrite = 1;
+}
+
+/*
+** Put constraints on the columns of the SQL into the WHERE clause of the
+** rewrite. There the planner for the SQL can use indexes on the underlying
+** tables for them, and rows they rule out never leave the SQL.
+**
+** The columns of the virtual table are declared with the types of the
+** columns of the SQL, but inside the SQL the other side of a comparison is
+** a parameter, which has no affinity, while outside it may have one, so the
+** two can convert values differently. This can't change the answer when the
+** value compared with doesn't need converting for the affinity of the
+** column: a number for a column with numeric affinity, or text for one
+** with TEXT affinity. We don't know the values until xFilter though, so
+** SQLite still checks the comparisons itself (omit is 0), and in pClass
+** we record the kind of value each needs, 'n' or 't'. xFilter uses a
+** rewrite without them if it gets a value of another kind (see
+** sqlexecFilterSql). No choice of value is safe for columns with no
+** affinity, as the other side of the comparison might have one, so we
+** leave comparisons on those to SQLite. LIKE, GLOB and IS [NOT] NULL
+** don't depend on affinity, so we can take them over entirely.
+**
+** We guess each equality constraint keeps a tenth of the rows, and any
+** other a half. If we have no idea how many rows there are, we expect an
+** equality constraint to leave as many as binding a parameter would.
+** nArg is the number of values already passed to xFilter.
+*/
+static void sqlexecPlanWhere(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  sqlexec_plan *pPlan,
+  int nArg
+){
+  double nRow = (double)pIdxInfo->estimatedRows;
+  int nTerm = 0;
+  int nExact = 0;
+  if (vtab->zSrc == NULL || vtab->opts.bMaterialize)
+    return;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *p = &pIdxInfo->aConstraint[i];
+    struct sqlite3_index_constraint_usage *pUsage =
+      &pIdxInfo->aConstraintUsage[i];
+    if (!p->usable || p->iColumn < 0 || p->iColumn >= vtab->nCol
+        || pUsage->argvIndex > 0)
+      continue;
+    char cClass = vtab->aClass[p->iColumn];
+    int bValue = 1;
+    const char *zOp;
+    switch (p->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:    zOp = "=";  break;
+      case SQLITE_INDEX_CONSTRAINT_GT:    zOp = ">";  break;
+      case SQLITE_INDEX_CONSTRAINT_LE:    zOp = "<="; break;
+      case SQLITE_INDEX_CONSTRAINT_LT:    zOp = "<";  break;
+      case SQLITE_INDEX_CONSTRAINT_GE:    zOp = ">="; break;
+      case SQLITE_INDEX_CONSTRAINT_LIKE:  zOp = "LIKE"; cClass = '-'; break;
+      case SQLITE_INDEX_CONSTRAINT_GLOB:  zOp = "GLOB"; cClass = '-'; break;
+      case SQLITE_INDEX_CONSTRAINT_ISNULL:
+        zOp = "IS NULL";
+        cClass = '-';
+        bValue = 0;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+        zOp = "IS NOT NULL";
+        cClass = '-';
+        bValue = 0;
+        break;
+      default:
+        continue;
+    }
+    if (cClass == 0)
+      continue;
+
+    sqlite3_str_appendf(pPlan->pWhere, "%sc%d %s",
+                        nTerm++ ? " AND " : " WHERE ", p->iColumn, zOp);
+    if (cClass == '-')
+      sqlite3_str_appendf(pPlan->pExact, "%sc%d %s",
+                          nExact++ ? " AND " : " WHERE ", p->iColumn, zOp);
+    if (bValue) {
+      pUsage->argvIndex = nArg + ++pPlan->nExtra;
+      sqlite3_str_appendchar(pPlan->pClass, 1, cClass);
+      int iParam = vtab->nParam + pPlan->nExtra;
+      if (cClass == '-') {
+        sqlite3_str_appendf(pPlan->pWhere, " ?%d", iParam);
+        sqlite3_str_appendf(pPlan->pExact, " ?%d", iParam);
+      } else {
+        sqlite3_str_appendf(pPlan->pWhere, " ?%d COLLATE \"%w\"", iParam,
+                            sqlite3_vtab_collation(pIdxInfo, i));
+      }
+    }
+    pUsage->omit = cClass == '-';
+    if (p->op == SQLITE_INDEX_CONSTRAINT_EQ && nRow >= (double)2147483647)
+      nRow = 10; /* as for a bound parameter */
+    else if (p->op == SQLITE_INDEX_CONSTRAINT_EQ
+             || p->op == SQLITE_INDEX_CONSTRAINT_ISNULL)
+      nRow *= 0.1;
+    else
+      nRow *= 0.5;
+    pPlan->bRewrite = 1;
+  }
+
+  if (nTerm > 0) {
+    if (nRow < 1)
+      nRow = 1;
+    pIdxInfo->estimatedRows = (sqlite3_int64)nRow;
+    if (!pPlan->bUnbound)
+      pIdxInfo->estimatedCost = nRow + 1;
+    pIdxInfo->idxNum |= SQLEXEC_IDX_SUBSET;
+  }
+}
+
+/*
+** Take over the LIMIT and OFFSET of the query, if SQLite gives them to us
+** (it does from version 3.38.0), by putting them into the rewrite. Then
+** the scan stops as soon as it has the rows wanted, rather than running
+** the SQL to the end for SQLite to throw most of the rows away. It's only
+** safe to do if the rows come out in the order the query wants and we are
+** filtering them by all the constraints we were given, since otherwise
+** SQLite would still be sorting or filtering the rows after the LIMIT.
+** Each slice of a partitioned scan would apply the LIMIT on its own, so we
+** leave it to SQLite then. nArg is the number of values already passed to
+** xFilter.
+*/
+static void sqlexecPlanLimit(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  sqlexec_plan *pPlan,
+  int nArg
+){
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+  int iLimit = -1;
+  int iOffset = -1;
+  if (vtab->zSrc == NULL || vtab->opts.bMaterialize || vtab->nPart > 1)
+    return;
+  if (pIdxInfo->nOrderBy > 0 && !pIdxInfo->orderByConsumed)
+    return;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *p = &pIdxInfo->aConstraint[i];
+    if (p->op == SQLITE_INDEX_CONSTRAINT_LIMIT && p->usable)
+      iLimit = i;
+    else if (p->op == SQLITE_INDEX_CONSTRAINT_OFFSET && p->usable)
+      iOffset = i;
+    else if (!pIdxInfo->aConstraintUsage[i].omit)
+      return;
+  }
+  if (iLimit < 0)
+    return;
+
+  struct sqlite3_index_constraint_usage *aUsage =
+    pIdxInfo->aConstraintUsage;
+  aUsage[iLimit].argvIndex = nArg + ++pPlan->nExtra;
+  aUsage[iLimit].omit = 1;
+  sqlite3_str_appendchar(pPlan->pClass, 1, '-');
+  pPlan->iLimit = vtab->nParam + pPlan->nExtra;
+  if (iOffset >= 0) {
+    aUsage[iOffset].argvIndex = nArg + ++pPlan->nExtra;
+    aUsage[iOffset].omit = 1;
+    sqlite3_str_appendchar(pPlan->pClass, 1, '-');
+    pPlan->iOffset = vtab->nParam + pPlan->nExtra;
+  }
+  pPlan->bRewrite = 1;
+  pIdxInfo->idxNum |= SQLEXEC_IDX_SUBSET;
+
+  /* If we know the limit, we know the scan returns no more rows */
+  sqlite3_value *pVal = NULL;
+  if (sqlite3_vtab_rhs_value(pIdxInfo, iLimit, &pVal) == SQLITE_OK
+      && sqlite3_value_type(pVal) == SQLITE_INTEGER) {
+    sqlite3_int64 nLimit = sqlite3_value_int64(pVal);
+    if (nLimit >= 0 && nLimit < pIdxInfo->estimatedRows) {
+      pIdxInfo->estimatedRows = nLimit;
+      if (!pPlan->bUnbound)
+        pIdxInfo->estimatedCost = (double)(nLimit + 1);
+    }
+  }
+#endif
+}
+
+/*
+** Leave out of the rewrite any columns the query doesn't use (according
+** to colUsed), so the SQL doesn't spend time working them out. We return
+** NULL for them instead. Bit 63 of colUsed covers all the columns from
+** the 64th onwards.
+*/
+static void sqlexecPlanProject(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  sqlexec_plan *pPlan
+){
+  if (vtab->zSrc == NULL || vtab->opts.bMaterialize)
+    return;
+  for (int i = 0; i < vtab->nCol; i++) {
+    if (!(pIdxInfo->colUsed & ((sqlite3_uint64)1 << (i < 63 ? i : 63)))) {
+      pPlan->bProject = 1;
+      pPlan->bRewrite = 1;
+      return;
+    }
+  }
+}
+
+/*
+** Have the SQL count the rows instead of returning them, if the query uses
+** none of the columns, as with `select count(*) from v`, or an EXISTS or
+** IN on a parameter column. The rewrite is then `select count(*) from
+** (...)`, and SQLite counts the rows inside the SQL, often without
+** reading them at all (for a plain table it just counts the entries of
+** its b-tree). The cursor then goes through that many rows of NULLs.
+**
+** A WHERE clause we put into the rewrite never leaves columns unused, as
+** SQLite still checks the comparisons, but the LIMIT and OFFSET can be
+** counted within. We leave partitioned scans to their workers, and scans
+** which have max_steps or timeout_ms out, as those are checked on each
+** row and a count returns just one.
+*/
+static void sqlexecPlanCount(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  sqlexec_plan *pPlan
+){
+  if (vtab->zSrc == NULL || vtab->opts.bMaterialize || vtab->nPart > 1
+      || vtab->opts.nMaxSteps > 0 || vtab->opts.nTimeout > 0)
+    return;
+  for (int i = 0; i < vtab->nCol; i++) {
+    if (pIdxInfo->colUsed & ((sqlite3_uint64)1 << (i < 63 ? i : 63)))
+      return;
+  }
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint_usage *pUsage =
+      &pIdxInfo->aConstraintUsage[i];
+    if (pIdxInfo->aConstraint[i].usable && pUsage->argvIndex > 0
+        && !pUsage->omit)
+      return;
+  }
+  pPlan->bCount = 1;
+  pPlan->bRewrite = 1;
+}
+
+/*
+** Append the start of a rewrite, up to the end of the FROM clause.
+*/
+static void sqlexecAppendSelect(
+  sqlite3_str *pStr,
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  const sqlexec_plan *pPlan
+){
+  sqlite3_str_appendf(pStr, "%s SELECT ", vtab->zSrc);
+  if (pPlan->bCount) {
+    sqlite3_str_appendall(pStr, "count(*) FROM (SELECT NULL");
+  } else if (pPlan->bProject) {
+    for (int i = 0; i < vtab->nCol; i++) {
+      int bUsed = (pIdxInfo->colUsed
+                   & ((sqlite3_uint64)1 << (i < 63 ? i : 63))) != 0;
+      if (bUsed)
+        sqlite3_str_appendf(pStr, "%sc%d", i ? ", " : "", i);
+      else
+        sqlite3_str_appendf(pStr, "%sNULL", i ? ", " : "");
+    }
+  } else {
+    sqlite3_str_appendall(pStr, "*");
+  }
+  sqlite3_str_appendall(pStr, " FROM " SQLEXEC_SRC);
+}
+
+/*
+** Append the ORDER BY of a plan to a rewrite. SQLite only gives us ORDER BY
+** terms using the collation of our columns, which is BINARY, and the
+** columns of the SQL might have another, so the rewrite says which to use.
+*/
+static void sqlexecAppendOrder(
+  sqlite3_str *pStr,
+  sqlite3_index_info *pIdxInfo,
+  const sqlexec_plan *pPlan
+){
+  if (!pPlan->bOrder)
+    return;
+  for (int i = 0; i < pIdxInfo->nOrderBy; i++) {
+    const struct sqlite3_index_orderby *p = &pIdxInfo->aOrderBy[i];
+    sqlite3_str_appendf(pStr, "%sc%d COLLATE BINARY%s",
+                        i ? ", " : " ORDER BY ", p->iColumn,
+                        p->desc ? " DESC" : "");
+  }
+}
+
+/*
+** Write the rewritten SQL for a plan into idxStr, for xFilter to run
+** instead of the SQL of the virtual table. It reads the rows of the SQL
+** from the WITH clause in vtab->zSrc.
+**
+** idxStr holds three strings, one after the other: the rewrite, then the
+** rewrite to fall back on if xFilter gets values of the wrong kind for
+** the WHERE clause (or an empty string if there is no need for one), then
+** the kind of each value, from pPlan->pClass, and last "count" if the
+** rewrite counts the rows (see sqlexecPlanCount). EXPLAIN QUERY PLAN just
+** shows the first.
+*/
+static int sqlexecPlanRewrite(
+  sqlexec_vtab *vtab,
+  sqlite3_index_info *pIdxInfo,
+  const sqlexec_plan *pPlan
+){
+  sqlite3_str *pStr = sqlite3_str_new(vtab->db);
+  const char *zWhere = sqlite3_str_value(pPlan->pWhere);
+  const char *zExact = sqlite3_str_value(pPlan->pExact);
+  const char *zClass = sqlite3_str_value(pPlan->pClass);
+  sqlexecAppendSelect(pStr, vtab, pIdxInfo, pPlan);
+  sqlite3_str_appendall(pStr, zWhere ? zWhere : "");
+  sqlexecAppendOrder(pStr, pIdxInfo, pPlan);
+  if (pPlan->iLimit)
+    sqlite3_str_appendf(pStr, " LIMIT ?%d", pPlan->iLimit);
+  if (pPlan->iOffset)
+    sqlite3_str_appendf(pStr, " OFFSET ?%d", pPlan->iOffset);
+  if (pPlan->bCount)
+    sqlite3_str_appendall(pStr, ")");
+  sqlite3_str_appendchar(pStr, 1, 0);
+
+  /* A count has no WHERE clause, so never needs the fallback */
+  if (zClass && (strchr(zClass, 'n') || strchr(zClass, 't'))) {
+    sqlexecAppendSelect(pStr, vtab, pIdxInfo, pPlan);
+    sqlite3_str_appendall(pStr, zExact ? zExact : "");
+    sqlexecAppendOrder(pStr, pIdxInfo, pPlan);
+  }
+  sqlite3_str_appendchar(pStr, 1, 0);
+  sqlite3_str_appendall(pStr, zClass ? zClass : "");
+  sqlite3_str_appendchar(pStr, 1, 0);
+  sqlite3_str_appendall(pStr, pPlan->bCount ? "count" : "");
+
+  char *zSql = sqlite3_str_finish(pStr);
+  if (zSql == NULL)
+    return SQLITE_NOMEM;
+  pIdxInfo->idxStr = zSql;
+  pIdxInfo->needToFreeIdxStr = 1;
+  return SQLITE_OK;
+}
+
+/*
+** Sqlite calls this to find the best index to use. The only constraints we
+** can make use of are equality constraints on the hidden parameter columns,
+** which we bind to the parameters of the SQL. Bit N of idxNum is set if the
+** parameter N+1 is constrained, and the values are passed to xFilter in
+** order of parameter number. Without a value the parameter is NULL, which
+** is rarely what anyone wants, so we make plans which leave parameters
+** unbound look very expensive.
+**
+** The number of rows we expect comes from the scans we have seen so far
+** (see sqlexecObserveRows), or the rows option until we have seen one. The
+** unique option tells us a scan with all parameters bound gives at most
+** one row.
+**
+** If idxStr is set, it is a rewritten version of the SQL for xFilter to
+** run instead, which sorts the rows (see sqlexecPlanOrder), filters them
+** (see sqlexecPlanWhere), stops after the LIMIT (see sqlexecPlanLimit),
+** leaves out columns which aren't needed (see sqlexecPlanProject) or just
+** counts the rows (see sqlexecPlanCount).
+** Values for the rewrite are passed to xFilter after those of the
+** parameters.
+*/
+static int sqlexecBestIndex(
+  sqlite3_vtab *tab,
+  sqlite3_index_info *pIdxInfo
+){
+  sqlexec_vtab *vtab = (sqlexec_vtab*)tab;
+  int aConstraint[SQLEXEC_MAX_PARAM];
+  int idxNum = 0;
+  int nArg = 0;
+
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *p = &pIdxInfo->aConstraint[i];
+    int iParam = p->iColumn - vtab->nCol;
+    if (iParam < 0 || !p->usable || p->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    if (idxNum & (1 << iParam))
+      continue;
+    idxNum |= 1 << iParam;
+    aConstraint[iParam] = i;
+  }
+  for (int iParam = 0; iParam < vtab->nParam; iParam++) {
+    if (idxNum & (1 << iParam)) {
+      struct sqlite3_index_constraint_usage *pUsage =
+        &pIdxInfo->aConstraintUsage[aConstraint[iParam]];
+      pUsage->argvIndex = ++nArg;
+      pUsage->omit = 1;
+    }
+  }
+
+  double nRow = vtab->aRowEstimate[nArg > 0];
+  if (nRow < 0)
+    nRow = nArg > 0 ? 10 : 2147483647;
+  if (vtab->nParam > 0 && nArg == vtab->nParam && vtab->opts.bUnique) {
+    nRow = 1;
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+  }
+  sqlexec_plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.bUnbound = vtab->nParam > 0 && nArg < vtab->nParam;
+  pIdxInfo->estimatedRows = (sqlite3_int64)nRow;
+  if (plan.bUnbound)
+    pIdxInfo->estimatedCost = (double)2147483647;
+  else
+    pIdxInfo->estimatedCost = nRow + 1; /* even an empty scan costs */
+  pIdxInfo->idxNum = idxNum;
+
+  plan.pWhere = sqlite3_str_new(vtab->db);
+  plan.pExact = sqlite3_str_new(vtab->db);
+  plan.pClass = sqlite3_str_new(vtab->db);
+  if (pIdxInfo->nOrderBy > 0)
+    sqlexecPlanOrder(vtab, pIdxInfo, &plan);
+  sqlexecPlanWhere(vtab, pIdxInfo, &plan, nArg);
+  sqlexecPlanLimit(vtab, pIdxInfo, &plan, nArg);
+  sqlexecPlanProject(vtab, pIdxInfo, &plan);
+  sqlexecPlanCount(vtab, pIdxInfo, &plan);
+  int rc = sqlite3_str_errcode(plan.pWhere);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_str_errcode(plan.pExact);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_str_errcode(plan.pClass);
+  if (rc == SQLITE_OK && plan.bRewrite)
+    rc = sqlexecPlanRewrite(vtab, pIdxInfo, &plan);
+  sqlite3_free(sqlite3_str_finish(plan.pWhere));
+  sqlite3_free(sqlite3_str_finish(plan.pExact));
+  sqlite3_free(sqlite3_str_finish(plan.pClass));
+  return rc;
+}
+
+/*
+** Give the cursor a statement from pPool, ready to step from the first
+** row. If the cursor already has one from a previous scan of the same SQL
+** we just reset it, so a rescan costs no more than the steps.
+*/
+static int sqlexecCursorStmt(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  sqlexec_pool *pPool
+){
+  if (pCur->pStmt != NULL && pCur->pPool != pPool) {
+    sqlexecStmtCheckin(pCur->pPool, pCur->pStmt);
+    pCur->pStmt = NULL;
+  }
+  if (pCur->pStmt == NULL) {
+    int rc = sqlexecStmtCheckout(vtab, pPool, &pCur->pStmt);
+    if (rc != SQLITE_OK)
+      return rc;
+    pCur->pPool = pPool;
+  } else {
+    sqlite3_reset(pCur->pStmt);
+    sqlexecStatAdd(vtab, nPoolHit, 1);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Get the cursor a statement for zSql (vtab->sql or a rewrite of it) with
+** the constrained parameter values bound, ready to step from the first
+** row. Statements come from the pool for zSql (see sqlexecCursorStmt). A
+** PRAGMA with parameters is prepared here instead, once we know what to
+** substitute. The count of steps the statement has taken starts again
+** from 0, for the max_steps option.
+*/
+static int sqlexecStartStmt(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zSql
+){
+  int rc;
+  if (vtab->nSubst > 0) {
+    if (pCur->pStmt != NULL) {
+      sqlexecStmtCheckin(pCur->pPool, pCur->pStmt);
+      pCur->pStmt = NULL;
+    }
+    char *sql = sqlexecExpandPragma(vtab->sql, vtab->aSubst, vtab->nSubst,
+                                    pCur->apArg);
+    if (sql == NULL)
+      return SQLITE_NOMEM;
+    pCur->pPool = NULL;
+    rc = sqlexecPrepare(vtab, sql, 0, &pCur->pStmt);
+    sqlite3_free(sql);
+    return rc;
+  }
+
+  sqlexec_pool *pPool = &vtab->pool;
+  if (zSql != vtab->sql) {
+    rc = sqlexecVariantPool(vtab, zSql, &pPool);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  rc = sqlexecCursorStmt(vtab, pCur, pPool);
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_stmt_status(pCur->pStmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+  return sqlexecBindArgs(pCur->pStmt, pCur->nArg, pCur->apArg);
+}
+
+/*
+** Read the schema cookie of the main database into *piCookie.
+*/
+static int sqlexecSchemaCookie(sqlexec_vtab *vtab, int *piCookie){
+  int rc;
+  if (vtab->pCookieStmt == NULL) {
+    rc = sqlexecPrepare(vtab, "pragma schema_version",
+                        SQLITE_PREPARE_PERSISTENT, &vtab->pCookieStmt);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  rc = sqlite3_step(vtab->pCookieStmt);
+  if (rc == SQLITE_ROW) {
+    *piCookie = sqlite3_column_int(vtab->pCookieStmt, 0);
+    rc = SQLITE_OK;
+  }
+  sqlite3_reset(vtab->pCookieStmt);
+  return rc;
+}
+
+/*
+** Decide whether we are still in the statement or transaction recorded in
+** pStamp by sqlexecStampSet, with nothing changed since. Any change made by
+** this connection (as counted by sqlite3_total_changes) means we aren't,
+** unless bKeep is set. Otherwise, in autocommit mode each statement is a
+** transaction of its own. We can't see statements start and end, but
+** SQLite keeps our cursors open until the statement using them is done, so
+** we take all our cursors being closed (a change of iGeneration) as the end
+** of a statement. Inside an explicit transaction we take it we are in the
+** same one unless the schema cookie changes or another connection commits
+** a change (which changes the data version, if we weren't holding a read
+** transaction open across statements). Our own changes don't change the
+** data version until they are committed, so with bKeep set, the stamp lasts
+** until the transaction commits.
+**
+** This decides whether cached results can still be used (with bKeep set by
+** the transaction option), and whether the setup statements need to run
+** again.
+*/
+static int sqlexecStampValid(
+  sqlexec_vtab *vtab,
+  sqlexec_stamp *pStamp,
+  int bKeep
+){
+  sqlite3 *db = vtab->db;
+  if (!bKeep && sqlite3_total_changes(db) != pStamp->nChanges)
+    return 0;
+  if (pStamp->iGeneration == vtab->iGeneration)
+    return 1;
+  if (pStamp->bAutocommit || sqlite3_get_autocommit(db))
+    return 0;
+  unsigned int iDataVersion = 0;
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_DATA_VERSION, &iDataVersion);
+  if (iDataVersion != pStamp->iDataVersion)
+    return 0;
+  int iCookie;
+  if (sqlexecSchemaCookie(vtab, &iCookie) != SQLITE_OK
+      || iCookie != pStamp->iCookie)
+    return 0;
+
+  /* Still good: the stamp now belongs to this statement as well */
+  pStamp->iGeneration = vtab->iGeneration;
+  return 1;
+}
+
+/*
+** Record the state of the connection in pStamp, for sqlexecStampValid to
+** compare against later.
+*/
+static int sqlexecStampSet(sqlexec_vtab *vtab, sqlexec_stamp *pStamp){
+  sqlite3 *db = vtab->db;
+  pStamp->iGeneration = vtab->iGeneration;
+  pStamp->bAutocommit = sqlite3_get_autocommit(db);
+  pStamp->nChanges = sqlite3_total_changes(db);
+  pStamp->iDataVersion = 0;
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_DATA_VERSION,
+                       &pStamp->iDataVersion);
+  return sqlexecSchemaCookie(vtab, &pStamp->iCookie);
+}
+
+/*
+** Write a record of the databases of the connection to aSig, which has
+** room for SQLEXEC_CATALOG_SIG bytes, and return its length, or -1 if it
+** doesn't fit or we can't make one. The record has the name and the data
+** version of each database, so that it changes when one is attached or a
+** change to one is committed, by this connection or another. A database
+** only sees another connection's change when it starts a read transaction,
+** which the statement scanning us may not have done, so first we step
+** pSentinel, a query reading the schema table of every database. It also
+** counts the times it has been prepared again, which goes up when a
+** database is detached (that expires every statement of the connection),
+** and we put that count in the record too.
+*/
+static int sqlexecCatalogSig(sqlexec_vtab *vtab, char *aSig){
+#if SQLITE_VERSION_NUMBER >= 3039000
+  sqlite3 *db = vtab->db;
+  if (sqlite3_libversion_number() < 3039000)
+    return -1; /* No sqlite3_db_name() */
+  int nSig = (int)sizeof(int);
+  const char *zName;
+  for (int i = 0; (zName = sqlite3_db_name(db, i)) != NULL; i++) {
+    int nName = (int)strlen(zName) + 1;
+    if (nSig + nName + (int)sizeof(unsigned int) > SQLEXEC_CATALOG_SIG)
+      return -1;
+    memcpy(&aSig[nSig], zName, nName);
+    nSig += nName;
+  }
+  int nNames = nSig - (int)sizeof(int);
+  const char *zNames = &aSig[sizeof(int)];
+
+  if (vtab->pSentinel == NULL || vtab->nSentinelDbs != nNames
+      || memcmp(vtab->zSentinelDbs, zNames, nNames) != 0) {
+    /* The databases have changed since pSentinel was made, or it wasn't */
+    sqlite3_finalize(vtab->pSentinel);
+    vtab->pSentinel = NULL;
+    sqlite3_free(vtab->zSentinelDbs);
+    vtab->zSentinelDbs = sqlite3_malloc(nNames);
+    if (vtab->zSentinelDbs == NULL)
+      return -1;
+    memcpy(vtab->zSentinelDbs, zNames, nNames);
+    vtab->nSentinelDbs = nNames;
+    sqlite3_str *pStr = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(pStr, "SELECT 1");
+    for (const char *z = zNames; z < zNames + nNames; z += strlen(z) + 1)
+      sqlite3_str_appendf(pStr, "%s\"%w\".sqlite_schema", z == zNames
+                          ? " FROM " : ", ", z);
+    sqlite3_str_appendall(pStr, " LIMIT 0");
+    char *zSql = sqlite3_str_finish(pStr);
+    if (zSql == NULL)
+      return -1;
+    int rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                                &vtab->pSentinel, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK)
+      return -1;
+  }
+  int rc = sqlite3_step(vtab->pSentinel);
+  sqlite3_reset(vtab->pSentinel);
+  if (rc != SQLITE_DONE)
+    return -1;
+  int nReprepare = sqlite3_stmt_status(vtab->pSentinel,
+                                       SQLITE_STMTSTATUS_REPREPARE, 0);
+  memcpy(aSig, &nReprepare, sizeof(nReprepare));
+
+  for (const char *z = zNames; z < zNames + nNames; z += strlen(z) + 1) {
+    unsigned int iDataVersion = 0;
+    if (nSig + (int)sizeof(iDataVersion) > SQLEXEC_CATALOG_SIG)
+      return -1;
+    sqlite3_file_control(db, z, SQLITE_FCNTL_DATA_VERSION, &iDataVersion);
+    memcpy(&aSig[nSig], &iDataVersion, sizeof(iDataVersion));
+    nSig += (int)sizeof(iDataVersion);
+  }
+  return nSig;
+#else
+  return -1;
+#endif
+}
+
+/*
+** Returns true if the cached results of a catalog PRAGMA are good in a
+** statement after the one they were cached in. That needs autocommit mode,
+** so that no change to the schema can be waiting to commit, and for the
+** record of the databases to be the same as when caching started.
+*/
+static int sqlexecCatalogValid(sqlexec_vtab *vtab){
+  char aSig[SQLEXEC_CATALOG_SIG];
+  if (!vtab->bCatalog || vtab->nCatalogSig < 0
+      || !sqlite3_get_autocommit(vtab->db))
+    return 0;
+  if (sqlexecCatalogSig(vtab, aSig) != vtab->nCatalogSig
+      || memcmp(aSig, vtab->aCatalogSig, vtab->nCatalogSig) != 0)
+    return 0;
+
+  /* Still good: cacheStamp now belongs to this statement as well */
+  vtab->cacheStamp.iGeneration = vtab->iGeneration;
+  vtab->cacheStamp.nChanges = sqlite3_total_changes(vtab->db);
+  return 1;
+}
+
+/*
+** Record the state of the connection as a virtual table starts caching
+** results, and for a catalog PRAGMA the databases too if we are in
+** autocommit mode (see sqlexecCatalogValid).
+*/
+static int sqlexecCacheStart(sqlexec_vtab *vtab){
+  vtab->nCatalogSig = -1;
+  if (vtab->bCatalog && sqlite3_get_autocommit(vtab->db))
+    vtab->nCatalogSig = sqlexecCatalogSig(vtab, vtab->aCatalogSig);
+  return sqlexecStampSet(vtab, &vtab->cacheStamp);
+}
+
+/*
+** Throw away all cached results of a virtual table.
+*/
+static void sqlexecCacheFlush(sqlexec_vtab *vtab){
+  sqlexecRowsetUnref(vtab->pMat);
+  vtab->pMat = NULL;
+  sqlexecCacheClear(&vtab->cache);
+}
+
+/*
+** Run the statement of a cursor (which sqlexecStartStmt has just set up) to
+** the end, copying all its rows into a new rowset.
+*/
+static int sqlexecRunToRowset(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  sqlexec_rowset **ppRows
+){
+  int rc;
+  sqlexec_rowset *pRows = sqlexecRowsetNew(vtab->nCol);
+  *ppRows = NULL;
+  if (pRows == NULL)
+    return SQLITE_NOMEM;
+  for (;;) {
+    sqlite3_int64 iStart = sqlexecStatStart(vtab);
+    rc = sqlite3_step(pCur->pStmt);
+    sqlexecStatStep(vtab, iStart);
+    if (rc != SQLITE_ROW)
+      break;
+    if (pCur->bLimit
+        && sqlexecLimitOver(vtab, pCur->pStmt, pCur->iDeadline)) {
+      rc = SQLITE_INTERRUPT;
+      break;
+    }
+    rc = sqlexecRowsetAppend(pRows, pCur->pStmt);
+    if (rc != SQLITE_OK)
+      break;
+  }
+  sqlite3_reset(pCur->pStmt);
+  if (rc != SQLITE_DONE) {
+    sqlexecRowsetUnref(pRows);
+    return rc;
+  }
+  *ppRows = pRows;
+  return SQLITE_OK;
+}
+
+#ifndef SQLEXEC_OMIT_SNAPSHOT
+/*
+** First bytes of a snapshot file.
+*/
+#define SQLEXEC_SNAPSHOT_MAGIC "sqlxsnp2"
+
+/*
+** Header of a snapshot file, written by sqlexecSnapshotSave. It is
+** followed by the name of the database file and the SQL the rows are for,
+** nFile and nSql bytes, and then, starting at a multiple of 8 bytes, the
+** arrays of a rowset of nCol columns and nRow rows (see sqlexec_rowset):
+** aCell, anByte and aType, each of nCol*nRow entries with nRowAlloc equal to
+** nRow. After those, again at a multiple of 8, come the nHeap bytes of
+** the heap, which holds the TEXT and BLOB values one after another with no
+** pointers between them. Everything is in the byte order of the machine
+** which wrote it, so a file written elsewhere fails the check of iOrder
+** and is replaced.
+*/
+typedef struct sqlexec_snaphdr sqlexec_snaphdr;
+struct sqlexec_snaphdr {
+  char aMagic[8];               /* SQLEXEC_SNAPSHOT_MAGIC */
+  sqlite3_int64 iOrder;         /* 1 */
+  sqlexec_snapkey key;          /* State of the database files */
+  sqlite3_int64 nFile;          /* Bytes of database file name */
+  sqlite3_int64 nSql;           /* Bytes of SQL */
+  sqlite3_int64 nCol;           /* Columns of the rowset */
+  sqlite3_int64 nRow;           /* Rows of the rowset */
+  sqlite3_int64 nHeap;          /* Bytes of heap */
+};
+
+/*
+** Work out the offsets of the arrays (*piCell) and the heap (*piHeap) of a
+** snapshot file with header pHdr, and return the size the file must be,
+** or -1 if the header can't be right.
+*/
+static sqlite3_int64 sqlexecSnapshotLayout(
+  const sqlexec_snaphdr *pHdr,
+  sqlite3_int64 *piCell,
+  sqlite3_int64 *piHeap
+){
+  if (pHdr->nFile < 0 || pHdr->nFile > INT_MAX
+      || pHdr->nSql < 0 || pHdr->nSql > INT_MAX
+      || pHdr->nCol < 1 || pHdr->nCol > 32767
+      || pHdr->nRow < 0 || pHdr->nRow > INT_MAX
+      || pHdr->nHeap < 0 || pHdr->nHeap > ((sqlite3_int64)1 << 48))
+    return -1;
+  sqlite3_int64 nCell = pHdr->nCol * pHdr->nRow;
+  *piCell = (sizeof(*pHdr) + pHdr->nFile + pHdr->nSql + 7) & ~7;
+  *piHeap = (*piCell + nCell * (sizeof(sqlexec_cell) + sizeof(int) + 1)
+             + 7) & ~7;
+  return *piHeap + pHdr->nHeap;
+}
+
+/*
+** Returns the modification time of a file in nanoseconds.
+*/
+static sqlite3_int64 sqlexecFileTime(const struct stat *pStat){
+#ifdef __APPLE__
+  return (sqlite3_int64)pStat->st_mtimespec.tv_sec * 1000000000
+       + pStat->st_mtimespec.tv_nsec;
+#else
+  return (sqlite3_int64)pStat->st_mtim.tv_sec * 1000000000
+       + pStat->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+** Fill in *pKey, apart from iCookie, from the files of the main database
+** zFile as they are now. A commit changes the database file or, in WAL
+** mode, the WAL file. The change counter is read through the connection's
+** own file handle: opening the file again and closing it would drop the
+** locks SQLite holds on it.
+**
+** In WAL mode neither the database file nor its change counter moves on
+** a commit, and once the WAL has been reset its frames are written over
+** in place, leaving its size as it was. So we take the salts of the WAL,
+** which change when it is reset, and its last commit frame and the
+** checksum of that frame, from the header of the wal-index (the -shm
+** file, which a commit always updates). The header is written twice,
+** and like SQLite we only take it if both copies are the same; if they
+** never are, we return SQLITE_BUSY and the scan goes without a snapshot.
+*/
+static int sqlexecSnapshotKey(
+  sqlexec_vtab *vtab,
+  const char *zFile,
+  sqlexec_snapkey *pKey
+){
+  struct stat st;
+  memset(pKey, 0, sizeof(*pKey));
+  if (stat(zFile, &st) != 0)
+    return SQLITE_CANTOPEN;
+  pKey->nSize = st.st_size;
+  pKey->iTime = sqlexecFileTime(&st);
+  char *zShm = sqlite3_mprintf("%s-shm", zFile);
+  if (zShm == NULL)
+    return SQLITE_NOMEM;
+  int fd = open(zShm, O_RDONLY);
+  sqlite3_free(zShm);
+  if (fd >= 0) {
+    unsigned int aHdr[24]; /* Both copies of the wal-index header */
+    int bSame = 0;
+    for (int i = 0; i < 3 && !bSame; i++)
+      bSame = pread(fd, aHdr, sizeof(aHdr), 0) == (ssize_t)sizeof(aHdr)
+           && memcmp(aHdr, &aHdr[12], sizeof(aHdr) / 2) == 0;
+    close(fd);
+    if (!bSame || ((unsigned char*)aHdr)[12] == 0) /* isInit */
+      return SQLITE_BUSY;
+    pKey->iWalFrame = aHdr[4];
+    pKey->iWalCksum = ((sqlite3_int64)aHdr[6] << 32) | aHdr[7];
+    pKey->iWalSalt = ((sqlite3_int64)aHdr[8] << 32) | aHdr[9];
+  }
+  sqlite3_file *pFile = NULL;
+  unsigned char aChange[4];
+  if (sqlite3_file_control(vtab->db, "main", SQLITE_FCNTL_FILE_POINTER,
+                           &pFile) == SQLITE_OK
+      && pFile != NULL && pFile->pMethods != NULL
+      && pFile->pMethods->xRead(pFile, aChange, 4, 24) == SQLITE_OK) {
+    pKey->iChange = ((sqlite3_int64)aChange[0] << 24) | (aChange[1] << 16)
+                  | (aChange[2] << 8) | aChange[3];
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Map the snapshot file zPath into a new rowset in *ppRows, if it holds the
+** result set of vtab->sql on the database file zFile in the state pKey.
+** Leaves *ppRows NULL if it doesn't, or there is no such file.
+*/
+static int sqlexecSnapshotLoad(
+  sqlexec_vtab *vtab,
+  const char *zPath,
+  const char *zFile,
+  const sqlexec_snapkey *pKey,
+  sqlexec_rowset **ppRows
+){
+  *ppRows = NULL;
+  int fd = open(zPath, O_RDONLY);
+  if (fd < 0)
+    return SQLITE_OK;
+  struct stat st;
+  char *aMap = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(sqlexec_snaphdr))
+    aMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (aMap == MAP_FAILED)
+    return SQLITE_OK;
+
+  const sqlexec_snaphdr *pHdr = (const sqlexec_snaphdr*)aMap;
+  sqlite3_int64 nFile = (sqlite3_int64)strlen(zFile);
+  sqlite3_int64 nSql = (sqlite3_int64)strlen(vtab->sql);
+  sqlite3_int64 iCell, iHeap;
+  if (memcmp(pHdr->aMagic, SQLEXEC_SNAPSHOT_MAGIC, 8) != 0
+      || pHdr->iOrder != 1
+      || memcmp(&pHdr->key, pKey, sizeof(*pKey)) != 0
+      || pHdr->nCol != vtab->nCol
+      || sqlexecSnapshotLayout(pHdr, &iCell, &iHeap) != st.st_size
+      || pHdr->nFile != nFile || pHdr->nSql != nSql
+      || memcmp(&aMap[sizeof(*pHdr)], zFile, nFile) != 0
+      || memcmp(&aMap[sizeof(*pHdr) + nFile], vtab->sql, nSql) != 0) {
+    munmap(aMap, (size_t)st.st_size);
+    return SQLITE_OK;
+  }
+
+  sqlexec_rowset *pRows = sqlexecRowsetNew(vtab->nCol);
+  if (pRows == NULL) {
+    munmap(aMap, (size_t)st.st_size);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 nCell = pHdr->nCol * pHdr->nRow;
+  pRows->nRow = pRows->nRowAlloc = (int)pHdr->nRow;
+  pRows->aCell = (sqlexec_cell*)&aMap[iCell];
+  pRows->anByte = (int*)&aMap[iCell + nCell * sizeof(sqlexec_cell)];
+  pRows->aType = (unsigned char*)&aMap[iCell + nCell * (sizeof(sqlexec_cell)
+                                                        + sizeof(int))];
+  pRows->aHeap = &aMap[iHeap];
+  pRows->nHeap = pHdr->nHeap;
+  pRows->pMap = aMap;
+  pRows->nMap = st.st_size;
+  *ppRows = pRows;
+  return SQLITE_OK;
+}
+
+/*
+** Write zero bytes to pOut up to offset iTo, from *piPos.
+*/
+static void sqlexecSnapshotPad(FILE *pOut, sqlite3_int64 *piPos,
+                               sqlite3_int64 iTo){
+  static const char aZero[8] = {0};
+  if (iTo > *piPos)
+    fwrite(aZero, 1, (size_t)(iTo - *piPos), pOut);
+  *piPos = iTo;
+}
+
+/*
+** Write the result set pRows of vtab->sql, taken from the database file
+** zFile in the state pKey, to the snapshot file zPath. It goes to a
+** temporary file first, which is renamed into place, so that another
+** process sees either the old file or the new one, never part of one, and
+** those which have the old one mapped keep it. If the file can't be
+** written, we go on without it.
+*/
+static void sqlexecSnapshotSave(
+  sqlexec_vtab *vtab,
+  const char *zPath,
+  const char *zFile,
+  const sqlexec_snapkey *pKey,
+  const sqlexec_rowset *pRows
+){
+  sqlexec_snaphdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.aMagic, SQLEXEC_SNAPSHOT_MAGIC, 8);
+  hdr.iOrder = 1;
+  hdr.key = *pKey;
+  hdr.nFile = (sqlite3_int64)strlen(zFile);
+  hdr.nSql = (sqlite3_int64)strlen(vtab->sql);
+  hdr.nCol = pRows->nCol;
+  hdr.nRow = pRows->nRow;
+  for (int iCol = 0; iCol < pRows->nCol; iCol++) {
+    for (int iRow = 0; iRow < pRows->nRow; iRow++) {
+      int iCell = iCol * pRows->nRowAlloc + iRow;
+      if (pRows->aType[iCell] == SQLITE_TEXT
+          || pRows->aType[iCell] == SQLITE_BLOB)
+        hdr.nHeap += pRows->anByte[iCell];
+    }
+  }
+  sqlite3_int64 iCell, iHeap;
+  if (sqlexecSnapshotLayout(&hdr, &iCell, &iHeap) < 0)
+    return;
+
+  char *zTmp = sqlite3_mprintf("%s-XXXXXX", zPath);
+  if (zTmp == NULL)
+    return;
+  int fd = mkstemp(zTmp);
+  FILE *pOut = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (pOut == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(zTmp);
+    }
+    sqlite3_free(zTmp);
+    return;
+  }
+  fchmod(fd, 0644);
+
+  sqlite3_int64 iPos = sizeof(hdr) + hdr.nFile + hdr.nSql;
+  fwrite(&hdr, sizeof(hdr), 1, pOut);
+  fwrite(zFile, 1, (size_t)hdr.nFile, pOut);
+  fwrite(vtab->sql, 1, (size_t)hdr.nSql, pOut);
+  sqlexecSnapshotPad(pOut, &iPos, iCell);
+  /* The heap is packed, so TEXT and BLOB cells get new offsets */
+  sqlite3_int64 iOffset = 0;
+  for (int iCol = 0; iCol < pRows->nCol; iCol++) {
+    for (int iRow = 0; iRow < pRows->nRow; iRow++) {
+      int i = iCol * pRows->nRowAlloc + iRow;
+      sqlexec_cell cell = pRows->aCell[i];
+      if (pRows->aType[i] == SQLITE_TEXT || pRows->aType[i] == SQLITE_BLOB) {
+        cell.i = iOffset;
+        iOffset += pRows->anByte[i];
+      }
+      fwrite(&cell, sizeof(cell), 1, pOut);
+    }
+  }
+  for (int iCol = 0; iCol < pRows->nCol; iCol++)
+    fwrite(&pRows->anByte[iCol * pRows->nRowAlloc], sizeof(int),
+           pRows->nRow, pOut);
+  for (int iCol = 0; iCol < pRows->nCol; iCol++)
+    fwrite(&pRows->aType[iCol * pRows->nRowAlloc], 1, pRows->nRow, pOut);
+  iPos = iCell + (sqlite3_int64)pRows->nCol * pRows->nRow
+                 * (sizeof(sqlexec_cell) + sizeof(int) + 1);
+  sqlexecSnapshotPad(pOut, &iPos, iHeap);
+  for (int iCol = 0; iCol < pRows->nCol; iCol++) {
+    for (int iRow = 0; iRow < pRows->nRow; iRow++) {
+      int i = iCol * pRows->nRowAlloc + iRow;
+      if (pRows->aType[i] == SQLITE_TEXT || pRows->aType[i] == SQLITE_BLOB)
+        fwrite(&pRows->aHeap[pRows->aCell[i].i], 1, pRows->anByte[i], pOut);
+    }
+  }
+
+  int bFailed = ferror(pOut);
+  if (fclose(pOut) != 0 || bFailed || rename(zTmp, zPath) != 0)
+    unlink(zTmp);
+  sqlite3_free(zTmp);
+}
+
+/*
+** Run vtab->sql on a new read-only connection to the database files, in a
+** read transaction of its own, copying the rows into a new rowset in
+** *ppRows. The state of the files is taken into *pKey just before the
+** transaction starts and again once it ends, and *pbSave is set if the
+** two match, so that we know the rows are those of that state. Our own
+** connection's read transaction may have started before the state was
+** taken, which is why we don't use it.
+**
+** Leaves *ppRows NULL if the SQL can't run that way (the database is in
+** use by a writer, or the SQL reads a temp table, say), for the caller to
+** run it on our connection instead and not keep a snapshot.
+*/
+static int sqlexecSnapshotBuild(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zFile,
+  sqlexec_snapkey *pKey,
+  sqlexec_rowset **ppRows,
+  int *pbSave
+){
+  *ppRows = NULL;
+  *pbSave = 0;
+  char *zSig;
+  int rc = sqlexecPrefetchSig(vtab, &zSig);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3 *db = NULL;
+  sqlite3_stmt *pStmt = NULL;
+  sqlexec_rowset *pRows = NULL;
+  int rcBuild = sqlite3_open_v2(zFile, &db, SQLITE_OPEN_READONLY, NULL);
+  if (rcBuild == SQLITE_OK)
+    rcBuild = sqlite3_exec(db, zSig, NULL, NULL, NULL);
+  sqlite3_free(zSig);
+  for (int i = 0; i < vtab->nSetup && rcBuild == SQLITE_OK; i++) {
+    if (!sqlexecIsAttach(vtab->azSetup[i]))
+      rcBuild = sqlite3_exec(db, vtab->azSetup[i], NULL, NULL, NULL);
+  }
+  if (rcBuild == SQLITE_OK)
+    rcBuild = sqlexecSnapshotKey(vtab, zFile, pKey);
+  if (rcBuild == SQLITE_OK)
+    rcBuild = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  if (rcBuild == SQLITE_OK)
+    rcBuild = sqlite3_prepare_v2(db, "pragma schema_version", -1, &pStmt,
+                                 NULL);
+  if (rcBuild == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+    pKey->iCookie = sqlite3_column_int(pStmt, 0);
+  if (rcBuild == SQLITE_OK)
+    rcBuild = sqlite3_finalize(pStmt);
+  pStmt = NULL;
+  if (rcBuild == SQLITE_OK) {
+    sqlexecStatAdd(vtab, nPrepare, 1);
+    rcBuild = sqlite3_prepare_v2(db, vtab->sql, -1, &pStmt, NULL);
+  }
+  if (rcBuild == SQLITE_OK && (pRows = sqlexecRowsetNew(vtab->nCol)) == NULL)
+    rc = SQLITE_NOMEM;
+  while (rcBuild == SQLITE_OK && rc == SQLITE_OK) {
+    sqlite3_int64 iStart = sqlexecStatStart(vtab);
+    rcBuild = sqlite3_step(pStmt);
+    sqlexecStatStep(vtab, iStart);
+    if (rcBuild != SQLITE_ROW)
+      break;
+    rcBuild = SQLITE_OK;
+    if (pCur->bLimit && sqlexecLimitOver(vtab, pStmt, pCur->iDeadline))
+      rc = SQLITE_INTERRUPT;
+    else
+      rc = sqlexecRowsetAppend(pRows, pStmt);
+  }
+  if (rcBuild == SQLITE_DONE)
+    rcBuild = SQLITE_OK;
+  sqlite3_finalize(pStmt);
+
+  if (rc == SQLITE_OK && rcBuild == SQLITE_OK) {
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlexec_snapkey after;
+    if (sqlexecSnapshotKey(vtab, zFile, &after) == SQLITE_OK) {
+      after.iCookie = pKey->iCookie;
+      *pbSave = memcmp(&after, pKey, sizeof(after)) == 0;
+    }
+    *ppRows = pRows;
+    pRows = NULL;
+  }
+  sqlexecRowsetUnref(pRows);
+  sqlite3_close(db);
+  return rc;
+}
+
+/*
+** Get the materialized result set of a table with the snapshot option into
+** *ppRows, from a snapshot saved by this process or any other for the state
+** the database files are in now, or by running the SQL and saving a new
+** snapshot (see sqlexecSnapshotBuild). The file is named after a hash of
+** the database file name and the SQL, and both are checked when it is
+** loaded. Leaves *ppRows NULL for the caller to run the SQL on our own
+** connection, with no snapshot, if it can't be built or if we are in a
+** write transaction, whose changes other connections don't see.
+**
+** A snapshot can be newer than the read transaction of our connection, if
+** another connection has committed since it started, as with prefetch
+** workers.
+*/
+static int sqlexecSnapshotRows(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  sqlexec_rowset **ppRows
+){
+  *ppRows = NULL;
+  const char *zFile = sqlite3_db_filename(vtab->db, "main");
+  if (zFile == NULL || zFile[0] == 0
+      || sqlite3_txn_state(vtab->db, NULL) == SQLITE_TXN_WRITE)
+    return SQLITE_OK;
+  sqlexec_snapkey key;
+  if (sqlexecSnapshotKey(vtab, zFile, &key) != SQLITE_OK)
+    return SQLITE_OK;
+  int iCookie;
+  int rc = sqlexecSchemaCookie(vtab, &iCookie);
+  if (rc != SQLITE_OK)
+    return rc;
+  key.iCookie = iCookie;
+  if (vtab->pSnap != NULL
+      && memcmp(&key, &vtab->snapKey, sizeof(key)) == 0) {
+    *ppRows = vtab->pSnap;
+    vtab->pSnap->nRef++;
+    return SQLITE_OK;
+  }
+
+  unsigned int h = sqlexecHashBytes(2166136261u, zFile, (int)strlen(zFile) + 1);
+  h = sqlexecHashBytes(h, vtab->sql, (int)strlen(vtab->sql));
+  char *zPath = sqlite3_mprintf("%s/sqlexec-%08x.snapshot", vtab->zSnapshot,
+                                h);
+  if (zPath == NULL)
     return SQLITE_NOMEM;
+  sqlexec_rowset *pRows;
+  int bKeep = 1;
+  rc = sqlexecSnapshotLoad(vtab, zPath, zFile, &key, &pRows);
+  if (rc == SQLITE_OK && pRows == NULL) {
+    rc = sqlexecSnapshotBuild(vtab, pCur, zFile, &key, &pRows, &bKeep);
+    if (rc == SQLITE_OK && pRows != NULL && bKeep)
+      sqlexecSnapshotSave(vtab, zPath, zFile, &key, pRows);
+  }
+  sqlite3_free(zPath);
+  if (rc != SQLITE_OK || pRows == NULL)
+    return rc;
+  if (bKeep) {
+    sqlexecRowsetUnref(vtab->pSnap);
+    vtab->pSnap = pRows;
+    vtab->snapKey = key;
+    pRows->nRef++;
   }
+  *ppRows = pRows;
+  return SQLITE_OK;
+}
+#else
+# define sqlexecSnapshotRows(vtab, pCur, ppRows) (*(ppRows) = NULL, SQLITE_OK)
+#endif /* SQLEXEC_OMIT_SNAPSHOT */
 
-  for (int i = 0; i < colCount; i++) {
-    const char *colName = sqlite3_column_name(pStmt, i);
-    if (colName == NULL) {
-      sqlite3_free(sql);       /* avoid memory leak of SQL text */
-      sqlite3_free(decl);
-      sqlite3_finalize(pStmt); /* avoid memory leak of prepared stmt */
-      return SQLITE_NOMEM;
+/*
+** Get the rows for a scan from the materialized result set or the result
+** cache, running the statement to fill them in if they aren't there. The
+** cursor gets its own reference to the rows in pCur->pRows. zSql is the
+** SQL to run and nArg is the number of parameters xFilter bound.
+*/
+static int sqlexecCachedRows(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zSql,
+  int nArg
+){
+  sqlexec_rowset *pRows = NULL;
+  int rc;
+
+  int bEmpty = vtab->pMat == NULL && vtab->cache.nEntry == 0;
+  if (!bEmpty && !sqlexecStampValid(vtab, &vtab->cacheStamp,
+                                     vtab->opts.bTransaction)
+      && !sqlexecCatalogValid(vtab)) {
+    sqlexecCacheFlush(vtab);
+    bEmpty = 1;
+  }
+
+  if (vtab->opts.bMaterialize && nArg == 0 && zSql == vtab->sql) {
+    if (vtab->pMat == NULL) {
+      rc = SQLITE_OK;
+      if (vtab->zSnapshot != NULL)
+        rc = sqlexecSnapshotRows(vtab, pCur, &vtab->pMat);
+      if (rc == SQLITE_OK && vtab->pMat == NULL)
+        rc = sqlexecStartStmt(vtab, pCur, zSql);
+      if (rc == SQLITE_OK && vtab->pMat == NULL)
+        rc = sqlexecRunToRowset(vtab, pCur, &vtab->pMat);
+      if (rc == SQLITE_OK && bEmpty)
+        rc = sqlexecCacheStart(vtab);
+      if (rc != SQLITE_OK)
+        return rc;
+    }
+    pCur->pRows = vtab->pMat;
+    pCur->pRows->nRef++;
+    return SQLITE_OK;
+  }
+
+  unsigned int iHash = sqlexecHashKey(zSql, pCur->nArg, pCur->apArg);
+  pRows = sqlexecCacheLookup(&vtab->cache, iHash, zSql, pCur->nArg,
+                             pCur->apArg);
+  if (pRows == NULL) {
+    rc = sqlexecStartStmt(vtab, pCur, zSql);
+    if (rc == SQLITE_OK)
+      rc = sqlexecRunToRowset(vtab, pCur, &pRows);
+    if (rc == SQLITE_OK && bEmpty)
+      rc = sqlexecCacheStart(vtab);
+    if (rc == SQLITE_OK) {
+      sqlexecRowsetTrim(pRows);
+      rc = sqlexecCacheInsert(&vtab->cache, vtab->opts.nCacheSize, iHash,
+                              zSql, pCur->nArg, pCur->apArg, pRows);
+    }
+    if (rc != SQLITE_OK) {
+      sqlexecRowsetUnref(pRows);
+      return rc;
+    }
+  }
+  pCur->pRows = pRows;
+  return SQLITE_OK;
+}
+
+/*
+** Run the setup statements, if there are any and they haven't run yet in
+** this statement or transaction (see sqlexecStampValid). The statements
+** are prepared the first time they run and kept for the next time, except
+** for an ATTACH, which we only need to run once.
+*/
+static int sqlexecRunSetup(sqlexec_vtab *vtab){
+  if (vtab->nSetup == 0
+      || (vtab->bSetupRun && sqlexecStampValid(vtab, &vtab->setupStamp, 0)))
+    return SQLITE_OK;
+  int rc;
+  vtab->bSetupRun = 0;
+  for (int i = 0; i < vtab->nSetup; i++) {
+    if (vtab->abSetupDone[i])
+      continue;
+    if (vtab->apSetup[i] == NULL) {
+      rc = sqlexecPrepare(vtab, vtab->azSetup[i], SQLITE_PREPARE_PERSISTENT,
+                          &vtab->apSetup[i]);
+      if (rc != SQLITE_OK)
+        return rc;
+    }
+    while ((rc = sqlite3_step(vtab->apSetup[i])) == SQLITE_ROW)
+      ;
+    sqlite3_reset(vtab->apSetup[i]);
+    if (rc != SQLITE_DONE) {
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("Error running setup: %s; "
+                                           "reason: %s", vtab->azSetup[i],
+                                           sqlite3_errmsg(vtab->db));
+      return rc;
+    }
+    vtab->abSetupDone[i] = (char)sqlexecIsAttach(vtab->azSetup[i]);
+  }
+  rc = sqlexecStampSet(vtab, &vtab->setupStamp);
+  if (rc == SQLITE_OK)
+    vtab->bSetupRun = 1;
+  return rc;
+}
+
+/*
+** Pick the SQL a scan runs: vtab->sql, or the rewrite of it in idxStr, or
+** the rewrite to fall back on if an extra value in argv is of the wrong
+** kind for the WHERE clause of the rewrite (see sqlexecPlanWhere and
+** sqlexecPlanRewrite). The extra values start at argv[iArg]. Sets
+** *pbCount if the SQL picked counts the rows rather than returning them.
+*/
+static const char *sqlexecFilterSql(
+  sqlexec_vtab *vtab,
+  const char *idxStr,
+  int iArg, int argc, sqlite3_value **argv,
+  int *pbCount
+){
+  *pbCount = 0;
+  if (idxStr == NULL)
+    return vtab->sql;
+  const char *zFallback = idxStr + strlen(idxStr) + 1;
+  const char *zClass = zFallback + strlen(zFallback) + 1;
+  for (int i = 0; zClass[i] && iArg + i < argc; i++) {
+    int eType = sqlite3_value_type(argv[iArg + i]);
+    if ((zClass[i] == 'n' && eType == SQLITE_TEXT)
+        || (zClass[i] == 't'
+            && (eType == SQLITE_INTEGER || eType == SQLITE_FLOAT)))
+      return zFallback[0] ? zFallback : vtab->sql;
+  }
+  *pbCount = strcmp(zClass + strlen(zClass) + 1, "count") == 0;
+  return idxStr;
+}
+
+/*
+** Names of the write options, for error messages.
+*/
+static const char *const sqlexecWriteName[3] = { "insert", "update", "delete" };
+
+/*
+** Set *pzOut to the SQL of write statement zSql with an OR IGNORE or OR
+** REPLACE clause, as eConflict says, or to NULL if zSql doesn't start with
+** INSERT or UPDATE or already has a clause of its own.
+*/
+static int sqlexecConflictSql(const char *zSql, int eConflict, char **pzOut){
+  const char *z = sqlexecSkipSpace(zSql);
+  *pzOut = NULL;
+  if ((sqlite3_strnicmp(z, "insert", 6) != 0
+       && sqlite3_strnicmp(z, "update", 6) != 0)
+      || isalnum((unsigned char)z[6]) || z[6] == '_')
+    return SQLITE_OK;
+  const char *zNext = sqlexecSkipSpace(z + 6);
+  if (sqlite3_strnicmp(zNext, "or", 2) == 0
+      && !isalnum((unsigned char)zNext[2]) && zNext[2] != '_')
+    return SQLITE_OK;
+  *pzOut = sqlite3_mprintf("%.*s OR %s%s", (int)(z + 6 - zSql), zSql,
+                           eConflict == SQLEXEC_CONFLICT_IGNORE
+                           ? "IGNORE" : "REPLACE", z + 6);
+  return *pzOut == NULL ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+/*
+** Set *ppStmt to the statement making a change of kind eWrite, preparing
+** it the first time it is needed. For an INSERT OR IGNORE or OR REPLACE
+** into the virtual table (eConflict), that is the SQL of the option with
+** the same clause (see sqlexecConflictSql), which otherwise would fail at
+** the first row breaking a constraint, however the change was asked for.
+** Failing ends the transaction whether the clause was OR ABORT, OR FAIL
+** or OR ROLLBACK, as the changes are made when it commits, so those run
+** the SQL as written.
+*/
+static int sqlexecWriteStmt(
+  sqlexec_vtab *vtab,
+  int eWrite, int eConflict,
+  sqlite3_stmt **ppStmt
+){
+  int rc = SQLITE_OK;
+  if (vtab->apWrite[eWrite][eConflict] == NULL) {
+    char *zOr = NULL;
+    if (eConflict != SQLEXEC_CONFLICT_ASIS)
+      rc = sqlexecConflictSql(vtab->azWrite[eWrite], eConflict, &zOr);
+    if (rc == SQLITE_OK)
+      rc = sqlexecPrepare(vtab, zOr ? zOr : vtab->azWrite[eWrite],
+                          SQLITE_PREPARE_PERSISTENT,
+                          &vtab->apWrite[eWrite][eConflict]);
+    sqlite3_free(zOr);
+  }
+  *ppStmt = vtab->apWrite[eWrite][eConflict];
+  return rc;
+}
+
+/*
+** Make the changes xUpdate has buffered in pPending, by running the SQL of
+** the insert, update and delete options for each in turn. Each statement
+** is prepared the first time it is needed and kept for the next time.
+**
+** The parameters of the insert statement are bound to the values of the
+** columns of the new row: ?1 to the first column, and so on. The update
+** statement gets the same, and after them the key of the row it changes,
+** as ?N+1 for a table of N columns. The delete statement gets the key of
+** the row to delete as ?1. Parameters the statement doesn't have are left
+** out, as are the values of columns an UPDATE left unchanged which the
+** update statement doesn't take (see sqlexecFindUpdateCols). The changes
+** are thrown away whether or not they all succeed.
+*/
+static int sqlexecWriteFlush(sqlexec_vtab *vtab){
+  sqlexec_rowset *pRows = vtab->pPending;
+  int rc = SQLITE_OK;
+  if (pRows == NULL)
+    return SQLITE_OK;
+  for (int iRow = 0; iRow < pRows->nRow && rc == SQLITE_OK; iRow++) {
+    int eWrite = (int)pRows->aCell[iRow].i;
+    int eConflict = (int)pRows->aCell[pRows->nRowAlloc + iRow].i;
+    sqlite3_stmt *pStmt;
+    rc = sqlexecWriteStmt(vtab, eWrite, eConflict, &pStmt);
+    if (rc != SQLITE_OK)
+      break;
+    sqlite3_clear_bindings(pStmt);
+    if (eWrite != SQLEXEC_WRITE_DELETE) {
+      for (int i = 0; i < vtab->nCol && rc == SQLITE_OK; i++)
+        rc = sqlexecRowsetBind(pRows, iRow, 3 + i, pStmt, i + 1);
+    }
+    if (rc == SQLITE_OK && eWrite != SQLEXEC_WRITE_INSERT) {
+      rc = sqlexecRowsetBind(pRows, iRow, 2, pStmt,
+                             eWrite == SQLEXEC_WRITE_UPDATE ? vtab->nCol + 1
+                             : 1);
+    }
+    if (rc != SQLITE_OK)
+      break;
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW)
+      ;
+    sqlite3_reset(pStmt);
+    if (rc != SQLITE_DONE) {
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("Error running %s: %s; "
+                                           "reason: %s",
+                                           sqlexecWriteName[eWrite],
+                                           vtab->azWrite[eWrite],
+                                           sqlite3_errmsg(vtab->db));
+      break;
+    }
+    rc = SQLITE_OK;
+  }
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < SQLEXEC_CONFLICT_MODES; j++) {
+      if (vtab->apWrite[i][j] != NULL)
+        sqlite3_clear_bindings(vtab->apWrite[i][j]);
+    }
+  }
+  pRows->nRow = 0;
+  pRows->nHeap = 0;
+  return rc;
+}
+
+/*
+** Sqlite calls this to start a scan. We remember the values of the
+** constrained parameters (the hidden columns need to return them), bind
+** them to the statement and step to the first row. Sqlite may call this
+** more than once on the same cursor, e.g. for the inner loop of a join.
+**
+** With the materialize option, scans which bind no parameters return rows
+** from vtab->pMat, and with the cache option scans return rows from the
+** result cache (see sqlexecCachedRows). Otherwise, with the prefetch option
+** the rows come from the cursor's prefetch worker if it can run the scan,
+** and with the block option the statement is read a block of rows at a
+** time (see sqlexecBlockFill).
+**
+** The setup statements, if any, run before the first scan of a statement
+** or transaction (see sqlexecRunSetup).
+**
+** Changes xUpdate has buffered are made first, so the scan sees them.
+**
+** Statements from the pool may have been prepared before a schema change.
+** sqlite3_step normally re-prepares them itself, but if it gives up with
+** SQLITE_SCHEMA we throw away the pooled statements and try once more with
+** a freshly prepared one.
+*/
+static int sqlexecFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sqlexec_cursor *pCur = (sqlexec_cursor *)pVtabCursor;
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtabCursor->pVtab;
+  int rc;
+
+  sqlexecPrefetchStop(pCur);
+  sqlexecRowsetUnref(pCur->pRows);
+  pCur->pRows = NULL;
+  pCur->iRowBase = 0;
+  pCur->bBlock = 0;
+  pCur->bLimit = vtab->opts.nMaxSteps > 0 || vtab->opts.nTimeout > 0;
+  pCur->iDeadline = vtab->opts.nTimeout > 0
+                  ? sqlexecClock() + vtab->opts.nTimeout * 1000000 : 0;
+  sqlexecStatAdd(vtab, nScan, 1);
+
+  if (vtab->pPending != NULL && vtab->pPending->nRow > 0) {
+    rc = sqlexecWriteFlush(vtab);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+
+  rc = sqlexecRunSetup(vtab);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  int iArg = 0;
+  for (int i = 0; i < vtab->nParam; i++) {
+    sqlite3_value_free(pCur->apArg[i]);
+    pCur->apArg[i] = NULL;
+    if ((idxNum & (1 << i)) && iArg < argc) {
+      pCur->apArg[i] = sqlite3_value_dup(argv[iArg++]);
+      if (pCur->apArg[i] == NULL)
+        return SQLITE_NOMEM;
     }
-    char *decl2 = sqlite3_mprintf("%s%s'%s'%s",
-                                  decl,
-                                  i == 0 ? "" : ",",
-                                  colName,
-                                  i + 1 == colCount ? ")" : "");
-    if (decl2 == NULL) {
-      sqlite3_free(sql);       /* avoid memory leak of SQL text */
-      sqlite3_free(decl);
-      sqlite3_finalize(pStmt); /* avoid memory leak of prepared stmt */
+  }
+
+  /* Values for a rewrite of the SQL follow those of the parameters */
+  int nArg = vtab->nParam + argc - iArg;
+  if (nArg > pCur->nArgAlloc) {
+    sqlite3_value **apArg = sqlite3_realloc64(pCur->apArg,
+                                              nArg * sizeof(*apArg));
+    if (apArg == NULL)
+      return SQLITE_NOMEM;
+    memset(&apArg[pCur->nArgAlloc], 0,
+           (nArg - pCur->nArgAlloc) * sizeof(*apArg));
+    pCur->apArg = apArg;
+    pCur->nArgAlloc = nArg;
+  }
+  for (int i = vtab->nParam; i < pCur->nArgAlloc; i++) {
+    sqlite3_value_free(pCur->apArg[i]);
+    pCur->apArg[i] = NULL;
+  }
+  for (int i = vtab->nParam; i < nArg; i++) {
+    pCur->apArg[i] = sqlite3_value_dup(argv[iArg + i - vtab->nParam]);
+    if (pCur->apArg[i] == NULL)
       return SQLITE_NOMEM;
+  }
+  pCur->nArg = nArg;
+
+  pCur->iRowid = 0;
+  pCur->bEof = 0;
+  pCur->bBound = iArg > 0;
+  pCur->bSubset = (idxNum & SQLEXEC_IDX_SUBSET) != 0;
+  const char *zSql = sqlexecFilterSql(vtab, idxStr, iArg, argc, argv,
+                                      &pCur->bCount);
+  pCur->nCount = -1;
+  /* A count takes one step, so isn't worth caching or a worker */
+  if (!pCur->bCount
+      && ((vtab->opts.bMaterialize && iArg == 0 && idxStr == NULL)
+          || vtab->opts.nCacheSize > 0)) {
+    rc = sqlexecCachedRows(vtab, pCur, zSql, iArg);
+    if (rc != SQLITE_OK) {
+      pCur->bEof = 1;
+      return rc;
     }
-    sqlite3_free(decl);
-    decl = decl2;
+    return sqlexecNext(pVtabCursor);
+  }
+  if (vtab->opts.nPrefetch > 0 && !pCur->bCount) {
+    int bStarted;
+    rc = sqlexecPrefetchStart(vtab, pCur, zSql, &bStarted);
+    if (rc != SQLITE_OK)
+      return rc;
+    if (bStarted)
+      return sqlexecNext(pVtabCursor);
   }
 
-  /*
-  ** Now we have constructed the CREATE TABLE statement we don't need the
-  ** statement handle any more.
-  */
-  rc = sqlite3_finalize(pStmt);
-  if (rc != SQLITE_OK) {
-    if (pzErr)
-      *pzErr = sqlite3_mprintf("sqlexecConnect: sqlite3_finalize failed for: %s\n",
-                               sql);
-   sqlite3_free(decl);
-   return rc;
+  rc = sqlexecStartStmt(vtab, pCur, zSql);
+  if (rc != SQLITE_OK)
+    return rc;
+  pCur->bBlock = vtab->opts.nBlock > 0 && !pCur->bCount;
+  pCur->bBlockDone = 0;
+  rc = sqlexecNext(pVtabCursor);
+  if (rc == SQLITE_SCHEMA) {
+    sqlite3_finalize(pCur->pStmt);
+    pCur->pStmt = NULL;
+    if (pCur->pPool != NULL)
+      pCur->pPool->nRef--;
+    sqlexecPoolClear(vtab);
+    rc = sqlexecStartStmt(vtab, pCur, zSql);
+    if (rc != SQLITE_OK)
+      return rc;
+    rc = sqlexecNext(pVtabCursor);
+  }
+  return rc;
+}
+
+/*
+** Sqlite calls this for an INSERT, UPDATE or DELETE on the virtual table.
+** argv[0] is the key of the row to update or delete, or NULL for an
+** INSERT, and argv[2] onwards are the values of the columns of the new
+** row (see sqlite3_module). Rather than running the SQL for each row as it
+** comes, we buffer the changes in pPending, in the order they were made,
+** and make them at xSync. So a statement writing many rows costs one pass
+** over the prepared statements, and the changes are only made once the
+** statement has succeeded. Inside an explicit transaction, changes are
+** also made before the next scan of the table (see sqlexecFilter), so a
+** query sees the table as it would be after them, and before each
+** savepoint (see sqlexecSavepoint).
+*/
+static int sqlexecUpdate(
+  sqlite3_vtab *pVtab,
+  int argc, sqlite3_value **argv,
+  sqlite_int64 *pRowid
+){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  int eWrite = argc == 1 ? SQLEXEC_WRITE_DELETE
+             : sqlite3_value_type(argv[0]) == SQLITE_NULL ? SQLEXEC_WRITE_INSERT
+             : SQLEXEC_WRITE_UPDATE;
+  if (vtab->azWrite[eWrite] == NULL) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("table %s may not be modified: it "
+                                         "has no %s option", vtab->zName,
+                                         sqlexecWriteName[eWrite]);
+    return SQLITE_ERROR;
+  }
+
+  int eConflict = SQLEXEC_CONFLICT_ASIS;
+  if (eWrite != SQLEXEC_WRITE_DELETE) {
+    switch (sqlite3_vtab_on_conflict(vtab->db)) {
+      case SQLITE_IGNORE:  eConflict = SQLEXEC_CONFLICT_IGNORE;  break;
+      case SQLITE_REPLACE: eConflict = SQLEXEC_CONFLICT_REPLACE; break;
+    }
   }
-  pStmt = NULL;
 
   /*
-  ** Declare columns of this virtual table.
+  ** Each change is a row of the operation, the conflict mode (see
+  ** sqlexecWriteStmt), the key and the new values
   */
-  rc = sqlite3_declare_vtab(db, decl);
-  if (rc != SQLITE_OK) {
-    if (pzErr)
-      *pzErr = sqlite3_mprintf("sqlexecConnect: sqlite3_declare_vtab failed for %s\n",
-                               decl);
-    sqlite3_free(decl);
+  if (vtab->pPending == NULL) {
+    vtab->pPending = sqlexecRowsetNew(vtab->nCol + 3);
+    if (vtab->pPending == NULL)
+      return SQLITE_NOMEM;
+  }
+  sqlexec_rowset *pRows = vtab->pPending;
+  if (pRows->nRow == pRows->nRowAlloc) {
+    int rc = sqlexecRowsetGrow(pRows);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  int iMode = pRows->nRowAlloc + pRows->nRow;
+  pRows->aCell[pRows->nRow].i = eWrite;
+  pRows->anByte[pRows->nRow] = 0;
+  pRows->aType[pRows->nRow] = SQLITE_INTEGER;
+  pRows->aCell[iMode].i = eConflict;
+  pRows->anByte[iMode] = 0;
+  pRows->aType[iMode] = SQLITE_INTEGER;
+  int rc = sqlexecRowsetPut(pRows, 2,
+                            eWrite == SQLEXEC_WRITE_INSERT ? NULL : argv[0]);
+  for (int i = 0; i < vtab->nCol && rc == SQLITE_OK; i++)
+    rc = sqlexecRowsetPut(pRows, 3 + i, argc > 1 ? argv[2 + i] : NULL);
+  if (rc != SQLITE_OK)
     return rc;
+  pRows->nRow++;
+  return SQLITE_OK;
+}
+
+/*
+** Forget the changes xUpdate has buffered and not yet made.
+*/
+static void sqlexecWriteDiscard(sqlexec_vtab *vtab){
+  if (vtab->pPending != NULL) {
+    vtab->pPending->nRow = 0;
+    vtab->pPending->nHeap = 0;
   }
-  sqlite3_free(decl); /* Don't need CREATE TABLE string any more */
-  decl = NULL;
+}
 
-  /*
-  ** Allocate memory for virtual table object.
-  */
-  pNew = sqlite3_malloc( sizeof(*pNew) );
-  if( pNew==0 ) return SQLITE_NOMEM;
-  memset(pNew, 0, sizeof(*pNew));
-  pNew->db = db;
-  pNew->sql = sql;
+/*
+** SQLite only calls the transaction methods below for a table which is
+** written to in the transaction. A transaction writing to the table has
+** started. There is nothing to do until it comes to an end.
+*/
+static int sqlexecBegin(sqlite3_vtab *pVtab){
+  return SQLITE_OK;
+}
 
-  /*
-  ** Return to caller.
-  */
-  *ppVtab = (sqlite3_vtab *) pNew;
+/*
+** The transaction is about to commit: make the changes buffered by
+** xUpdate. If this fails, SQLite rolls back the whole transaction, so
+** the changes made are undone as well.
+*/
+static int sqlexecSync(sqlite3_vtab *pVtab){
+  return sqlexecWriteFlush((sqlexec_vtab *)pVtab);
+}
+
+/*
+** The transaction has ended. Results cached during it may not be right
+** for the next one (with the transaction option, they may leave out the
+** changes it made, and after a rollback they may have rows which are no
+** longer there), so we throw them away along with any changes still
+** buffered.
+*/
+static int sqlexecCommit(sqlite3_vtab *pVtab){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  sqlexecWriteDiscard(vtab);
+  sqlexecCacheFlush(vtab);
+  return SQLITE_OK;
+}
+
+static int sqlexecRollback(sqlite3_vtab *pVtab){
+  return sqlexecCommit(pVtab);
+}
+
+/*
+** A savepoint is being opened, by a SAVEPOINT statement or by SQLite
+** around a statement which may need undoing. We make the changes buffered
+** so far, so they are kept if the savepoint is rolled back, and anything
+** still buffered when it is rolled back came after it.
+*/
+static int sqlexecSavepoint(sqlite3_vtab *pVtab, int iSavepoint){
+  return sqlexecWriteFlush((sqlexec_vtab *)pVtab);
+}
+
+static int sqlexecRelease(sqlite3_vtab *pVtab, int iSavepoint){
+  return SQLITE_OK;
+}
+
+/*
+** The changes made since the savepoint are undone by SQLite, and those
+** still buffered are thrown away.
+*/
+static int sqlexecRollbackTo(sqlite3_vtab *pVtab, int iSavepoint){
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
+  sqlexecWriteDiscard(vtab);
+  sqlexecCacheFlush(vtab);
+  return SQLITE_OK;
+}
+
+/*
+** The schema table of virtual table v, v_schema (see SQLEXEC_SCHEMA_SUFFIX),
+** is its only shadow table.
+*/
+static int sqlexecShadowName(const char *zName){
+  return sqlite3_stricmp(zName, SQLEXEC_SCHEMA_SUFFIX + 1) == 0;
+}
+
+/*
+** Declare interface for sqlexec module.
+*/
+static sqlite3_module sqlexecModule = {
+  3,                      /* iVersion */
+  sqlexecCreate,          /* xCreate */
+  sqlexecConnect,         /* xConnect */
+  sqlexecBestIndex,       /* xBestIndex */
+  sqlexecDisconnect,      /* xDisconnect */
+  sqlexecDestroy,         /* xDestroy */
+  sqlexecOpen,            /* xOpen - open a cursor */
+  sqlexecClose,           /* xClose - close a cursor */
+  sqlexecFilter,          /* xFilter - configure scan constraints */
+  sqlexecNext,            /* xNext - advance a cursor */
+  sqlexecEof,             /* xEof - check for end of scan */
+  sqlexecColumn,          /* xColumn - read data */
+  sqlexecRowid,           /* xRowid - read data */
+  sqlexecUpdate,          /* xUpdate - write data */
+  sqlexecBegin,           /* xBegin */
+  sqlexecSync,            /* xSync */
+  sqlexecCommit,          /* xCommit */
+  sqlexecRollback,        /* xRollback */
+  0,                      /* xFindMethod */
+  sqlexecRename,          /* xRename */
+  sqlexecSavepoint,       /* xSavepoint */
+  sqlexecRelease,         /* xRelease */
+  sqlexecRollbackTo,      /* xRollbackTo */
+  sqlexecShadowName,      /* xShadowName */
+};
+
+/*
+** The sqlexec_tvf table runs SQL given in the query, with no CREATE
+** VIRTUAL TABLE, as a table-valued function:
+**
+** sqlite> select value0, value2 from sqlexec_tvf('pragma index_list(?)', 't');
+**
+** The SQL is its hidden column sql, followed by hidden columns arg1, arg2,
+** etc. for the values of its parameters. Since the columns have to be
+** declared before we know what SQL will be run, they are the generic
+** value0, value1, etc., and those beyond the columns the SQL returns are
+** NULL.
+**
+** It is eponymous-only, so there is one per connection, and it is an
+** sqlexec_vtab with no SQL of its own, nCol of SQLEXEC_TVF_COLUMNS and
+** nParam counting the hidden columns. The pools of the pVariant list are
+** keyed by the text of the SQL, so every query running the same SQL
+** through it shares the prepared statements, and sqlexec_stats reports on
+** it like any other sqlexec table. A PRAGMA with parameters is prepared
+** for each scan, as for sqlexec.
+*/
+#ifndef SQLEXEC_TVF_COLUMNS
+# define SQLEXEC_TVF_COLUMNS 16
+#endif
+#ifndef SQLEXEC_TVF_ARGS
+# define SQLEXEC_TVF_ARGS 8
+#endif
+
+static int sqlexecTvfConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  sqlite3_str *pStr = sqlite3_str_new(db);
+  sqlite3_str_appendall(pStr, "create table x(");
+  for (int i = 0; i < SQLEXEC_TVF_COLUMNS; i++)
+    sqlite3_str_appendf(pStr, "value%d,", i);
+  sqlite3_str_appendall(pStr, "sql hidden");
+  for (int i = 1; i <= SQLEXEC_TVF_ARGS; i++)
+    sqlite3_str_appendf(pStr, ",arg%d hidden", i);
+  sqlite3_str_appendall(pStr, ")");
+  char *decl = sqlite3_str_finish(pStr);
+  if (decl == NULL)
+    return SQLITE_NOMEM;
+  int rc = sqlite3_declare_vtab(db, decl);
+  sqlite3_free(decl);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlexec_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+  if (pNew == NULL)
+    return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->db = db;
+  pNew->nCol = SQLEXEC_TVF_COLUMNS;
+  pNew->nParam = 1 + SQLEXEC_TVF_ARGS;
+  pNew->opts.nRowsHint = -1;
+  pNew->aRowEstimate[0] = pNew->aRowEstimate[1] = -1.0;
+  pNew->zDb = sqlite3_mprintf("%s", argv[1]);
+  pNew->zName = sqlite3_mprintf("%s", argv[2]);
+  if (pNew->zDb == NULL || pNew->zName == NULL) {
+    sqlexecDisconnect((sqlite3_vtab*)pNew);
+    return SQLITE_NOMEM;
+  }
+  sqlexecEnvLink((sqlexec_env*)pAux, pNew);
+  *ppVtab = &pNew->base;
   return SQLITE_OK;
 }
 
 /*
-** Disconnect virtual table. All we need to do is make sure that memory for
-** virtual table object is deallocated.
+** The sql column must be constrained, and the arguments are taken from
+** whichever of the argN columns are. idxNum has bit 0 set for sql and bit
+** N for argN. A plan which can't use the value of one of them, as when a
+** join puts the table outside the loop its arguments come from, is turned
+** down. The rows of every scan come from different SQL, so there is
+** nothing to learn a row estimate from.
 */
-static int sqlexecDisconnect(sqlite3_vtab *pVtab){
-  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtab;
-  sqlite3_free(vtab->sql);
-  sqlite3_free(vtab);
+static int sqlexecTvfBestIndex(
+  sqlite3_vtab *tab,
+  sqlite3_index_info *pIdxInfo
+){
+  sqlexec_vtab *vtab = (sqlexec_vtab*)tab;
+  int aConstraint[1 + SQLEXEC_TVF_ARGS];
+  int idxNum = 0;
+  int nArg = 0;
+
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *p = &pIdxInfo->aConstraint[i];
+    int iParam = p->iColumn - vtab->nCol;
+    if (iParam < 0 || p->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    if (!p->usable)
+      return SQLITE_CONSTRAINT;
+    if (idxNum & (1 << iParam))
+      continue;
+    idxNum |= 1 << iParam;
+    aConstraint[iParam] = i;
+  }
+  if ((idxNum & 1) == 0)
+    return SQLITE_CONSTRAINT; /* No SQL to run */
+  for (int iParam = 0; iParam < vtab->nParam; iParam++) {
+    if (idxNum & (1 << iParam)) {
+      struct sqlite3_index_constraint_usage *pUsage =
+        &pIdxInfo->aConstraintUsage[aConstraint[iParam]];
+      pUsage->argvIndex = ++nArg;
+      pUsage->omit = 1;
+    }
+  }
+  pIdxInfo->idxNum = idxNum;
+  pIdxInfo->estimatedRows = 100;
+  pIdxInfo->estimatedCost = (double)100;
   return SQLITE_OK;
 }
 
 /*
-** Opens a cursor on our virtual table. We need to prepare the underlying
-** SQL and stash the statement handle into our cursor.
+** Returns true if pStmt, prepared from zSql, covers all of it: there is
+** nothing after its end but spaces, comments and semicolons. SQLite keeps
+** the text of the statement up to where it ended, so that points us at
+** whatever SQLite left unprepared.
 */
-static int sqlexecOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
-  sqlexec_vtab *vtab = (sqlexec_vtab*)p;
-  sqlite3 *db = vtab->db;
-
-  /*
-  ** Allocate memory for cursor object.
-  */
-  sqlexec_cursor *pCur;
-  pCur = sqlite3_malloc( sizeof(*pCur) );
-  if( pCur==0 ) return SQLITE_NOMEM;
-  memset(pCur, 0, sizeof(*pCur));
-
-  /*
-  ** Prepare the SQL statement.
-  */
-  int rc = sqlite3_prepare_v2(db, vtab->sql, -1, &pCur->pStmt, NULL);
-  if (rc != SQLITE_OK) {
-    vtab->base.zErrMsg = sqlite3_mprintf("Error preparing: %s; reason: %s",
-                                         vtab->sql, sqlite3_errmsg(db));
-    sqlite3_free(pCur); /* don't leak memory */
-    return rc;
-  }
+static int sqlexecStmtIsAll(sqlite3_stmt *pStmt, const char *zSql){
+  const char *z = sqlexecSkipSpace(zSql + strlen(sqlite3_sql(pStmt)));
+  while (*z == ';')
+    z = sqlexecSkipSpace(z + 1);
+  return *z == 0;
+}
 
-  /*
-  ** Success: provide cursor object to caller and return SQLITE_OK.
-  */
-  *ppCursor = &pCur->base;
-  return SQLITE_OK;
+/*
+** Leave the error for SQL given to sqlexec_tvf which holds more than one
+** statement, and return SQLITE_ERROR.
+*/
+static int sqlexecTvfNotOne(sqlexec_vtab *vtab, const char *zSql){
+  sqlite3_free(vtab->base.zErrMsg);
+  vtab->base.zErrMsg = sqlite3_mprintf("sqlexec_tvf: more than one "
+                                       "statement in: %s", zSql);
+  return SQLITE_ERROR;
 }
 
 /*
-** Close the cursor. We have to finalize the underlying statement handle
-** and deallocate memory.
+** Get the cursor a statement for zSql with the arguments bound, from the
+** pool for zSql, or prepared for this scan if it is a PRAGMA with
+** parameters. zSql must be a single statement.
 */
-static int sqlexecClose(sqlite3_vtab_cursor *cur){
-  sqlexec_cursor *pCur = (sqlexec_cursor *)cur;
-  int rc = SQLITE_OK;
-  if (pCur->pStmt != NULL) {
-    rc = sqlite3_finalize(pCur->pStmt);
-    pCur->pStmt = NULL;
+static int sqlexecTvfStartStmt(
+  sqlexec_vtab *vtab,
+  sqlexec_cursor *pCur,
+  const char *zSql
+){
+  sqlite3_value **apArg = pCur->apArg + 1;
+  int rc;
+  if (sqlexecIsPragma(zSql)) {
+    sqlexec_subst *aSubst;
+    int nSubst;
+    char **azName;
+    int nParam;
+    rc = sqlexecScanPragmaParams(zSql, &aSubst, &nSubst, &azName, &nParam);
+    if (rc == SQLITE_OK) {
+      for (int i = 0; i < nParam; i++)
+        sqlite3_free(azName[i]);
+      sqlite3_free(azName);
+    }
+    if (rc == SQLITE_RANGE || nParam > SQLEXEC_TVF_ARGS) {
+      sqlite3_free(aSubst);
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("sqlexec_tvf: too many parameters"
+                                           " in: %s", zSql);
+      return SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK)
+      return rc;
+    if (nSubst > 0) {
+      char *sql = sqlexecExpandPragma(zSql, aSubst, nSubst, apArg);
+      sqlite3_free(aSubst);
+      if (sql == NULL)
+        return SQLITE_NOMEM;
+      if (pCur->pStmt != NULL) {
+        sqlexecStmtCheckin(pCur->pPool, pCur->pStmt);
+        pCur->pStmt = NULL;
+      }
+      pCur->pPool = NULL;
+      rc = sqlexecPrepare(vtab, sql, 0, &pCur->pStmt);
+      if (rc == SQLITE_OK && pCur->pStmt != NULL
+          && !sqlexecStmtIsAll(pCur->pStmt, sql))
+        rc = sqlexecTvfNotOne(vtab, zSql);
+      sqlite3_free(sql);
+      return rc;
+    }
   }
-  sqlite3_free(pCur);
-  return rc;
+
+  sqlexec_pool *pPool;
+  rc = sqlexecVariantPool(vtab, zSql, &pPool);
+  if (rc == SQLITE_OK)
+    rc = sqlexecCursorStmt(vtab, pCur, pPool);
+  if (rc != SQLITE_OK)
+    return rc;
+  int nCol = sqlite3_column_count(pCur->pStmt);
+  if (nCol == 0 || nCol > vtab->nCol) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = nCol == 0
+      ? sqlite3_mprintf("SQL statement returns no data: %s", zSql)
+      : sqlite3_mprintf("sqlexec_tvf: more than %d columns in: %s",
+                        vtab->nCol, zSql);
+    return SQLITE_ERROR;
+  }
+  if (!sqlexecStmtIsAll(pCur->pStmt, zSql))
+    return sqlexecTvfNotOne(vtab, zSql);
+  return sqlexecBindArgs(pCur->pStmt, vtab->nParam - 1, apArg);
 }
 
 /*
-** Advance to next row.
+** Start a scan: sqlexecFilter without the options, and with the SQL taken
+** from the first hidden column.
 */
-static int sqlexecNext(sqlite3_vtab_cursor *cur){
-  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
+static int sqlexecTvfFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sqlexec_cursor *pCur = (sqlexec_cursor *)pVtabCursor;
+  sqlexec_vtab *vtab = (sqlexec_vtab *)pVtabCursor->pVtab;
+  int rc;
 
-  /*
-  ** If statement handle is NULL, that indicates we are at end of data,
-  ** don't advance any further.
-  */
-  if (pCur->pStmt == NULL)
-    return SQLITE_OK;
+  sqlexecStatAdd(vtab, nScan, 1);
+  int iArg = 0;
+  for (int i = 0; i < vtab->nParam; i++) {
+    sqlite3_value_free(pCur->apArg[i]);
+    pCur->apArg[i] = NULL;
+    if ((idxNum & (1 << i)) && iArg < argc) {
+      pCur->apArg[i] = sqlite3_value_dup(argv[iArg++]);
+      if (pCur->apArg[i] == NULL)
+        return SQLITE_NOMEM;
+    }
+  }
+  pCur->iRowid = 0;
+  pCur->bEof = 1;
+  pCur->bBound = 1;
+  pCur->bSubset = 1;
 
-  /*
-  ** Advance underlying statement handle.
-  */
-  int rc = sqlite3_step(pCur->pStmt);
-  if (rc == SQLITE_DONE) { /* Handle end of data */
-    rc = sqlite3_finalize(pCur->pStmt);
+  const char *zSql = (const char*)sqlite3_value_text(pCur->apArg[0]);
+  if (zSql == NULL) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("sqlexec_tvf: no SQL to run");
+    return SQLITE_ERROR;
+  }
+  rc = sqlexecTvfStartStmt(vtab, pCur, zSql);
+  if (rc != SQLITE_OK)
+    return rc;
+  pCur->bEof = 0;
+  rc = sqlexecNext(pVtabCursor);
+  if (rc == SQLITE_SCHEMA) {
+    /* As in sqlexecFilter */
+    sqlite3_finalize(pCur->pStmt);
+    pCur->pStmt = NULL;
+    if (pCur->pPool != NULL)
+      pCur->pPool->nRef--;
+    sqlexecPoolClear(vtab);
+    pCur->bEof = 1;
+    rc = sqlexecTvfStartStmt(vtab, pCur, zSql);
     if (rc != SQLITE_OK)
       return rc;
-    pCur->pStmt = NULL;
-    return SQLITE_OK;
-  }
-  if (rc == SQLITE_ROW) { /* Handle a row */
-    pCur->iRowid++;
-    return SQLITE_OK;
+    pCur->bEof = 0;
+    rc = sqlexecNext(pVtabCursor);
   }
-  return rc; /* Anything else means an error, just return the error */
+  return rc;
 }
 
 /*
-** Purpose of this method is to determine if we are at EOF.
-** We use NULL statement handle as a marker for EOF.
+** Columns beyond those of the SQL are NULL.
 */
-static int sqlexecEof(sqlite3_vtab_cursor *cur){
+static int sqlexecTvfColumn(
+  sqlite3_vtab_cursor *cur,
+  sqlite3_context *ctx,
+  int i
+){
   sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
-  return pCur->pStmt == NULL;
+  if (i < SQLEXEC_TVF_COLUMNS && i >= sqlite3_column_count(pCur->pStmt))
+    return SQLITE_OK;
+  return sqlexecColumn(cur, ctx, i);
 }
 
+static sqlite3_module sqlexecTvfModule = {
+  0,                      /* iVersion */
+  0,                      /* xCreate - eponymous-only */
+  sqlexecTvfConnect,      /* xConnect */
+  sqlexecTvfBestIndex,    /* xBestIndex */
+  sqlexecDisconnect,      /* xDisconnect */
+  0,                      /* xDestroy */
+  sqlexecOpen,            /* xOpen - open a cursor */
+  sqlexecClose,           /* xClose - close a cursor */
+  sqlexecTvfFilter,       /* xFilter - configure scan constraints */
+  sqlexecNext,            /* xNext - advance a cursor */
+  sqlexecEof,             /* xEof - check for end of scan */
+  sqlexecTvfColumn,       /* xColumn - read data */
+  sqlexecRowid,           /* xRowid - read data */
+  0,                      /* xUpdate */
+  0,                      /* xBegin */
+  0,                      /* xSync */
+  0,                      /* xCommit */
+  0,                      /* xRollback */
+  0,                      /* xFindMethod */
+  0,                      /* xRename */
+};
+
 /*
-** Return value for a specific column of the current row. We just delegate
-** to the underlying statement handle.
+** The sqlexec_cache table reports on the result cache of every sqlexec
+** virtual table of the connection, for example:
+**
+** sqlite> select name, entries, hits, misses from sqlexec_cache;
+**
+** It is an eponymous-only virtual table, so there is no need to create it.
+** Its cursor just walks the list of virtual tables in sqlexec_env.
 */
-static int sqlexecColumn(
+typedef struct sqlexec_cache_vtab sqlexec_cache_vtab;
+struct sqlexec_cache_vtab {
+  sqlite3_vtab base;
+  sqlexec_env *pEnv;
+};
+
+typedef struct sqlexec_cache_cursor sqlexec_cache_cursor;
+struct sqlexec_cache_cursor {
+  sqlite3_vtab_cursor base;
+  sqlexec_vtab *pCurrent;     /* Virtual table for current row */
+  sqlite3_int64 iRowid;
+};
+
+static int sqlexecCacheConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  int rc = sqlite3_declare_vtab(db,
+      "create table x(db, name, entries, bytes, budget, hits, misses)");
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlexec_cache_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+  if (pNew == NULL)
+    return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->pEnv = (sqlexec_env*)pAux;
+  *ppVtab = &pNew->base;
+  return SQLITE_OK;
+}
+
+static int sqlexecCacheDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int sqlexecCacheOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  sqlexec_cache_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == NULL)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int sqlexecCacheClose(sqlite3_vtab_cursor *cur){
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+static int sqlexecCacheNext(sqlite3_vtab_cursor *cur){
+  sqlexec_cache_cursor *pCur = (sqlexec_cache_cursor*)cur;
+  pCur->pCurrent = pCur->pCurrent->pNext;
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+static int sqlexecCacheEof(sqlite3_vtab_cursor *cur){
+  return ((sqlexec_cache_cursor*)cur)->pCurrent == NULL;
+}
+
+static int sqlexecCacheColumn(
   sqlite3_vtab_cursor *cur,
   sqlite3_context *ctx,
   int i
 ){
-  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
-  sqlite3_value *val = sqlite3_column_value(pCur->pStmt, i);
-  sqlite3_result_value(ctx, val);
+  sqlexec_vtab *vtab = ((sqlexec_cache_cursor*)cur)->pCurrent;
+  switch (i) {
+    case 0: sqlite3_result_text(ctx, vtab->zDb, -1, SQLITE_TRANSIENT); break;
+    case 1: sqlite3_result_text(ctx, vtab->zName, -1, SQLITE_TRANSIENT); break;
+    case 2: sqlite3_result_int(ctx, vtab->cache.nEntry); break;
+    case 3: sqlite3_result_int64(ctx, vtab->cache.nByte); break;
+    case 4: sqlite3_result_int64(ctx, vtab->opts.nCacheSize); break;
+    case 5: sqlite3_result_int64(ctx, vtab->cache.nHit); break;
+    case 6: sqlite3_result_int64(ctx, vtab->cache.nMiss); break;
+  }
   return SQLITE_OK;
 }
 
-/*
-** Return row identifier for current row. We just use an incrementing counter
-** stored in the cursor.
-*/
-static int sqlexecRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
-  sqlexec_cursor *pCur = (sqlexec_cursor*)cur;
-  *pRowid = pCur->iRowid;
+static int sqlexecCacheRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  *pRowid = ((sqlexec_cache_cursor*)cur)->iRowid;
   return SQLITE_OK;
 }
 
-/*
-** Sqlite calls this to find the best index to use. However, since we don't
-** support any indices, just return a dummy result.
-*/
-static int sqlexecBestIndex(
+static int sqlexecCacheBestIndex(
   sqlite3_vtab *tab,
   sqlite3_index_info *pIdxInfo
 ){
-  pIdxInfo->estimatedCost = (double)2147483647;
-  pIdxInfo->estimatedRows = 2147483647;
-  pIdxInfo->idxNum = 0;
+  pIdxInfo->estimatedCost = (double)100;
+  pIdxInfo->estimatedRows = 100;
   return SQLITE_OK;
 }
 
-/*
-** Sqlite calls this to filter the data with a given index. But, we don't
-** implement any indices, so we just provide a dummy implementation here.
-*/
-static int sqlexecFilter(
+static int sqlexecCacheFilter(
   sqlite3_vtab_cursor *pVtabCursor,
   int idxNum, const char *idxStr,
   int argc, sqlite3_value **argv
 ){
-  sqlexec_cursor *pCur = (sqlexec_cursor *)pVtabCursor;
-  if( idxNum ){
-    return SQLITE_INTERNAL;
-  }
-  return sqlexecNext(pVtabCursor);
+  sqlexec_cache_cursor *pCur = (sqlexec_cache_cursor*)pVtabCursor;
+  pCur->pCurrent = ((sqlexec_cache_vtab*)pVtabCursor->pVtab)->pEnv->pFirst;
+  pCur->iRowid = 1;
+  return SQLITE_OK;
 }
 
+static sqlite3_module sqlexecCacheModule = {
+  0,                      /* iVersion */
+  0,                      /* xCreate - eponymous-only */
+  sqlexecCacheConnect,    /* xConnect */
+  sqlexecCacheBestIndex,  /* xBestIndex */
+  sqlexecCacheDisconnect, /* xDisconnect */
+  0,                      /* xDestroy */
+  sqlexecCacheOpen,       /* xOpen - open a cursor */
+  sqlexecCacheClose,      /* xClose - close a cursor */
+  sqlexecCacheFilter,     /* xFilter - configure scan constraints */
+  sqlexecCacheNext,       /* xNext - advance a cursor */
+  sqlexecCacheEof,        /* xEof - check for end of scan */
+  sqlexecCacheColumn,     /* xColumn - read data */
+  sqlexecCacheRowid,      /* xRowid - read data */
+  0,                      /* xUpdate */
+  0,                      /* xBegin */
+  0,                      /* xSync */
+  0,                      /* xCommit */
+  0,                      /* xRollback */
+  0,                      /* xFindMethod */
+  0,                      /* xRename */
+};
+
+#ifndef SQLEXEC_OMIT_STATS
 /*
-** Declare interface for sqlexec module.
+** The sqlexec_stats table reports the counters of every sqlexec virtual
+** table of the connection (see sqlexec_stats), for example:
+**
+** sqlite> select name, rows, step_ns from sqlexec_stats order by step_ns desc;
+**
+** step_ns is the total time of all the steps, estimated from those timed
+** (see SQLEXEC_STATS_SAMPLE). The histogram column is a JSON array of the
+** counts of timed steps in each bucket of step times (see
+** SQLEXEC_STATS_BUCKETS), from the fastest up to the slowest non-empty
+** bucket. Like sqlexec_cache it is eponymous-only, and it shares the
+** cursor of sqlexec_cache.
 */
-static sqlite3_module sqlexecModule = {
+static int sqlexecStatsConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  int rc = sqlite3_declare_vtab(db,
+      "create table x(db, name, cursors, allocs, scans, stops, prepares,"
+      " pool_hits, rows, bytes, steps, timed_steps, step_ns, max_step_ns,"
+      " histogram)");
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlexec_cache_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+  if (pNew == NULL)
+    return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->pEnv = (sqlexec_env*)pAux;
+  *ppVtab = &pNew->base;
+  return SQLITE_OK;
+}
+
+/*
+** Return the histogram column of sqlexec_stats for pStats.
+*/
+static void sqlexecStatsHistogram(
+  sqlite3_context *ctx,
+  const sqlexec_stats *pStats
+){
+  int n = SQLEXEC_STATS_BUCKETS;
+  while (n > 0 && pStats->anHist[n-1] == 0)
+    n--;
+  sqlite3_str *pStr = sqlite3_str_new(sqlite3_context_db_handle(ctx));
+  sqlite3_str_appendchar(pStr, 1, '[');
+  for (int i = 0; i < n; i++)
+    sqlite3_str_appendf(pStr, "%s%lld", i ? "," : "", pStats->anHist[i]);
+  sqlite3_str_appendchar(pStr, 1, ']');
+  int rc = sqlite3_str_errcode(pStr);
+  char *zHist = sqlite3_str_finish(pStr);
+  if (rc != SQLITE_OK)
+    sqlite3_result_error_code(ctx, rc);
+  else
+    sqlite3_result_text(ctx, zHist, -1, sqlite3_free);
+  if (rc != SQLITE_OK)
+    sqlite3_free(zHist);
+}
+
+static int sqlexecStatsColumn(
+  sqlite3_vtab_cursor *cur,
+  sqlite3_context *ctx,
+  int i
+){
+  sqlexec_vtab *vtab = ((sqlexec_cache_cursor*)cur)->pCurrent;
+  const sqlexec_stats *pStats = &vtab->stats;
+  switch (i) {
+    case 0: sqlite3_result_text(ctx, vtab->zDb, -1, SQLITE_TRANSIENT); break;
+    case 1: sqlite3_result_text(ctx, vtab->zName, -1, SQLITE_TRANSIENT); break;
+    case 2: sqlite3_result_int64(ctx, pStats->nCursor); break;
+    case 3: sqlite3_result_int64(ctx, pStats->nAlloc); break;
+    case 4: sqlite3_result_int64(ctx, pStats->nScan); break;
+    case 5: sqlite3_result_int64(ctx, pStats->nStop); break;
+    case 6: sqlite3_result_int64(ctx, pStats->nPrepare); break;
+    case 7: sqlite3_result_int64(ctx, pStats->nPoolHit); break;
+    case 8: sqlite3_result_int64(ctx, pStats->nRow); break;
+    case 9: sqlite3_result_int64(ctx, pStats->nByte); break;
+    case 10: sqlite3_result_int64(ctx, pStats->nStep); break;
+    case 11: sqlite3_result_int64(ctx, pStats->nTimed); break;
+    case 12:
+      /* Estimated from the steps timed */
+      sqlite3_result_int64(ctx, pStats->nTimed == 0 ? 0
+          : (sqlite3_int64)((double)pStats->nStepTime * pStats->nStep
+                            / pStats->nTimed));
+      break;
+    case 13: sqlite3_result_int64(ctx, pStats->nStepMax); break;
+    case 14: sqlexecStatsHistogram(ctx, pStats); break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module sqlexecStatsModule = {
   0,                      /* iVersion */
-  sqlexecConnect,         /* xCreate */
-  sqlexecConnect,         /* xConnect */
-  sqlexecBestIndex,       /* xBestIndex */
-  sqlexecDisconnect,      /* xDisconnect */
-  sqlexecDisconnect,      /* xDestroy */
-  sqlexecOpen,            /* xOpen - open a cursor */
-  sqlexecClose,           /* xClose - close a cursor */
-  sqlexecFilter,          /* xFilter - configure scan constraints */
-  sqlexecNext,            /* xNext - advance a cursor */
-  sqlexecEof,             /* xEof - check for end of scan */
-  sqlexecColumn,          /* xColumn - read data */
-  sqlexecRowid,           /* xRowid - read data */
+  0,                      /* xCreate - eponymous-only */
+  sqlexecStatsConnect,    /* xConnect */
+  sqlexecCacheBestIndex,  /* xBestIndex */
+  sqlexecCacheDisconnect, /* xDisconnect */
+  0,                      /* xDestroy */
+  sqlexecCacheOpen,       /* xOpen - open a cursor */
+  sqlexecCacheClose,      /* xClose - close a cursor */
+  sqlexecCacheFilter,     /* xFilter - configure scan constraints */
+  sqlexecCacheNext,       /* xNext - advance a cursor */
+  sqlexecCacheEof,        /* xEof - check for end of scan */
+  sqlexecStatsColumn,     /* xColumn - read data */
+  sqlexecCacheRowid,      /* xRowid - read data */
   0,                      /* xUpdate */
   0,                      /* xBegin */
   0,                      /* xSync */
@@ -404,10 +7343,87 @@ static sqlite3_module sqlexecModule = {
   0,                      /* xFindMethod */
   0,                      /* xRename */
 };
+#endif /* SQLEXEC_OMIT_STATS */
+
+/*
+** Destructor for the sqlexec_env shared by our modules, called by sqlite as
+** each module is dropped. The last one frees it.
+*/
+static void sqlexecEnvUnref(void *p){
+  sqlexec_env *pEnv = (sqlexec_env*)p;
+  if (--pEnv->nRef == 0) {
+    sqlexecEnvUnregister(pEnv);
+    sqlite3_free(pEnv);
+  }
+}
+
+/*
+** Returns the env of our modules on connection db, or NULL if it has none.
+*/
+static sqlexec_env *sqlexecEnvFind(sqlite3 *db){
+#ifndef SQLITE_CORE
+  if (sqlite3_api == NULL)
+    return NULL; /* Never loaded, so no connection has them */
+#endif
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  sqlexec_env *pEnv = sqlexecEnvList;
+  while (pEnv != NULL && pEnv->db != db)
+    pEnv = pEnv->pNextEnv;
+  sqlite3_mutex_leave(pMutex);
+  return pEnv;
+}
+
+/*
+** Have the prefetch workers of connection db write to fd each time they
+** have rows ready or finish, so that an event loop can wait on it rather
+** than a step waiting for them (see sqlexec_would_block). A fd of -1 stops
+** this. Returns SQLITE_MISUSE if db has not declared our modules.
+*/
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlexec_notify_fd(sqlite3 *db, int fd){
+  sqlexec_env *pEnv = sqlexecEnvFind(db);
+  if (pEnv == NULL)
+    return SQLITE_MISUSE;
+#ifndef SQLEXEC_OMIT_PREFETCH
+  atomic_store(&pEnv->fdNotify, fd < 0 ? -1 : fd);
+#endif
+  return SQLITE_OK;
+}
+
+/*
+** Returns 1 if stepping a statement of connection db now could wait for a
+** prefetch worker: some cursor has been through the rows it was given and
+** its workers have none ready and are still running. Otherwise 0.
+*/
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlexec_would_block(sqlite3 *db){
+#ifndef SQLEXEC_OMIT_PREFETCH
+  sqlexec_env *pEnv = sqlexecEnvFind(db);
+  if (pEnv == NULL)
+    return 0;
+  for (sqlexec_merge *pMerge = pEnv->pMerge; pMerge != NULL;
+       pMerge = pMerge->pNextMerge) {
+    sqlexec_cursor *pCur = pMerge->pCur;
+    if (!pCur->bFetching || pCur->bEof)
+      continue;
+    if (pCur->pRows != NULL
+        && pCur->iRowid - pCur->iRowBase < pCur->pRows->nRow)
+      continue;
+    if (sqlexecMergeBusy(pMerge))
+      return 1;
+  }
+#endif
+  return 0;
+}
 
 /*
 ** Called when our extension is loaded. We just declare our virtual table
-** module.
+** modules.
 */
 #ifdef _WIN32
 __declspec(dllexport)
@@ -419,7 +7435,38 @@ int sqlite3_sqlexec_init(
 ){
   int rc = SQLITE_OK;
   SQLITE_EXTENSION_INIT2(pApi);
-  rc = sqlite3_create_module(db, "sqlexec", &sqlexecModule, 0);
+  sqlexec_env *pEnv = sqlite3_malloc(sizeof(*pEnv));
+  if (pEnv == NULL)
+    return SQLITE_NOMEM;
+  memset(pEnv, 0, sizeof(*pEnv));
+  pEnv->db = db;
+#ifndef SQLEXEC_OMIT_PREFETCH
+  atomic_init(&pEnv->fdNotify, -1);
+#endif
+  sqlexecEnvRegister(pEnv);
+  pEnv->nRef = 3;
+#ifndef SQLEXEC_OMIT_STATS
+  pEnv->nRef++;
+#endif
+  rc = sqlite3_create_module_v2(db, "sqlexec", &sqlexecModule, pEnv,
+                                sqlexecEnvUnref);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_module_v2(db, "sqlexec_cache", &sqlexecCacheModule,
+                                  pEnv, sqlexecEnvUnref);
+  else
+    sqlexecEnvUnref(pEnv); /* the destructor is called if create fails */
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_module_v2(db, "sqlexec_tvf", &sqlexecTvfModule,
+                                  pEnv, sqlexecEnvUnref);
+  else
+    sqlexecEnvUnref(pEnv);
+#ifndef SQLEXEC_OMIT_STATS
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_module_v2(db, "sqlexec_stats", &sqlexecStatsModule,
+                                  pEnv, sqlexecEnvUnref);
+  else
+    sqlexecEnvUnref(pEnv);
+#endif
   if (rc != SQLITE_OK) {
       if (pzErrMsg)
         *pzErrMsg = sqlite3_mprintf("%s", "Error declaring module - maybe you are loading this extension twice?");
@@ -428,4 +7475,14 @@ int sqlite3_sqlexec_init(
   return rc;
 }
 
+#ifdef SQLITE_CORE
+/*
+** When the extension is linked into the program, have every connection
+** declare our modules as it opens, with no library to find and load.
+*/
+int sqlexec_register_auto(void){
+  return sqlite3_auto_extension((void(*)(void))sqlite3_sqlexec_init);
+}
+#endif
+
 /* vim: tabstop=8 expandtab shiftwidth=2 softtabstop=2 cc=80 */
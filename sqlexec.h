@@ -0,0 +1,52 @@
+/*
+** Interface to the SQLEXEC extension for programs which link it in rather
+** than loading it with sqlite3_load_extension. Build the library with
+** SQLITE_CORE defined (the static target of the makefiles does this).
+*/
+#ifndef SQLEXEC_H
+#define SQLEXEC_H
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Declare the sqlexec modules on connection db. This is the entry point
+** sqlite3_load_extension calls.
+*/
+int sqlite3_sqlexec_init(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+);
+
+/*
+** Make every connection opened from now on declare the sqlexec modules,
+** with sqlite3_auto_extension. Returns an SQLite result code.
+*/
+int sqlexec_register_auto(void);
+
+/*
+** Have the prefetch workers of connection db write an 8 byte count to fd,
+** an eventfd or the write end of a pipe, whenever they have more rows or
+** finish. The descriptor should be non-blocking; -1 stops the writes. Only
+** change or close it while no statement of db is being stepped. Returns
+** SQLITE_MISUSE if db has not declared the sqlexec modules.
+*/
+int sqlexec_notify_fd(sqlite3 *db, int fd);
+
+/*
+** Returns 1 if the next sqlite3_step of a statement of db could wait for
+** prefetch workers, so an event loop should wait for the descriptor of
+** sqlexec_notify_fd to become readable first. Call it from the thread
+** using db, between steps.
+*/
+int sqlexec_would_block(sqlite3 *db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SQLEXEC_H */